@@ -0,0 +1,2413 @@
+// https://github.com/unxed/xkb2win
+// License: CC0-1.0 license
+
+// Headless benchmarks for xkb2win translation code.
+// Every benchmark first checks that optimized code gives the same results
+// as reference implementation, and only then measures it.
+// Usage: xkb2win_bench [--check] [benchmark name...]; runs all benchmarks if no names given.
+// --check: only check results, without measuring (that is what "./build.sh test" runs)
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../xkb2win.c"
+#include "../win32_input_decoder.c"
+#include "../x11_session.c"
+#include "../key_overrides.c"
+#include "../key_ring.c"
+#include "../key_trace.c"
+#include "../x11_event_loop.c"
+#include "reference.c"
+
+// Keep results alive so compiler can not throw benchmarked code away
+static volatile unsigned int sink;
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Highest KeySym value measured. Covers both translated blocks,
+// everything between them and some space above.
+#define BENCH_KEYSYM_MAX 0x1FFFF
+
+// Highest KeySym value checked: whole 29-bit KeySym space, Unicode KeySyms included
+#define BENCH_KEYSYM_CHECK_MAX 0x1FFFFFFF
+
+static void bench_lookup_shuffle(int *codes, int count)
+{
+	for (int i = count - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		int t = codes[i]; codes[i] = codes[j]; codes[j] = t;
+	}
+}
+
+// Benchmarks are repeated and best result is taken, to filter out scheduler noise
+#define BENCH_REPEATS 5
+
+// Set to 0 by --check
+static int bench_repeats = BENCH_REPEATS;
+
+static void bench_lookup_run(const char *what, const int *codes, int count)
+{
+	// Same total number of lookups for any count
+	const int rounds = 1 + (40 * (BENCH_KEYSYM_MAX + 1)) / count;
+	const double lookups = (double)rounds * count;
+	double switch_ns = 1e9, table_ns = 1e9;
+	unsigned int acc = 0;
+
+	for (int repeat = 0; repeat < bench_repeats; repeat++) {
+		double start = now_ns();
+		for (int r = 0; r < rounds; r++) {
+			for (int i = 0; i < count; i++) {
+				unsigned char *ref = xkb_to_winkey_reference(codes[i]);
+				acc += ref[0] + ref[1] + ref[2];
+			}
+		}
+		double elapsed = (now_ns() - start) / lookups;
+		if (elapsed < switch_ns) { switch_ns = elapsed; }
+
+		start = now_ns();
+		for (int r = 0; r < rounds; r++) {
+			for (int i = 0; i < count; i++) {
+				struct winkey key = xkb_to_winkey(codes[i]);
+				acc += key.vk + key.scan + key.enhanced;
+			}
+		}
+		elapsed = (now_ns() - start) / lookups;
+		if (elapsed < table_ns) { table_ns = elapsed; }
+	}
+
+	sink = acc;
+	printf("lookup, %s: switch %.2f ns/lookup, table %.2f ns/lookup (x%.1f)\n",
+		what, switch_ns, table_ns, switch_ns / table_ns);
+}
+
+// Latency of single lookup: input is small enough to stay in L1 cache, and each lookup
+// depends on result of previous one, so neither input loads nor out-of-order execution
+// of independent lookups hide it. That is how keyboard input comes: one key at a time.
+// Next KeySym is also picked with random generator, so branch predictor can not learn the walk
+#define BENCH_LOOKUP_CHAIN 1024
+
+static void bench_lookup_chain(const char *what, const int *codes, int count)
+{
+	int chain[BENCH_LOOKUP_CHAIN];
+	for (int i = 0; i < BENCH_LOOKUP_CHAIN; i++) { chain[i] = codes[rand() % count]; }
+	const int lookups = 40 * (BENCH_KEYSYM_MAX + 1);
+	double switch_ns = 1e9, table_ns = 1e9;
+	unsigned int acc = 0;
+
+	for (int repeat = 0; repeat < bench_repeats; repeat++) {
+		unsigned int i = 0, seed = 1;
+		double start = now_ns();
+		for (int n = 0; n < lookups; n++) {
+			unsigned char *ref = xkb_to_winkey_reference(chain[i]);
+			seed = seed * 1103515245 + 12345;
+			i = ((seed >> 16) + ref[0] + ref[1] + ref[2]) & (BENCH_LOOKUP_CHAIN - 1);
+		}
+		double elapsed = (now_ns() - start) / lookups;
+		if (elapsed < switch_ns) { switch_ns = elapsed; }
+		acc += i;
+
+		i = 0;
+		seed = 1;
+		start = now_ns();
+		for (int n = 0; n < lookups; n++) {
+			struct winkey key = xkb_to_winkey(chain[i]);
+			seed = seed * 1103515245 + 12345;
+			i = ((seed >> 16) + key.vk + key.scan + key.enhanced) & (BENCH_LOOKUP_CHAIN - 1);
+		}
+		elapsed = (now_ns() - start) / lookups;
+		if (elapsed < table_ns) { table_ns = elapsed; }
+		acc += i;
+	}
+
+	sink = acc;
+	printf("lookup latency, %s: switch %.2f ns/lookup, table %.2f ns/lookup (x%.1f)\n",
+		what, switch_ns, table_ns, switch_ns / table_ns);
+}
+
+static int bench_lookup()
+{
+	for (int code = 0; code <= BENCH_KEYSYM_CHECK_MAX; code++) {
+		unsigned char *ref = xkb_to_winkey_reference(code);
+		struct winkey key = xkb_to_winkey(code);
+		if (key.vk != ref[0] || key.scan != ref[1] || key.enhanced != ref[2]) {
+			fprintf(stderr, "lookup: mismatch for KeySym 0x%X: %i,%i,%i instead of %i,%i,%i\n",
+				code, key.vk, key.scan, key.enhanced, ref[0], ref[1], ref[2]);
+			return 1;
+		}
+	}
+	if (!bench_repeats) { return 0; }
+
+	// Whole KeySym space, and KeySyms that actually have translation (as real keyboard input does).
+	// Both are walked in random order, as real input does not come sorted.
+	// Switch wins for the whole space: almost every KeySym there takes the same default branch,
+	// which branch predictor always guesses right; mapped KeySyms are what table is for.
+	const int count = BENCH_KEYSYM_MAX + 1;
+	int *codes = (int *)malloc(count * sizeof(int));
+	int *mapped_codes = (int *)malloc(count * sizeof(int));
+	int mapped = 0;
+	for (int code = 0; code < count; code++) {
+		codes[code] = code;
+		if (xkb_to_winkey(code).vk) { mapped_codes[mapped++] = code; }
+	}
+	bench_lookup_shuffle(codes, count);
+	bench_lookup_shuffle(mapped_codes, mapped);
+
+	bench_lookup_run("all KeySyms", codes, count);
+	bench_lookup_run("mapped KeySyms", mapped_codes, mapped);
+	bench_lookup_chain("all KeySyms", codes, count);
+	bench_lookup_chain("mapped KeySyms", mapped_codes, mapped);
+
+	free(mapped_codes);
+	free(codes);
+	return 0;
+}
+
+// Compiles keymap for English keyboard layout, as kp.cpp does
+static struct xkb_keymap *bench_keymap(struct xkb_context *ctx)
+{
+	struct xkb_rule_names names = {};
+	names.layout = "us";
+	struct xkb_keymap *keymap = xkb_keymap_new_from_names(ctx, &names, XKB_KEYMAP_COMPILE_NO_FLAGS);
+	if (!keymap) { fprintf(stderr, "Cannot compile keymap\n"); }
+	return keymap;
+}
+
+// Per event xkb_state update and KeySym query, as kp.cpp did before translation table was introduced
+static struct winkey bench_keycode_reference(struct xkb_state *state, unsigned int keycode, int down)
+{
+	if ((keycode != XKB2WIN_KEYCODE_SHIFT_L) && (keycode != XKB2WIN_KEYCODE_SHIFT_R)) {
+		xkb_state_update_key(state, keycode, down ? XKB_KEY_DOWN : XKB_KEY_UP);
+	}
+	unsigned char *ref = xkb_to_winkey_reference(xkb_state_key_get_one_sym(state, keycode));
+	struct winkey key = { ref[0], ref[1], ref[2] };
+	return key;
+}
+
+static int bench_keycode()
+{
+	struct xkb_context *ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	struct xkb_keymap *keymap = bench_keymap(ctx);
+	if (!keymap) { xkb_context_unref(ctx); return 1; }
+
+	struct xkb2win_keycode_table table;
+	xkb2win_keycode_table_build(&table, keymap);
+
+	// Random key taps (press followed by release), NumLock included
+	const int count = 1 << 20;
+	unsigned int *keycodes = (unsigned int *)malloc(count * sizeof(unsigned int));
+	srand(2);
+	for (int i = 0; i < count; i += 2) {
+		keycodes[i] = keycodes[i + 1] = 8 + rand() % 248;
+	}
+
+	int failed = 0;
+	struct xkb_state *state = xkb_state_new(keymap);
+	int numlock = 0;
+	for (int i = 0; i < count && !failed; i++) {
+		int down = !(i & 1);
+		struct winkey ref = bench_keycode_reference(state, keycodes[i], down);
+		if ((keycodes[i] == XKB2WIN_KEYCODE_NUMLOCK) && down) { numlock = !numlock; }
+		struct winkey key = xkb2win_keycode_lookup(&table, keycodes[i], numlock)->key;
+		if (key.vk != ref.vk || key.scan != ref.scan || key.enhanced != ref.enhanced) {
+			fprintf(stderr, "keycode: mismatch for keycode %u, NumLock %i: %i,%i,%i instead of %i,%i,%i\n",
+				keycodes[i], numlock, key.vk, key.scan, key.enhanced, ref.vk, ref.scan, ref.enhanced);
+			failed = 1;
+		}
+	}
+	xkb_state_unref(state);
+
+	double state_ns = 1e9, table_ns = 1e9;
+	unsigned int acc = 0;
+	for (int repeat = 0; repeat < bench_repeats && !failed; repeat++) {
+		state = xkb_state_new(keymap);
+		double start = now_ns();
+		for (int i = 0; i < count; i++) {
+			struct winkey key = bench_keycode_reference(state, keycodes[i], !(i & 1));
+			acc += key.vk + key.scan + key.enhanced;
+		}
+		double elapsed = (now_ns() - start) / count;
+		if (elapsed < state_ns) { state_ns = elapsed; }
+		xkb_state_unref(state);
+
+		numlock = 0;
+		start = now_ns();
+		for (int i = 0; i < count; i++) {
+			if ((keycodes[i] == XKB2WIN_KEYCODE_NUMLOCK) && !(i & 1)) { numlock = !numlock; }
+			struct winkey key = xkb2win_keycode_lookup(&table, keycodes[i], numlock)->key;
+			acc += key.vk + key.scan + key.enhanced;
+		}
+		elapsed = (now_ns() - start) / count;
+		if (elapsed < table_ns) { table_ns = elapsed; }
+	}
+	sink = acc;
+
+	if (!failed && bench_repeats) {
+		printf("keycode: xkb_state %.2f ns/event, table %.2f ns/event (x%.1f)\n",
+			state_ns, table_ns, state_ns / table_ns);
+	}
+
+	free(keycodes);
+	xkb_keymap_unref(keymap);
+	xkb_context_unref(ctx);
+	return failed;
+}
+
+// Random key events, as they come from translation
+static struct win_key_event *bench_random_events(int count)
+{
+	struct win_key_event *events = (struct win_key_event *)malloc(count * sizeof(struct win_key_event));
+	for (int i = 0; i < count; i++) {
+		struct winkey key = xkb_to_winkey(rand() & 0xFF);
+		events[i].vk = key.vk;
+		events[i].scan = key.scan;
+		events[i].unicode = (i % 4) ? 0x20 + rand() % 0x60 : rand() & 0xFFFF;
+		events[i].key_down = rand() & 1;
+		events[i].control_key_state = (rand() & 0x7FF) | (key.enhanced ? ENHANCED_KEY : 0);
+		events[i].repeat_count = (i % 16) ? 1 : 1 + rand() % 1000;
+	}
+	return events;
+}
+
+// Per event printf formatting, as kp.cpp did before encoder was introduced
+static size_t bench_encode_reference(const struct win_key_event *events, int count, char *buf)
+{
+	char *p = buf;
+	for (int i = 0; i < count; i++) {
+		p += sprintf(p, "\x1b[%i;%i;%i;%i;%i;%i_",
+			events[i].vk, events[i].scan, events[i].unicode,
+			events[i].key_down ? 1 : 0, events[i].control_key_state, events[i].repeat_count);
+	}
+	return p - buf;
+}
+
+static int bench_encode()
+{
+	const int count = 1 << 18;
+	srand(3);
+	struct win_key_event *events = bench_random_events(count);
+	char *ref = (char *)malloc(count * WIN32_INPUT_MODE_SEQ_MAX + 1);
+	char *buf = (char *)malloc(count * WIN32_INPUT_MODE_SEQ_MAX);
+
+	size_t ref_len = bench_encode_reference(events, count, ref);
+	size_t encoded = 0;
+	size_t len = win32_input_mode_encode(events, count, buf, count * WIN32_INPUT_MODE_SEQ_MAX, &encoded);
+	int failed = (len != ref_len || encoded != (size_t)count || memcmp(buf, ref, len));
+	if (failed) { fprintf(stderr, "encode: output differs from printf formatting\n"); }
+
+	double printf_ns = 1e9, encoder_ns = 1e9;
+	for (int repeat = 0; repeat < bench_repeats && !failed; repeat++) {
+		double start = now_ns();
+		bench_encode_reference(events, count, ref);
+		double elapsed = (now_ns() - start) / count;
+		if (elapsed < printf_ns) { printf_ns = elapsed; }
+
+		start = now_ns();
+		win32_input_mode_encode(events, count, buf, count * WIN32_INPUT_MODE_SEQ_MAX, NULL);
+		elapsed = (now_ns() - start) / count;
+		if (elapsed < encoder_ns) { encoder_ns = elapsed; }
+	}
+	sink = buf[count / 2];
+
+	if (!failed && bench_repeats) {
+		double bytes_per_event = (double)len / count;
+		printf("encode: printf %.2f ns/event (%.0f MB/s), encoder %.2f ns/event (%.0f MB/s) (x%.1f)\n",
+			printf_ns, bytes_per_event * 1e3 / printf_ns,
+			encoder_ns, bytes_per_event * 1e3 / encoder_ns, printf_ns / encoder_ns);
+	}
+
+	free(buf);
+	free(ref);
+	free(events);
+	return failed;
+}
+
+// Collects decoder output for comparison with what was encoded
+struct bench_decode_output {
+	struct win_key_event *events;
+	size_t events_count;
+	char *text;
+	size_t text_len;
+};
+
+static void bench_decode_on_event(void *user, const struct win_key_event *event)
+{
+	struct bench_decode_output *out = (struct bench_decode_output *)user;
+	out->events[out->events_count++] = *event;
+}
+
+static void bench_decode_on_text(void *user, const char *text, size_t len)
+{
+	struct bench_decode_output *out = (struct bench_decode_output *)user;
+	memcpy(out->text + out->text_len, text, len);
+	out->text_len += len;
+}
+
+// Decodes stream split into chunks of given size, or random sizes up to 64 bytes if chunk is 0
+static void bench_decode_run(const char *stream, size_t len, size_t chunk, struct bench_decode_output *out)
+{
+	struct win32_input_decoder decoder;
+	win32_input_decoder_init(&decoder, bench_decode_on_event, bench_decode_on_text, out);
+	out->events_count = 0;
+	out->text_len = 0;
+	for (size_t offset = 0; offset < len; ) {
+		size_t n = chunk ? chunk : 1 + rand() % 64;
+		if (n > len - offset) { n = len - offset; }
+		win32_input_decode(&decoder, stream + offset, n);
+		offset += n;
+	}
+	win32_input_decoder_flush(&decoder);
+}
+
+// Sequences with parameters at the limits of their fields; too large ones are passed through as text
+struct bench_decode_range_case {
+	const char *seq;
+	int valid;
+};
+
+static const struct bench_decode_range_case bench_decode_range_cases[] = {
+	{ "\x1b[65535;65535;65535;1;4294967295;65535_", 1 },
+	{ "\x1b[0000065535;1;1;1;1;1_", 1 },
+	{ "\x1b[65536;1;1;1;1;1_", 0 },
+	{ "\x1b[65601;1;1;1;1;1_", 0 },
+	{ "\x1b[1;99999;1;1;1;1_", 0 },
+	{ "\x1b[1;1;65536;1;1;1_", 0 },
+	{ "\x1b[1;1;1;65536;1;1_", 0 },
+	{ "\x1b[1;1;1;1;4294967296;1_", 0 },
+	{ "\x1b[1;1;1;1;1;65536_", 0 },
+	{ "\x1b[1;1;1;1;99999999999_", 0 },
+};
+
+// Helper function to check decoding of bench_decode_range_cases, byte by byte
+// and in single buffer, with room for vectorized parsing
+static int bench_decode_range()
+{
+	const char padding[] = "                                                 .";
+	int failed = 0;
+	for (size_t c = 0; c < sizeof(bench_decode_range_cases) / sizeof(bench_decode_range_cases[0]); c++) {
+		const struct bench_decode_range_case *x = &bench_decode_range_cases[c];
+		char stream[128];
+		size_t len = snprintf(stream, sizeof(stream), "%s%s", x->seq, padding);
+		struct win_key_event events[1];
+		char text[128];
+		struct bench_decode_output out;
+		out.events = events;
+		out.text = text;
+		for (size_t chunk = 1; chunk <= len && !failed; chunk = (chunk == 1) ? len : len + 1) {
+			bench_decode_run(stream, len, chunk, &out);
+			size_t text_len = x->valid ? strlen(padding) : len;
+			if (out.events_count != (x->valid ? 1u : 0u) || out.text_len != text_len
+				|| memcmp(out.text, stream + len - text_len, text_len)) {
+				fprintf(stderr, "decode: %s sequence \\e%s, chunk size %zu: %zu events, %zu bytes of text\n",
+					x->valid ? "valid" : "too large", x->seq + 1, chunk, out.events_count, out.text_len);
+				failed = 1;
+			}
+		}
+	}
+	return failed;
+}
+
+static int bench_decode()
+{
+	// Captured-like input: paste sent as per-character sequences,
+	// with some plain text and other ESC sequences in between
+	const int count = 1 << 18;
+	srand(4);
+	struct win_key_event *events = bench_random_events(count);
+	size_t size = count * (WIN32_INPUT_MODE_SEQ_MAX + 8);
+	char *stream = (char *)malloc(size);
+	char *text = (char *)malloc(size);
+	size_t len = 0, text_len = 0;
+	for (int i = 0; i < count; i++) {
+		len += win32_input_mode_encode(&events[i], 1, stream + len, size - len, NULL);
+		if (i % 64 == 0) {
+			static const char *const others[] = { "plain text", "\x1b[A", "\x1b", "\x1b[1;2", "x_y" };
+			const char *other = others[rand() % 5];
+			memcpy(stream + len, other, strlen(other));
+			memcpy(text + text_len, other, strlen(other));
+			len += strlen(other);
+			text_len += strlen(other);
+		}
+	}
+
+	struct bench_decode_output out;
+	out.events = (struct win_key_event *)malloc(count * sizeof(struct win_key_event));
+	out.text = (char *)malloc(size);
+
+	int failed = bench_decode_range();
+	const size_t chunks[] = { 0, 1, 7, 64, len };
+	for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]) && !failed; c++) {
+		bench_decode_run(stream, len, chunks[c], &out);
+		failed = (out.events_count != (size_t)count || out.text_len != text_len
+			|| memcmp(out.text, text, text_len));
+		for (int i = 0; i < count && !failed; i++) {
+			failed = (out.events[i].vk != events[i].vk || out.events[i].scan != events[i].scan
+				|| out.events[i].unicode != events[i].unicode || out.events[i].key_down != events[i].key_down
+				|| out.events[i].control_key_state != events[i].control_key_state
+				|| out.events[i].repeat_count != events[i].repeat_count);
+		}
+		if (failed) { fprintf(stderr, "decode: output differs from encoded input, chunk size %zu\n", chunks[c]); }
+	}
+
+	// Small chunks never have room for vectorized parsing of whole sequence
+	double whole_ns = 1e9, split_ns = 1e9;
+	for (int repeat = 0; repeat < bench_repeats && !failed; repeat++) {
+		double start = now_ns();
+		bench_decode_run(stream, len, len, &out);
+		double elapsed = now_ns() - start;
+		if (elapsed < whole_ns) { whole_ns = elapsed; }
+
+		start = now_ns();
+		bench_decode_run(stream, len, 16, &out);
+		elapsed = now_ns() - start;
+		if (elapsed < split_ns) { split_ns = elapsed; }
+	}
+
+	if (!failed && bench_repeats) {
+		printf("decode, %.1f MB stream: 16 byte chunks %.0f MB/s (%.1f ns/event), whole buffer %.0f MB/s (%.1f ns/event) (x%.1f)\n",
+			len / 1e6, len * 1e3 / split_ns, split_ns / count, len * 1e3 / whole_ns, whole_ns / count, split_ns / whole_ns);
+	}
+
+	free(out.text);
+	free(out.events);
+	free(text);
+	free(stream);
+	free(events);
+	return failed;
+}
+
+// Helper function to encode code point as UTF-8
+// return
+//   count of bytes written
+static int bench_utf8_put(unsigned int cp, char *p)
+{
+	if (cp < 0x80) { p[0] = (char)cp; return 1; }
+	if (cp < 0x800) { p[0] = (char)(0xC0 | (cp >> 6)); p[1] = (char)(0x80 | (cp & 0x3F)); return 2; }
+	if (cp < 0x10000) {
+		p[0] = (char)(0xE0 | (cp >> 12)); p[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+		p[2] = (char)(0x80 | (cp & 0x3F)); return 3;
+	}
+	p[0] = (char)(0xF0 | (cp >> 18)); p[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+	p[2] = (char)(0x80 | ((cp >> 6) & 0x3F)); p[3] = (char)(0x80 | (cp & 0x3F)); return 4;
+}
+
+// Per char decoding with utf8_char_to_ucs2(), as kp.cpp did before bulk conversion was introduced
+static size_t bench_utf8_reference(char *utf8, unsigned short *out)
+{
+	size_t n = 0;
+	wchar_t ch;
+	int numread;
+	while ((numread = utf8_char_to_ucs2(utf8, &ch)) != 0) {
+		out[n++] = (unsigned short)ch;
+		utf8 += numread;
+	}
+	return n;
+}
+
+static int bench_utf8_run(const char *what, const unsigned int *cps, int cps_count, int size)
+{
+	char *utf8 = (char *)malloc(size + 4);
+	unsigned short *ref = (unsigned short *)malloc(size * sizeof(unsigned short));
+	unsigned short *out = (unsigned short *)malloc(size * sizeof(unsigned short));
+	int len = 0;
+	while (len < size - 4) { len += bench_utf8_put(cps[rand() % cps_count], utf8 + len); }
+	utf8[len] = 0;
+
+	size_t ref_count = bench_utf8_reference(utf8, ref);
+	size_t count = utf8_to_utf16(utf8, len, out, size, NULL);
+	int failed = (count != ref_count || memcmp(out, ref, count * sizeof(unsigned short)));
+	if (failed) { fprintf(stderr, "utf8, %s: output differs from utf8_char_to_ucs2()\n", what); }
+
+	double ref_ns = 1e9, bulk_ns = 1e9;
+	for (int repeat = 0; repeat < bench_repeats && !failed; repeat++) {
+		double start = now_ns();
+		bench_utf8_reference(utf8, ref);
+		double elapsed = now_ns() - start;
+		if (elapsed < ref_ns) { ref_ns = elapsed; }
+
+		start = now_ns();
+		utf8_to_utf16(utf8, len, out, size, NULL);
+		elapsed = now_ns() - start;
+		if (elapsed < bulk_ns) { bulk_ns = elapsed; }
+	}
+	sink = out[count / 2];
+
+	if (!failed && bench_repeats) {
+		printf("utf8, %s: utf8_char_to_ucs2 %.0f MB/s, utf8_to_utf16 %.0f MB/s (x%.1f)\n",
+			what, len * 1e3 / ref_ns, len * 1e3 / bulk_ns, ref_ns / bulk_ns);
+	}
+
+	free(out);
+	free(ref);
+	free(utf8);
+	return failed;
+}
+
+// Invalid UTF-8 and UTF-16 it should give: U+FFFD for each maximal invalid subpart
+struct bench_utf8_invalid {
+	const char *what;
+	const char *bytes;
+	unsigned short units[4];
+	int first_len; // bytes utf8_char_decode() takes for the first char
+	int at_end;    // truncated by end of buffer, so nothing can follow
+};
+
+static const struct bench_utf8_invalid bench_utf8_invalid_cases[] = {
+	{ "overlong 2 byte", "\xC0\x80", { 0xFFFD, 0xFFFD }, 1, 0 },
+	{ "overlong 2 byte C1", "\xC1\xBF", { 0xFFFD, 0xFFFD }, 1, 0 },
+	{ "overlong 3 byte", "\xE0\x80\xAF", { 0xFFFD, 0xFFFD, 0xFFFD }, 1, 0 },
+	{ "overlong 4 byte", "\xF0\x8F\xBF\xBF", { 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD }, 1, 0 },
+	{ "surrogate D800", "\xED\xA0\x80", { 0xFFFD, 0xFFFD, 0xFFFD }, 1, 0 },
+	{ "surrogate DFFF", "\xED\xBF\xBF", { 0xFFFD, 0xFFFD, 0xFFFD }, 1, 0 },
+	{ "above U+10FFFF", "\xF4\x90\x80\x80", { 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD }, 1, 0 },
+	{ "F5 lead", "\xF5\x80\x80\x80", { 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD }, 1, 0 },
+	{ "FF byte", "\xFF", { 0xFFFD }, 1, 0 },
+	{ "stray continuation", "\x80", { 0xFFFD }, 1, 0 },
+	{ "stray continuations", "\xBF\x80", { 0xFFFD, 0xFFFD }, 1, 0 },
+	{ "truncated 2 byte", "\xC3", { 0xFFFD }, 1, 1 },
+	{ "truncated 3 byte", "\xE4\xB8", { 0xFFFD }, 2, 1 },
+	{ "truncated 4 byte", "\xF0\x9F\x98", { 0xFFFD }, 3, 1 },
+	{ "truncated 3 byte, then ASCII", "\xE4\xB8" "A", { 0xFFFD, 'A' }, 2, 0 },
+	{ "truncated 4 byte, then lead", "\xF0\x9F\xE4\xB8\xAD", { 0xFFFD, 0x4E2D }, 2, 0 },
+};
+
+// Checks invalid UTF-8 alone (scalar path only) and with ASCII runs around it at every offset,
+// so it comes right after, right before and across the 16 byte blocks of the SSE2 path
+static int bench_utf8_invalid()
+{
+	const int cases = sizeof(bench_utf8_invalid_cases) / sizeof(bench_utf8_invalid_cases[0]);
+	for (int c = 0; c < cases; c++) {
+		const struct bench_utf8_invalid *x = &bench_utf8_invalid_cases[c];
+		const size_t len = strlen(x->bytes);
+		size_t units = 0;
+		while (units < 4 && x->units[units]) { units++; }
+
+		unsigned int cp;
+		if (utf8_char_decode((const unsigned char *)x->bytes, len, &cp) != x->first_len
+			|| cp != x->units[0]) {
+			fprintf(stderr, "utf8, %s: wrong utf8_char_decode() result\n", x->what);
+			return 1;
+		}
+
+		for (size_t before = 0; before <= 33; before++) {
+			for (size_t after = 0; after <= 33; after += (after < 17) ? 1 : 16) {
+				if (after && x->at_end) { continue; }
+
+				char utf8[80];
+				unsigned short expected[80], out[80];
+				size_t n = 0, size = 0;
+				for (size_t i = 0; i < before; i++) { utf8[size++] = 'a' + i % 26; expected[n++] = 'a' + i % 26; }
+				memcpy(utf8 + size, x->bytes, len);
+				size += len;
+				memcpy(expected + n, x->units, units * sizeof(unsigned short));
+				n += units;
+				for (size_t i = 0; i < after; i++) { utf8[size++] = '0' + i % 10; expected[n++] = '0' + i % 10; }
+
+				size_t consumed;
+				size_t count = utf8_to_utf16(utf8, size, out, 80, &consumed);
+				int ok = (count == n && consumed == size && !memcmp(out, expected, n * sizeof(unsigned short)));
+
+				// Output full right before invalid input: it is not consumed
+				size_t part = utf8_to_utf16(utf8, size, out, before, &consumed);
+				ok = ok && part == before && consumed == before;
+				if (!ok) {
+					fprintf(stderr, "utf8, %s: wrong conversion with %zu ASCII chars before and %zu after\n",
+						x->what, before, after);
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static int bench_utf8()
+{
+	// Every code point should survive UTF-8 to UTF-16 conversion, astral ones as surrogate pairs
+	for (unsigned int cp = 0; cp <= 0x10FFFF; cp++) {
+		if (cp >= 0xD800 && cp <= 0xDFFF) { continue; }
+		char utf8[4];
+		unsigned short out[2];
+		int len = bench_utf8_put(cp, utf8);
+		size_t consumed;
+		size_t count = utf8_to_utf16(utf8, len, out, 2, &consumed);
+		int ok = (consumed == (size_t)len);
+		if (cp < 0x10000) {
+			// Same as utf8_char_to_ucs2() gives, for everything it can decode
+			char z[4] = { 0 };
+			memcpy(z, utf8, len);
+			wchar_t ch;
+			ok = ok && count == 1 && out[0] == cp;
+			ok = ok && (!cp || (utf8_char_to_ucs2(z, &ch) == len && (unsigned int)ch == out[0]));
+		} else {
+			ok = ok && count == 2 && out[0] == (0xD800 | ((cp - 0x10000) >> 10)) && out[1] == (0xDC00 | (cp & 0x3FF));
+		}
+		if (!ok) {
+			fprintf(stderr, "utf8: wrong conversion of U+%04X\n", cp);
+			return 1;
+		}
+	}
+
+	if (bench_utf8_invalid()) { return 1; }
+
+	// Pastes of different scripts, 1 MB each
+	static const unsigned int ascii[] = { 'a', 'b', 'z', 'A', 'Z', '0', '9', ' ', '.', '\n', '{', '}' };
+	static const unsigned int mixed[] = { 'a', ' ', 0x0436, 0x0444, 0x00E9, 0x4E2D, 0x6587, 0x3042 };
+	const int size = 1 << 20;
+	srand(5);
+	return bench_utf8_run("ASCII", ascii, sizeof(ascii) / sizeof(ascii[0]), size)
+		| bench_utf8_run("mixed scripts", mixed, sizeof(mixed) / sizeof(mixed[0]), size);
+}
+
+// Key event as it comes from X11
+struct bench_translate_event {
+	unsigned char keycode;
+	unsigned char key_down;
+	unsigned int state;
+	char utf8[13]; // null terminated, for utf8_char_to_ucs2()
+	unsigned char utf8_len;
+};
+
+// Intended differences from original code. Translation table takes only NumLock into account,
+// while original passed held Control and Alt keys to xkb_state too, and some keys give other
+// KeySyms with them. Now such keys keep their own Windows key codes.
+struct bench_translate_exception {
+	const char *what;
+	xkb_keysym_t first, last;  // KeySyms original got
+	const char *mods[2];       // modifiers held for that, NULL if not needed
+	int hits;
+};
+
+static struct bench_translate_exception bench_translate_exceptions[] = {
+	// VK_F1..VK_F12 instead of 0
+	{ "Ctrl+Alt+F1..F12", XKB_KEY_XF86Switch_VT_1, XKB_KEY_XF86Switch_VT_12, { XKB_MOD_NAME_CTRL, XKB_MOD_NAME_ALT }, 0 },
+	// VK_DIVIDE, VK_MULTIPLY, VK_SUBTRACT, VK_ADD instead of 0
+	{ "Ctrl+Alt+KP_Divide..KP_Add", XKB_KEY_XF86Ungrab, XKB_KEY_XF86Prev_VMode, { XKB_MOD_NAME_CTRL, XKB_MOD_NAME_ALT }, 0 },
+	// VK_SNAPSHOT instead of 0
+	{ "Alt+Print", XKB_KEY_Sys_Req, XKB_KEY_Sys_Req, { XKB_MOD_NAME_ALT, NULL }, 0 },
+	// Both have no Windows key code, so output is the same
+	{ "Ctrl+Pause", XKB_KEY_Break, XKB_KEY_Break, { XKB_MOD_NAME_CTRL, NULL }, 0 },
+};
+
+// return
+//   exception KeySym original got belongs to, or NULL if difference is not expected
+static struct bench_translate_exception *bench_translate_exception(struct xkb_state *state, xkb_keysym_t sym)
+{
+	for (size_t i = 0; i < sizeof(bench_translate_exceptions) / sizeof(bench_translate_exceptions[0]); i++) {
+		struct bench_translate_exception *x = &bench_translate_exceptions[i];
+		int held = 1;
+		for (int m = 0; m < 2 && x->mods[m]; m++) {
+			if (xkb_state_mod_name_is_active(state, x->mods[m], XKB_STATE_MODS_EFFECTIVE) <= 0) { held = 0; }
+		}
+		if (sym >= x->first && sym <= x->last && held) { return x; }
+	}
+	return NULL;
+}
+
+static int bench_translate()
+{
+	struct xkb_context *ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	struct xkb_keymap *keymap = bench_keymap(ctx);
+	if (!keymap) { xkb_context_unref(ctx); return 1; }
+	struct xkb2win_keycode_table table;
+	xkb2win_keycode_table_build(&table, keymap);
+
+	// Key taps with modifiers pressed and released in between, NumLock included.
+	// Modifiers mask sometimes lacks held modifiers, as when their release was lost,
+	// and has random lock bits. Text is up to 3 random chars up to U+FFFF
+	static const unsigned char modifiers[] = { 50, 62, 37, 105, 64, 108 };
+	static const unsigned int modifier_masks[] = { ShiftMask, ShiftMask, ControlMask, ControlMask, Mod1Mask, Mod1Mask };
+	const int count = 1 << 20;
+	struct bench_translate_event *events = (struct bench_translate_event *)calloc(count, sizeof(struct bench_translate_event));
+	int held[6] = { 0 };
+	srand(8);
+	for (int i = 0; i < count; ) {
+		unsigned int state = 0;
+		for (int m = 0; m < 6; m++) {
+			if (held[m]) { state |= modifier_masks[m]; }
+		}
+		if (rand() % 16 == 0) { state &= rand(); }
+		state |= rand() & (LockMask | Mod2Mask | Mod3Mask | Mod5Mask);
+
+		struct bench_translate_event *e = &events[i];
+		e->state = state;
+		if (rand() % 4 == 0) {
+			int m = rand() % 6;
+			held[m] = !held[m];
+			e->keycode = modifiers[m];
+			e->key_down = held[m];
+			i++;
+			continue;
+		}
+		e->keycode = 8 + rand() % 248;
+		e->key_down = 1;
+		int chars = rand() % 4;
+		for (int c = 0; c < chars; c++) {
+			unsigned int cp;
+			do { cp = 1 + rand() % 0xFFFF; } while (cp >= 0xD800 && cp <= 0xDFFF);
+			e->utf8_len += bench_utf8_put(cp, e->utf8 + e->utf8_len);
+		}
+		if (i + 1 < count) {
+			events[i + 1] = *e;
+			events[i + 1].key_down = 0;
+			events[i + 1].utf8_len = 0;
+			events[i + 1].utf8[0] = 0;
+		}
+		i += 2;
+	}
+
+	int failed = 0;
+	struct x11_translator tr;
+	x11_translator_init(&tr, &table, 0);
+	struct x11_translator_reference ref_tr = { xkb_state_new(keymap), 0 };
+	struct win_key_event out[16], ref[16];
+	for (int i = 0; i < count && !failed; i++) {
+		const struct bench_translate_event *e = &events[i];
+		size_t n = x11_translate(&tr, e->keycode, e->key_down, e->state, e->utf8, e->utf8_len, out, 16);
+		size_t ref_n = x11_translate_reference(&ref_tr, e->keycode, e->key_down, e->state, events[i].utf8, ref);
+
+		// For expected differences, original output is checked with Windows key codes of table
+		const struct xkb2win_keycode *entry = xkb2win_keycode_lookup(&table, e->keycode, tr.numlock);
+		xkb_keysym_t ref_sym = xkb_state_key_get_one_sym(ref_tr.state, e->keycode);
+		struct bench_translate_exception *exception = (ref_sym != entry->sym)
+			? bench_translate_exception(ref_tr.state, ref_sym) : NULL;
+		if (exception) {
+			exception->hits++;
+			for (size_t j = 0; j < ref_n; j++) {
+				ref[j].vk = entry->key.vk;
+				ref[j].scan = entry->key.scan;
+				ref[j].control_key_state = (ref[j].control_key_state & ~ENHANCED_KEY) | (entry->key.enhanced ? ENHANCED_KEY : 0);
+			}
+		}
+
+		failed = (n != ref_n);
+		for (size_t j = 0; j < n && !failed; j++) {
+			failed = (out[j].vk != ref[j].vk || out[j].scan != ref[j].scan || out[j].unicode != ref[j].unicode
+				|| out[j].key_down != ref[j].key_down || out[j].control_key_state != ref[j].control_key_state
+				|| out[j].repeat_count != ref[j].repeat_count);
+		}
+		if (failed) {
+			fprintf(stderr, "translate: mismatch for event %i, keycode %u, %s, state 0x%X: "
+				"%zu events, control key state 0x%X instead of %zu events, 0x%X\n",
+				i, e->keycode, e->key_down ? "down" : "up", e->state,
+				n, out[0].control_key_state, ref_n, ref[0].control_key_state);
+			fprintf(stderr, "translate: VK %i, KeySym 0x%X instead of VK %i, KeySym 0x%X\n",
+				out[0].vk, entry->sym, ref[0].vk, ref_sym);
+		}
+	}
+	xkb_state_unref(ref_tr.state);
+
+	double ref_ns = 1e9, table_ns = 1e9;
+	unsigned int acc = 0;
+	for (int repeat = 0; repeat < bench_repeats && !failed; repeat++) {
+		ref_tr.state = xkb_state_new(keymap);
+		ref_tr.cks = 0;
+		double start = now_ns();
+		for (int i = 0; i < count; i++) {
+			const struct bench_translate_event *e = &events[i];
+			size_t n = x11_translate_reference(&ref_tr, e->keycode, e->key_down, e->state, events[i].utf8, ref);
+			acc += n + ref[0].control_key_state;
+		}
+		double elapsed = (now_ns() - start) / count;
+		if (elapsed < ref_ns) { ref_ns = elapsed; }
+		xkb_state_unref(ref_tr.state);
+
+		x11_translator_init(&tr, &table, 0);
+		start = now_ns();
+		for (int i = 0; i < count; i++) {
+			const struct bench_translate_event *e = &events[i];
+			size_t n = x11_translate(&tr, e->keycode, e->key_down, e->state, e->utf8, e->utf8_len, out, 16);
+			acc += n + out[0].control_key_state;
+		}
+		elapsed = (now_ns() - start) / count;
+		if (elapsed < table_ns) { table_ns = elapsed; }
+	}
+	sink = acc;
+
+	if (!failed && bench_repeats) {
+		printf("translate: original %.2f ns/event, x11_translate %.2f ns/event (x%.1f)\n",
+			ref_ns, table_ns, ref_ns / table_ns);
+		printf("translate: expected differences from original:");
+		for (size_t i = 0; i < sizeof(bench_translate_exceptions) / sizeof(bench_translate_exceptions[0]); i++) {
+			printf("%s %s %i", i ? "," : "", bench_translate_exceptions[i].what, bench_translate_exceptions[i].hits);
+		}
+		printf("\n");
+	}
+
+	free(events);
+	xkb_keymap_unref(keymap);
+	xkb_context_unref(ctx);
+	return failed;
+}
+
+// Key event of one of the sessions, as it comes from X11
+struct bench_session_event {
+	unsigned short session;  // index of session in thread
+	unsigned char keycode;
+	unsigned char key_down;
+	unsigned int state;
+	unsigned char utf8_len;
+	char utf8[7];
+};
+
+#define BENCH_SESSIONS 64 // sessions per thread
+
+// Work of single thread: its own sessions sharing one table, all fed with the same event stream
+struct bench_session_thread {
+	pthread_t thread;
+	struct xkb2win_shared_table *shared;
+	const struct bench_session_event *events;
+	int count;
+	unsigned int checksum;  // hash of all ESC sequences produced
+	pthread_barrier_t *start;
+};
+
+static void *bench_session_run(void *arg)
+{
+	struct bench_session_thread *t = (struct bench_session_thread *)arg;
+	struct x11_session sessions[BENCH_SESSIONS];
+	for (int i = 0; i < BENCH_SESSIONS; i++) { x11_session_init(&sessions[i], t->shared, i & 1); }
+	pthread_barrier_wait(t->start);
+
+	unsigned int hash = 2166136261u;
+	char seq[8 * WIN32_INPUT_MODE_SEQ_MAX];
+	struct win_key_event out[8];
+	for (int i = 0; i < t->count; i++) {
+		const struct bench_session_event *e = &t->events[i];
+		size_t n = x11_session_translate(&sessions[e->session], e->keycode, e->key_down, e->state,
+			e->utf8, e->utf8_len, out, 8);
+		size_t len = win32_input_mode_encode(out, n, seq, sizeof(seq), NULL);
+		for (size_t j = 0; j < len; j++) { hash = (hash ^ (unsigned char)seq[j]) * 16777619u; }
+	}
+	t->checksum = hash;
+
+	for (int i = 0; i < BENCH_SESSIONS; i++) { x11_session_free(&sessions[i]); }
+	return NULL;
+}
+
+// Runs given number of threads at once
+// return
+//   wall time, ns; 0 if some thread got different output than expected
+static double bench_sessions_run(struct xkb2win_shared_table *shared, const struct bench_session_event *events,
+	int count, int threads, unsigned int expected)
+{
+	struct bench_session_thread *t = (struct bench_session_thread *)calloc(threads, sizeof(struct bench_session_thread));
+	pthread_barrier_t start;
+	pthread_barrier_init(&start, NULL, threads + 1);
+	for (int i = 0; i < threads; i++) {
+		t[i].shared = shared;
+		t[i].events = events;
+		t[i].count = count;
+		t[i].start = &start;
+		pthread_create(&t[i].thread, NULL, bench_session_run, &t[i]);
+	}
+	pthread_barrier_wait(&start);
+	double begin = now_ns();
+	int ok = 1;
+	for (int i = 0; i < threads; i++) {
+		pthread_join(t[i].thread, NULL);
+		if (t[i].checksum != expected) { ok = 0; }
+	}
+	double elapsed = now_ns() - begin;
+	pthread_barrier_destroy(&start);
+	free(t);
+	return ok ? elapsed : 0;
+}
+
+// Translates all events in current thread
+// return
+//   checksum every thread should get
+static unsigned int bench_sessions_reference(struct xkb2win_shared_table *shared,
+	const struct bench_session_event *events, int count)
+{
+	pthread_barrier_t start;
+	pthread_barrier_init(&start, NULL, 1);
+	struct bench_session_thread t;
+	memset(&t, 0, sizeof(t));
+	t.shared = shared;
+	t.events = events;
+	t.count = count;
+	t.start = &start;
+	bench_session_run(&t);
+	pthread_barrier_destroy(&start);
+	return t.checksum;
+}
+
+static int bench_sessions()
+{
+	struct xkb2win_shared_table *shared = xkb2win_shared_table_new("us");
+	if (!shared) { fprintf(stderr, "Cannot compile keymap\n"); return 1; }
+
+	// Random key taps in random sessions, with modifiers held in some of them
+	const int count = 1 << 20;
+	struct bench_session_event *events = (struct bench_session_event *)calloc(count, sizeof(struct bench_session_event));
+	srand(6);
+	for (int i = 0; i < count; i += 2) {
+		struct bench_session_event *e = &events[i];
+		e->session = rand() % BENCH_SESSIONS;
+		e->keycode = 8 + rand() % 248;
+		e->key_down = 1;
+		e->state = (rand() % 8 == 0) ? ShiftMask | ControlMask : 0;
+		int len = xkb_keysym_to_utf8(xkb2win_keycode_lookup(shared->table, e->keycode, 0)->sym, e->utf8, sizeof(e->utf8));
+		e->utf8_len = (len > 0) ? len - 1 : 0;
+		events[i + 1] = *e;
+		events[i + 1].key_down = 0;
+		events[i + 1].utf8_len = 0;
+	}
+
+	// Sessions do not share any mutable state, so every thread should get exactly
+	// the same output as single thread gets for the same events.
+	// Checked with more threads than CPUs too, so threads are preempted in the middle of translation
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) { cpus = 1; }
+	unsigned int expected = bench_sessions_reference(shared, events, count);
+	unsigned int expected_part = bench_sessions_reference(shared, events, count / 16);
+	int failed = !bench_sessions_run(shared, events, count / 16, cpus * 4, expected_part);
+	if (failed) { fprintf(stderr, "sessions: concurrent sessions give different output\n"); }
+
+	double single_ns = 0;
+	for (int threads = 1; threads <= cpus && !failed && bench_repeats; threads = (threads * 2 > cpus && threads < cpus) ? cpus : threads * 2) {
+		double best = 1e18;
+		for (int repeat = 0; repeat < bench_repeats && !failed; repeat++) {
+			double elapsed = bench_sessions_run(shared, events, count, threads, expected);
+			if (!elapsed) { failed = 1; break; }
+			if (elapsed < best) { best = elapsed; }
+		}
+		if (failed) { fprintf(stderr, "sessions: %i threads give different output\n", threads); break; }
+		if (threads == 1) { single_ns = best; }
+		double events_per_s = (double)count * threads * 1e9 / best;
+		printf("sessions: %i thread(s), %i sessions each: %.1f M events/s, %.2f ns/event per thread, scaling x%.2f (%.0f%%)\n",
+			threads, BENCH_SESSIONS, events_per_s / 1e6, best / count,
+			threads * single_ns / best, 100.0 * single_ns / best);
+	}
+
+	free(events);
+	xkb2win_shared_table_unref(shared);
+	return failed;
+}
+
+// Ways cache file can be damaged; each of them should make keymap_cache_load() rebuild it
+static const char *const bench_cache_damages[] = {
+	"empty file", "truncated header", "truncated table", "truncated keymap", "other magic", "other version",
+	"other fingerprint", "damaged table", "keymap without null", "table out of file",
+};
+
+// Helper function to load cache and check it has right table
+// return
+//   1 if cache file was used (mapped), 0 if it was rebuilt, -1 on failure
+static int bench_cache_load(const struct xkb2win_keycode_table *expected, const char *what)
+{
+	struct keymap_cache cache;
+	if (!keymap_cache_load(&cache, "us")) {
+		fprintf(stderr, "cache: %s: cannot load\n", what);
+		return -1;
+	}
+	int result = cache.mapped;
+	if (memcmp(cache.table, expected, sizeof(*expected))) {
+		fprintf(stderr, "cache: %s: table differs from compiled one\n", what);
+		result = -1;
+	}
+	keymap_cache_close(&cache);
+	return result;
+}
+
+// Checks keymap cache: file is made on first load and used next time, it is rebuilt when
+// fingerprint changes, and truncated or damaged file is never used
+static int bench_cache()
+{
+	struct xkb_context *ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	struct xkb_keymap *keymap = bench_keymap(ctx);
+	if (!keymap) { return 1; }
+	struct xkb2win_keycode_table expected;
+	xkb2win_keycode_table_build(&expected, keymap);
+	xkb_keymap_unref(keymap);
+	xkb_context_unref(ctx);
+
+	// Own cache directory, user's one is not touched
+	const char *saved = getenv("XDG_CACHE_HOME");
+	char *saved_cache = saved ? strdup(saved) : NULL;
+	char dir[] = "/tmp/xkb2win-cache-XXXXXX";
+	char path[sizeof(dir) + 32];
+	if (!mkdtemp(dir)) { return 1; }
+	setenv("XDG_CACHE_HOME", dir, 1);
+	snprintf(path, sizeof(path), "%s/xkb2win/keymap-us.cache", dir);
+
+	int failed = 0;
+	struct stat st;
+	// Bench links libxkbcommon dynamically, so it is the library, not executable
+	const char *library = keymap_cache_library();
+	if (!strstr(library, "libxkbcommon.so") || stat(library, &st) != 0) {
+		fprintf(stderr, "cache: libxkbcommon file is not found (%s), its updates would not rebuild cache\n", library);
+		failed = 1;
+	}
+	if (bench_cache_load(&expected, "first load") != 0 || stat(path, &st) != 0
+		|| bench_cache_load(&expected, "second load") != 1) {
+		fprintf(stderr, "cache: file is not made on first load, or not used on second one\n");
+		failed = 1;
+	}
+
+	// Other RMLVO defaults give other fingerprint; pc104 model has the same keys as default pc105 one
+	setenv("XKB_DEFAULT_MODEL", "pc104", 1);
+	if (!failed && (bench_cache_load(&expected, "other model") != 0 || bench_cache_load(&expected, "other model") != 1)) {
+		fprintf(stderr, "cache: file is not rebuilt when fingerprint changes\n");
+		failed = 1;
+	}
+	unsetenv("XKB_DEFAULT_MODEL");
+	if (!failed && bench_cache_load(&expected, "default model") != 0) {
+		fprintf(stderr, "cache: file made with other fingerprint is used\n");
+		failed = 1;
+	}
+
+	// Valid file image, to damage it
+	char *image = NULL;
+	size_t size = 0;
+	FILE *f = fopen(path, "rb");
+	if (f && fstat(fileno(f), &st) == 0 && st.st_size >= (off_t)sizeof(struct keymap_cache_header)) {
+		size = st.st_size;
+		image = (char *)malloc(size);
+		if (fread(image, 1, size, f) != size) { size = 0; }
+	}
+	if (f) { fclose(f); }
+	if (!size) { failed = 1; }
+
+	for (size_t d = 0; d < sizeof(bench_cache_damages) / sizeof(bench_cache_damages[0]) && !failed; d++) {
+		char *damaged = (char *)malloc(size);
+		memcpy(damaged, image, size);
+		struct keymap_cache_header *header = (struct keymap_cache_header *)damaged;
+		size_t damaged_size = size;
+		switch (d) {
+		case 0: damaged_size = 0; break;
+		case 1: damaged_size = sizeof(*header) / 2; break;
+		case 2: damaged_size = header->table_offset + header->table_size / 2; break;
+		case 3: damaged_size = size - 1; break;
+		case 4: header->magic[0] ^= 1; break;
+		case 5: header->version++; break;
+		case 6: header->fingerprint ^= 1; break;
+		case 7: damaged[header->table_offset + header->table_size / 2] ^= 0x10; break;
+		case 8: damaged[size - 1] = 'x'; break;
+		case 9: header->table_offset = (uint32_t)(size + 8) & ~7u; break;
+		}
+		f = fopen(path, "wb");
+		int written = f && fwrite(damaged, 1, damaged_size, f) == damaged_size;
+		if (f && fclose(f) != 0) { written = 0; }
+		free(damaged);
+
+		// Damaged file is replaced with valid one
+		if (!written || bench_cache_load(&expected, bench_cache_damages[d]) != 0
+			|| bench_cache_load(&expected, bench_cache_damages[d]) != 1) {
+			fprintf(stderr, "cache: %s: file is used or not rebuilt\n", bench_cache_damages[d]);
+			failed = 1;
+		}
+	}
+
+	free(image);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/xkb2win", dir);
+	rmdir(path);
+	rmdir(dir);
+	if (saved_cache) { setenv("XDG_CACHE_HOME", saved_cache, 1); }
+	else { unsetenv("XDG_CACHE_HOME"); }
+	free(saved_cache);
+	return failed;
+}
+
+// Batch of X11 key events, repeat counts x11_fold_autorepeat() should give for them,
+// and text event loop should pass for them with US international layout, with folding and without
+struct bench_autorepeat_case {
+	const char *what;
+	int count;
+	struct x11_key_event events[6]; // keycode, state, time, key_down
+	unsigned int repeats[6];
+	const char *text;               // chars of key down events, each repeated RepeatCount times
+};
+
+static const struct bench_autorepeat_case bench_autorepeat_cases[] = {
+	{ "synthetic release and press with the same timestamp", 6,
+		{ { 38, 0, 100, 1 }, { 38, 0, 130, 0 }, { 38, 0, 130, 1 }, { 38, 0, 160, 0 }, { 38, 0, 160, 1 }, { 38, 0, 200, 0 } },
+		{ 3, 0, 0, 0, 0, 1 }, "aaa" },
+	{ "detectable autorepeat, presses only", 5,
+		{ { 38, 0, 100, 1 }, { 38, 0, 130, 1 }, { 38, 0, 160, 1 }, { 38, 0, 190, 1 }, { 38, 0, 200, 0 } },
+		{ 4, 0, 0, 0, 1 }, "aaaa" },
+	{ "modifier change splits run", 5,
+		{ { 38, 0, 100, 1 }, { 38, 0, 130, 1 }, { 38, ShiftMask, 160, 1 }, { 38, ShiftMask, 190, 1 }, { 38, ShiftMask, 200, 0 } },
+		{ 2, 0, 2, 0, 1 }, "aaAA" },
+	{ "modifier change splits synthetic pairs", 4,
+		{ { 38, 0, 100, 1 }, { 38, 0, 130, 0 }, { 38, ControlMask, 130, 1 }, { 38, ControlMask, 200, 0 } },
+		{ 1, 0, 1, 1 }, "a\x01" },
+	{ "real release between presses", 4,
+		{ { 38, 0, 100, 1 }, { 38, 0, 120, 0 }, { 38, 0, 150, 1 }, { 38, 0, 170, 0 } },
+		{ 1, 1, 1, 1 }, "aa" },
+	{ "other key between presses", 3,
+		{ { 38, 0, 100, 1 }, { 39, 0, 110, 1 }, { 38, 0, 130, 1 } },
+		{ 1, 1, 1 }, "asa" },
+	{ "run ends at batch end", 3,
+		{ { 38, 0, 100, 1 }, { 38, 0, 130, 1 }, { 38, 0, 160, 1 } },
+		{ 3, 0, 0 }, "aaa" },
+	{ "release at batch end is kept, its press may be in next batch", 2,
+		{ { 38, 0, 100, 1 }, { 38, 0, 130, 0 } },
+		{ 1, 1 }, "a" },
+	{ "press at batch start is not folded into anything", 2,
+		{ { 38, 0, 130, 1 }, { 38, 0, 160, 0 } },
+		{ 1, 1 }, "a" },
+	// Apostrophe is dead_acute in US international layout, it gives "´" when it is pressed twice
+	{ "dead key held", 5,
+		{ { 48, 0, 100, 1 }, { 48, 0, 130, 1 }, { 48, 0, 160, 1 }, { 48, 0, 190, 1 }, { 48, 0, 200, 0 } },
+		{ 4, 0, 0, 0, 1 }, "\xC2\xB4\xC2\xB4" },
+	{ "key held after dead key", 6,
+		{ { 48, 0, 100, 1 }, { 48, 0, 120, 0 }, { 26, 0, 150, 1 }, { 26, 0, 180, 1 }, { 26, 0, 210, 1 }, { 26, 0, 230, 0 } },
+		{ 1, 1, 3, 0, 0, 1 }, "\xC3\xA9" "ee" },
+};
+
+// Helper function to make xkb_text without X11 connection, with US international layout,
+// that has dead keys, and compose table of en_US.UTF-8 locale
+static int bench_xkb_text(struct xkb_text *text)
+{
+	memset(text, 0, sizeof(*text));
+	text->ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	struct xkb_rule_names names = {};
+	names.layout = "us";
+	names.variant = "intl";
+	text->keymap = text->ctx ? xkb_keymap_new_from_names(text->ctx, &names, XKB_KEYMAP_COMPILE_NO_FLAGS) : NULL;
+	text->state = text->keymap ? xkb_state_new(text->keymap) : NULL;
+	text->compose_table = text->ctx ? xkb_compose_table_new_from_locale(text->ctx, "en_US.UTF-8",
+		XKB_COMPOSE_COMPILE_NO_FLAGS) : NULL;
+	text->compose = text->compose_table ? xkb_compose_state_new(text->compose_table, XKB_COMPOSE_STATE_NO_FLAGS) : NULL;
+	if (!text->state || !text->compose) {
+		fprintf(stderr, "Cannot compile US international keymap or en_US.UTF-8 compose table\n");
+		xkb_text_free(text);
+		return 0;
+	}
+	return 1;
+}
+
+// Chars of key down events passed by event loop, each repeated RepeatCount times
+struct bench_autorepeat_text {
+	unsigned short units[64];
+	size_t count;
+	FILE *trace; // if not NULL, every key event is recorded here, as kp does
+};
+
+// Helper function to add chars of key down events to text
+static void bench_autorepeat_add(struct bench_autorepeat_text *t, const struct win_key_event *events, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		const struct win_key_event *e = &events[i];
+		for (unsigned int r = 0; e->key_down && e->unicode && r < e->repeat_count && t->count < 64; r++) {
+			t->units[t->count++] = e->unicode;
+		}
+	}
+}
+
+static void bench_autorepeat_on_key(void *user, const struct x11_event_loop_key *key)
+{
+	struct bench_autorepeat_text *t = (struct bench_autorepeat_text *)user;
+	if (t->trace) {
+		key_trace_write(t->trace, key->xkey->keycode, key->xkey->type == KeyPress, key->xkey->state,
+			key->xkey->time, key->utf8, key->utf8_len);
+	}
+	bench_autorepeat_add(t, key->events, key->count);
+}
+
+// Helper function to replay trace as kp_replay does, every record separately
+// return
+//   1 on success, 0 if trace can not be read
+static int bench_autorepeat_replay(const char *path, const struct xkb2win_keycode_table *table,
+	struct bench_autorepeat_text *t)
+{
+	struct key_trace trace;
+	if (!key_trace_open(&trace, path)) { return 0; }
+	struct x11_translator tr;
+	x11_translator_init(&tr, table, trace.numlock);
+	t->count = 0;
+	size_t offset = 0;
+	const struct key_trace_record *record;
+	while ((record = key_trace_next(&trace, &offset)) != NULL) {
+		struct win_key_event events[8];
+		size_t count = x11_translate(&tr, record->keycode, record->key_down, record->state,
+			record->utf8, record->utf8_len, events, 8);
+		bench_autorepeat_add(t, events, count);
+	}
+	key_trace_close(&trace);
+	return 1;
+}
+
+// Nothing is measured here, folding is done once per batch
+static int bench_autorepeat()
+{
+	const int cases = sizeof(bench_autorepeat_cases) / sizeof(bench_autorepeat_cases[0]);
+	for (int c = 0; c < cases; c++) {
+		const struct bench_autorepeat_case *x = &bench_autorepeat_cases[c];
+		unsigned int repeats[6];
+		x11_fold_autorepeat(x->events, x->count, repeats);
+		if (memcmp(repeats, x->repeats, x->count * sizeof(unsigned int))) {
+			fprintf(stderr, "autorepeat, %s: repeat counts", x->what);
+			for (int i = 0; i < x->count; i++) { fprintf(stderr, " %u", repeats[i]); }
+			fprintf(stderr, " instead of");
+			for (int i = 0; i < x->count; i++) { fprintf(stderr, " %u", x->repeats[i]); }
+			fprintf(stderr, "\n");
+			return 1;
+		}
+	}
+
+	// Text passed by event loop, that feeds key events to compose; event loop is not run,
+	// so X11 connection is only needed for its fd
+	struct xkb_context *ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	struct xkb_keymap *keymap = bench_keymap(ctx);
+	struct xkb_text text;
+	int x11[2];
+	if (!keymap || !bench_xkb_text(&text) || pipe(x11) < 0) { return 1; }
+	_XPrivDisplay display = (_XPrivDisplay)calloc(1, sizeof(*(_XPrivDisplay)NULL));
+	display->fd = x11[0];
+	struct xkb2win_keycode_table table;
+	xkb2win_keycode_table_build(&table, keymap);
+	// Trace recorded with folding should replay to the same text
+	char trace_path[] = "/tmp/xkb2win-autorepeat-XXXXXX";
+	int trace_fd = mkstemp(trace_path);
+	if (trace_fd >= 0) { close(trace_fd); }
+
+	int failed = trace_fd < 0;
+	for (int c = 0; c < cases && !failed; c++) {
+		const struct bench_autorepeat_case *x = &bench_autorepeat_cases[c];
+		struct bench_autorepeat_text expected;
+		size_t consumed;
+		expected.count = utf8_to_utf16(x->text, strlen(x->text), expected.units, 64, &consumed);
+		for (int fold = 0; fold < 2 && !failed; fold++) {
+			struct x11_translator tr;
+			x11_translator_init(&tr, &table, 0);
+			struct x11_event_loop loop;
+			struct bench_autorepeat_text got;
+			got.count = 0;
+			got.trace = fold ? key_trace_create(trace_path, 0) : NULL;
+			if ((fold && !got.trace) || !x11_event_loop_init(&loop, (Display *)display, NULL, &tr, -1)) {
+				fprintf(stderr, "autorepeat: cannot create event loop or trace\n");
+				if (got.trace) { fclose(got.trace); }
+				failed = 1;
+				break;
+			}
+			loop.xkb_text = &text;
+			loop.fold_repeats = fold;
+			loop.on_key = bench_autorepeat_on_key;
+			loop.user = &got;
+			xkb_compose_state_reset(text.compose);
+			for (int i = 0; i < x->count; i++) {
+				XKeyEvent *xkey = &loop.batch[i].xkey;
+				memset(&loop.batch[i], 0, sizeof(loop.batch[i]));
+				xkey->type = x->events[i].key_down ? KeyPress : KeyRelease;
+				xkey->keycode = x->events[i].keycode;
+				xkey->state = x->events[i].state;
+				xkey->time = x->events[i].time;
+			}
+			x11_event_loop_process(&loop, x->count);
+			x11_event_loop_free(&loop);
+			if (got.count != expected.count || memcmp(got.units, expected.units, got.count * sizeof(unsigned short))) {
+				fprintf(stderr, "autorepeat, %s: %s folding, text is", x->what, fold ? "with" : "without");
+				for (size_t i = 0; i < got.count; i++) { fprintf(stderr, " U+%04X", got.units[i]); }
+				fprintf(stderr, "\n");
+				failed = 1;
+			}
+			if (!got.trace) { continue; }
+
+			if (fclose(got.trace) || !bench_autorepeat_replay(trace_path, &table, &got)) {
+				fprintf(stderr, "autorepeat, %s: cannot write or read trace\n", x->what);
+				failed = 1;
+			} else if (got.count != expected.count || memcmp(got.units, expected.units, got.count * sizeof(unsigned short))) {
+				fprintf(stderr, "autorepeat, %s: replayed trace text is", x->what);
+				for (size_t i = 0; i < got.count; i++) { fprintf(stderr, " U+%04X", got.units[i]); }
+				fprintf(stderr, "\n");
+				failed = 1;
+			}
+		}
+	}
+
+	if (trace_fd >= 0) { unlink(trace_path); }
+	close(x11[0]);
+	close(x11[1]);
+	free(display);
+	xkb_text_free(&text);
+	xkb_keymap_unref(keymap);
+	xkb_context_unref(ctx);
+	return failed;
+}
+
+// Lookup after composed string did not fit into buffer, and what it should give
+struct bench_text_case {
+	const char *what;
+	int discard;          // xkb_text_discard() is called before lookup
+	unsigned int keycode;
+	int key_down;
+	const char *text;
+};
+
+static const struct bench_text_case bench_text_cases[] = {
+	{ "same event again", 0, 26, 1, "\xC3\xA9" },
+	{ "release of the key", 0, 26, 0, "" },
+	{ "other key", 0, 39, 1, "s" },
+	{ "same event after discard", 1, 26, 1, "e" },
+};
+
+// Checks that composed string that did not fit into buffer is given only by lookup of the same event:
+// dead_acute and "e" give "é", that is looked up with too small buffer first
+static int bench_text()
+{
+	struct xkb_text text;
+	if (!bench_xkb_text(&text)) { return 1; }
+	int failed = 0;
+	for (size_t c = 0; c < sizeof(bench_text_cases) / sizeof(bench_text_cases[0]); c++) {
+		const struct bench_text_case *x = &bench_text_cases[c];
+		char buf[16];
+		int dead = xkb_text_lookup(&text, 48, 1, 0, buf, sizeof(buf));
+		int pending = xkb_text_lookup(&text, 26, 1, 0, buf, 1);
+		if (x->discard) { xkb_text_discard(&text); }
+		int len = xkb_text_lookup(&text, x->keycode, x->key_down, 0, buf, sizeof(buf));
+		if (dead != 0 || pending != 2 || len != (int)strlen(x->text) || strcmp(buf, x->text) || xkb_text_composing(&text)) {
+			fprintf(stderr, "text, %s: got \"%s\" (%d), dead key gave %d, cut lookup %d\n", x->what, buf, len, dead, pending);
+			failed = 1;
+		}
+		xkb_text_lookup(&text, x->keycode, 0, 0, buf, sizeof(buf));
+	}
+	xkb_text_free(&text);
+	return failed;
+}
+
+// Key event as it is recorded to trace
+struct bench_trace_event {
+	unsigned int keycode;
+	int key_down;
+	unsigned int state;
+	unsigned int time;
+	char *utf8;
+	size_t utf8_len;
+	size_t recorded_len; // utf8_len as it should be in trace
+};
+
+// Helper function to translate key event and add resulting ESC sequences to checksum
+static unsigned int bench_trace_hash(unsigned int hash, struct x11_translator *tr, unsigned int keycode, int key_down,
+	unsigned int state, const char *utf8, size_t utf8_len, struct win_key_event *events, char *seq)
+{
+	size_t n = x11_translate(tr, keycode, key_down, state, utf8, utf8_len, events, 0x10000);
+	size_t len = win32_input_mode_encode(events, n, seq, 0x10000 * WIN32_INPUT_MODE_SEQ_MAX, NULL);
+	for (size_t i = 0; i < len; i++) { hash = (hash ^ (unsigned char)seq[i]) * 16777619u; }
+	return hash;
+}
+
+// Checks trace write and read round trip, and that replaying trace gives
+// the same ESC sequences as translating key events as they come
+// Nothing is measured here, kp_replay -b measures replay speed
+static int bench_trace()
+{
+	struct xkb_context *ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	struct xkb_keymap *keymap = bench_keymap(ctx);
+	if (!keymap) { xkb_context_unref(ctx); return 1; }
+	struct xkb2win_keycode_table table;
+	xkb2win_keycode_table_build(&table, keymap);
+
+	// Random key events with up to 3 chars of text, and two IME commit strings longer
+	// than trace can keep: they should be cut at char boundary, not inside of a char
+	const int count = 1 << 16;
+	struct bench_trace_event *events = (struct bench_trace_event *)calloc(count, sizeof(struct bench_trace_event));
+	srand(9);
+	for (int i = 0; i < count; i++) {
+		struct bench_trace_event *e = &events[i];
+		e->keycode = 8 + rand() % 248;
+		e->key_down = rand() & 1;
+		e->state = rand() & 0xFFFF;
+		e->time = rand();
+		unsigned int long_cp = (i == 100) ? 0x0436 : (i == 200) ? 0x1F600 : 0;
+		int chars = long_cp ? 0x10000 : rand() % 4;
+		e->utf8 = (char *)malloc(chars * 4 + 1);
+		for (int c = 0; c < chars; c++) {
+			unsigned int cp = long_cp;
+			while (!cp || (cp >= 0xD800 && cp <= 0xDFFF)) { cp = 1 + rand() % 0x10FFFF; }
+			e->utf8_len += bench_utf8_put(cp, e->utf8 + e->utf8_len);
+		}
+		e->recorded_len = e->utf8_len;
+	}
+	events[100].recorded_len = 0xFFFE; // 2 byte chars
+	events[200].recorded_len = 0xFFFC; // 4 byte chars
+
+	char path[] = "/tmp/xkb2win-trace-XXXXXX";
+	int fd = mkstemp(path);
+	FILE *f = NULL;
+	if (fd >= 0) {
+		close(fd);
+		f = key_trace_create(path, 1);
+	}
+	int failed = !f;
+	for (int i = 0; i < count && !failed; i++) {
+		const struct bench_trace_event *e = &events[i];
+		failed = !key_trace_write(f, e->keycode, e->key_down, e->state, e->time, e->utf8, e->utf8_len);
+	}
+	if (f && fclose(f)) { failed = 1; }
+	if (failed) { fprintf(stderr, "trace: cannot write %s\n", path); }
+
+	// Round trip, and the same ESC sequences from replay as from key events themselves
+	struct win_key_event *out = (struct win_key_event *)malloc(0x10000 * sizeof(struct win_key_event));
+	char *seq = (char *)malloc(0x10000 * WIN32_INPUT_MODE_SEQ_MAX);
+	struct key_trace trace;
+	if (!failed && !key_trace_open(&trace, path)) {
+		fprintf(stderr, "trace: cannot read %s\n", path);
+		failed = 1;
+	}
+	if (!failed) {
+		struct x11_translator live, replay;
+		x11_translator_init(&live, &table, 1);
+		x11_translator_init(&replay, &table, trace.numlock);
+		unsigned int live_hash = 2166136261u, replay_hash = 2166136261u;
+		size_t offset = 0;
+		int records = 0;
+		const struct key_trace_record *r;
+		while (!failed && (r = key_trace_next(&trace, &offset)) != NULL) {
+			const struct bench_trace_event *e = &events[records];
+			failed = (records >= count || r->keycode != e->keycode || r->key_down != e->key_down
+				|| r->state != e->state || r->time != e->time || r->utf8_len != e->recorded_len
+				|| memcmp(r->utf8, e->utf8, r->utf8_len));
+			if (failed) { fprintf(stderr, "trace: record %i differs from key event written\n", records); break; }
+			live_hash = bench_trace_hash(live_hash, &live, e->keycode, e->key_down, e->state,
+				e->utf8, e->recorded_len, out, seq);
+			replay_hash = bench_trace_hash(replay_hash, &replay, r->keycode, r->key_down, r->state,
+				r->utf8, r->utf8_len, out, seq);
+			records++;
+		}
+		if (!failed && (records != count || trace.numlock != 1)) {
+			fprintf(stderr, "trace: %i records read instead of %i\n", records, count);
+			failed = 1;
+		}
+		if (!failed && live_hash != replay_hash) {
+			fprintf(stderr, "trace: replay gives different ESC sequences\n");
+			failed = 1;
+		}
+		size_t size = trace.size;
+		key_trace_close(&trace);
+
+		// Record cut by end of file is not returned
+		if (!failed && truncate(path, size - 1) == 0 && key_trace_open(&trace, path)) {
+			offset = 0;
+			records = 0;
+			while (key_trace_next(&trace, &offset)) { records++; }
+			key_trace_close(&trace);
+			if (records != count - 1) {
+				fprintf(stderr, "trace: %i records read from truncated trace instead of %i\n", records, count - 1);
+				failed = 1;
+			}
+		}
+
+		// Other versions are not read
+		if (!failed) {
+			f = fopen(path, "r+b");
+			uint32_t version = KEY_TRACE_VERSION + 1;
+			if (f && fseek(f, offsetof(struct key_trace_header, version), SEEK_SET) == 0) {
+				fwrite(&version, sizeof(version), 1, f);
+			}
+			if (f) { fclose(f); }
+			if (key_trace_open(&trace, path)) {
+				key_trace_close(&trace);
+				fprintf(stderr, "trace: trace of other version is read\n");
+				failed = 1;
+			}
+		}
+	}
+	unlink(path);
+
+	free(seq);
+	free(out);
+	for (int i = 0; i < count; i++) { free(events[i].utf8); }
+	free(events);
+	xkb_keymap_unref(keymap);
+	xkb_context_unref(ctx);
+	return failed;
+}
+
+// Override files, in the order they are loaded, and what they should give
+struct bench_overrides_case {
+	const char *what;
+	const char *text;   // file contents with %d for keycode of semicolon key, NULL to delete file
+	int error_line;     // expected reload error, active table is kept then
+};
+
+#define BENCH_OVERRIDES_X64 "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+
+static const struct bench_overrides_case bench_overrides_cases[] = {
+	{ "no file", NULL, 0 },
+	{ "overrides",
+		"# keycode line wins over keysym line, whatever their order is\n"
+		"keycode %d 0x11 0x22 1\n"
+		"keysym semicolon 0xBA 0x27\n"
+		"keysym 1 0x31 0x99   # digit name, not KeySym 0x1\n"
+		"keysym 0x2c 0xBC 0x55\n", 0 },
+	{ "unknown KeySym", "keysym 1 0x31 0x98\nkeysym no_such_key 1 2\n", 2 },
+	{ "KeySym of other layout", "keysym Cyrillic_a 0x41 0x1E\n", 1 },
+	{ "KeySym value no key has", "keysym 0x5 0x41 0x1E\n", 1 },
+	{ "decimal KeySym value", "\n# comment\nkeysym 44 0xBC 0x55\n", 3 },
+	{ "keycode out of range", "keycode 256 1 2\n", 1 },
+	{ "vk out of range", "keycode 10 0x100 2\n", 1 },
+	{ "enhanced out of range", "keycode 10 1 2 2\n", 1 },
+	{ "too many fields", "keycode 10 1 2 1 1\n", 1 },
+	{ "unknown kind", "scancode 10 1 2\n", 1 },
+	{ "too long line", "keycode 10 1 2\n# " BENCH_OVERRIDES_X64 BENCH_OVERRIDES_X64 BENCH_OVERRIDES_X64
+		BENCH_OVERRIDES_X64 "\nkeycode 10 1 2\n", 2 },
+	{ "file deleted", NULL, 0 },
+};
+
+// Checks override file parsing and reloading: keycode lines win over keysym lines,
+// file with errors keeps previous table, deleted file gives base table back
+static int bench_overrides()
+{
+	struct xkb_context *ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	struct xkb_keymap *keymap = bench_keymap(ctx);
+	if (!keymap) { return 1; }
+	struct xkb2win_keycode_table base;
+	xkb2win_keycode_table_build(&base, keymap);
+	int semicolon = 0, digit1 = 0, comma = 0;
+	for (int k = 0; k < 256; k++) {
+		if (base.keys[0][k].sym == XKB_KEY_semicolon) { semicolon = k; }
+		if (base.keys[0][k].sym == XKB_KEY_1) { digit1 = k; }
+		if (base.keys[0][k].sym == XKB_KEY_comma) { comma = k; }
+	}
+
+	char dir[] = "/tmp/xkb2win-overrides-XXXXXX";
+	char path[sizeof(dir) + 16];
+	if (!mkdtemp(dir)) { return 1; }
+	snprintf(path, sizeof(path), "%s/overrides", dir);
+
+	struct key_overrides ov;
+	int failed = !key_overrides_init(&ov, &base, path, 1);
+	if (failed) { fprintf(stderr, "overrides: missing file is an error\n"); }
+	const struct xkb2win_keycode_table *loaded = NULL;
+	for (size_t c = 0; c < sizeof(bench_overrides_cases) / sizeof(bench_overrides_cases[0]) && !failed; c++) {
+		const struct bench_overrides_case *oc = &bench_overrides_cases[c];
+		const struct xkb2win_keycode_table *before = key_overrides_table(&ov);
+		if (oc->text) {
+			char text[512];
+			snprintf(text, sizeof(text), oc->text, semicolon);
+			FILE *f = fopen(path, "w");
+			if (!f || fputs(text, f) < 0 || fclose(f)) { failed = 1; break; }
+		} else {
+			unlink(path);
+		}
+
+		// File change comes through inotify, as it does in event loop
+		int result = key_overrides_poll(&ov);
+		if (c == 0) { result = 1; } // nothing changed yet
+		const struct xkb2win_keycode_table *table = key_overrides_table(&ov);
+		if (oc->error_line) {
+			if (result != -1 || ov.error_line != oc->error_line || table != before) {
+				fprintf(stderr, "overrides: %s: reload gave %d, error at line %d instead of %d\n",
+					oc->what, result, ov.error_line, oc->error_line);
+				failed = 1;
+			}
+			continue;
+		}
+		if (result != 1 || ov.error_line) {
+			fprintf(stderr, "overrides: %s: reload gave %d, error at line %d\n", oc->what, result, ov.error_line);
+			failed = 1;
+			continue;
+		}
+		// With no translator attached, nothing reads replaced table, it is freed at once
+		if (ov.retired) {
+			fprintf(stderr, "overrides: %s: replaced table is kept with no readers\n", oc->what);
+			failed = 1;
+		}
+		if (!oc->text) {
+			if (memcmp(table, &base, sizeof(base))) {
+				fprintf(stderr, "overrides: %s: table differs from base one\n", oc->what);
+				failed = 1;
+			}
+			continue;
+		}
+
+		loaded = table;
+		const struct winkey expected[3] = { { 0x11, 0x22, 1 }, { 0x31, 0x99, 0 }, { 0xBC, 0x55, 0 } };
+		const int keycodes[3] = { semicolon, digit1, comma };
+		for (int i = 0; i < 3; i++) {
+			for (int numlock = 0; numlock < 2; numlock++) {
+				const struct winkey *key = &table->keys[numlock][keycodes[i]].key;
+				if (key->vk != expected[i].vk || key->scan != expected[i].scan || key->enhanced != expected[i].enhanced) {
+					fprintf(stderr, "overrides: %s: keycode %d has %02X %02X %d\n", oc->what, keycodes[i],
+						key->vk, key->scan, key->enhanced);
+					failed = 1;
+				}
+			}
+		}
+		// Everything else is left as is
+		for (int numlock = 0; numlock < 2; numlock++) {
+			for (int k = 0; k < 256; k++) {
+				if (k == semicolon || k == digit1 || k == comma) { continue; }
+				if (memcmp(&table->keys[numlock][k], &base.keys[numlock][k], sizeof(struct xkb2win_keycode))) {
+					fprintf(stderr, "overrides: %s: keycode %d is changed\n", oc->what, k);
+					failed = 1;
+				}
+			}
+		}
+	}
+	if (!failed && !loaded) { failed = 1; }
+
+	key_overrides_free(&ov);
+	unlink(path);
+	rmdir(dir);
+	xkb_keymap_unref(keymap);
+	xkb_context_unref(ctx);
+	return failed;
+}
+
+// Reader translating in its own thread while overrides are reloaded
+struct bench_reload_reader {
+	pthread_t thread;
+	struct key_overrides *ov;
+	int keycode;
+	int stop;            // set by reloading thread
+	unsigned long count; // translations done
+	unsigned long wrong; // translations giving key codes no table has
+};
+
+static void *bench_reload_run(void *arg)
+{
+	struct bench_reload_reader *r = (struct bench_reload_reader *)arg;
+	struct x11_translator tr;
+	x11_translator_init(&tr, r->ov->base, 0);
+	key_overrides_attach(r->ov, &tr);
+	while (!__atomic_load_n(&r->stop, __ATOMIC_RELAXED)) {
+		struct win_key_event e;
+		x11_translate(&tr, r->keycode, 1, 0, NULL, 0, &e, 1);
+		if (!((e.vk == 0x11 && e.scan == 0x22) || (e.vk == 0x31 && e.scan == 0x99))) { r->wrong++; }
+		r->count++;
+	}
+	key_overrides_detach(r->ov, &tr);
+	return NULL;
+}
+
+// Helper function to write override file
+static int bench_reload_write(const char *path, const char *format, int keycode)
+{
+	FILE *f = fopen(path, "w");
+	return f && fprintf(f, format, keycode) > 0 && !fclose(f);
+}
+
+// Checks that reload does not free table translator is reading:
+// table held by translator survives reloads until it is released,
+// and translators in other threads always get whole table while it is reloaded
+static int bench_reload()
+{
+	struct xkb_context *ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	struct xkb_keymap *keymap = bench_keymap(ctx);
+	if (!keymap) { return 1; }
+	struct xkb2win_keycode_table base;
+	xkb2win_keycode_table_build(&base, keymap);
+	int semicolon = 0;
+	for (int k = 0; k < 256; k++) {
+		if (base.keys[0][k].sym == XKB_KEY_semicolon) { semicolon = k; }
+	}
+	const char *texts[2] = { "keycode %d 0x11 0x22 1\n", "keycode %d 0x31 0x99\n" };
+
+	char dir[] = "/tmp/xkb2win-reload-XXXXXX";
+	char path[sizeof(dir) + 16];
+	if (!mkdtemp(dir)) { return 1; }
+	snprintf(path, sizeof(path), "%s/overrides", dir);
+	struct key_overrides ov;
+	if (!bench_reload_write(path, texts[0], semicolon) || !key_overrides_init(&ov, &base, path, 0)) {
+		fprintf(stderr, "reload: can not load overrides\n");
+		unlink(path);
+		rmdir(dir);
+		return 1;
+	}
+	int failed = 0;
+
+	// Translator stopped in the middle of lookup, as if preempted, while file is reloaded twice
+	struct x11_translator tr;
+	x11_translator_init(&tr, &base, 0);
+	key_overrides_attach(&ov, &tr);
+	const struct xkb2win_keycode_table *held = key_overrides_table(&ov);
+	struct xkb2win_keycode_table copy = *held;
+	tr.reading = ov.epoch + 1; // as x11_translate() announces it
+	for (int i = 0; i < 2 && !failed; i++) {
+		failed = !bench_reload_write(path, texts[(i + 1) & 1], semicolon) || key_overrides_reload(&ov) != 1;
+	}
+	int kept = 0;
+	for (const struct key_overrides_table *t = ov.retired; t; t = t->next) {
+		if (&t->table == held) { kept = 1; }
+	}
+	if (!failed && (!kept || memcmp(held, &copy, sizeof(copy)))) {
+		fprintf(stderr, "reload: table held by translator is freed or changed\n");
+		failed = 1;
+	}
+	// Released table is freed by next reload
+	tr.reading = 0;
+	if (!failed && (!bench_reload_write(path, texts[0], semicolon) || key_overrides_reload(&ov) != 1 || ov.retired)) {
+		fprintf(stderr, "reload: released tables are not freed\n");
+		failed = 1;
+	}
+	key_overrides_detach(&ov, &tr);
+
+	// Readers in other threads, while file is reloaded over and over
+	const int readers = 4;
+	struct bench_reload_reader r[readers];
+	int started = 0;
+	for (; started < readers && !failed; started++) {
+		memset(&r[started], 0, sizeof(r[started]));
+		r[started].ov = &ov;
+		r[started].keycode = semicolon;
+		pthread_create(&r[started].thread, NULL, bench_reload_run, &r[started]);
+	}
+	for (int i = 0; i < 2000 && !failed; i++) {
+		if (!bench_reload_write(path, texts[i & 1], semicolon) || key_overrides_reload(&ov) != 1) {
+			fprintf(stderr, "reload: reload %d failed\n", i);
+			failed = 1;
+		}
+	}
+	for (int i = 0; i < started; i++) { __atomic_store_n(&r[i].stop, 1, __ATOMIC_RELAXED); }
+	for (int i = 0; i < started; i++) {
+		pthread_join(r[i].thread, NULL);
+		if (!failed && r[i].wrong) {
+			fprintf(stderr, "reload: reader %d got %lu wrong translations of %lu\n", i, r[i].wrong, r[i].count);
+			failed = 1;
+		}
+	}
+	if (!failed && ov.readers) {
+		fprintf(stderr, "reload: detached translators are still listed\n");
+		failed = 1;
+	}
+	// With nobody reading, every replaced table is freed
+	if (!failed && (!bench_reload_write(path, texts[0], semicolon) || key_overrides_reload(&ov) != 1 || ov.retired)) {
+		fprintf(stderr, "reload: replaced tables are kept after readers are gone\n");
+		failed = 1;
+	}
+
+	key_overrides_free(&ov);
+	unlink(path);
+	rmdir(dir);
+	xkb_keymap_unref(keymap);
+	xkb_context_unref(ctx);
+	return failed;
+}
+
+// Checksum of key events, for checking what other process got
+static unsigned int bench_ring_hash(unsigned int hash, const struct win_key_event *e)
+{
+	const unsigned int fields[6] = { e->vk, e->scan, e->unicode, e->key_down, e->control_key_state, e->repeat_count };
+	for (int i = 0; i < 6; i++) { hash = (hash ^ fields[i]) * 16777619u; }
+	return hash;
+}
+
+struct bench_ring_consumer {
+	unsigned int hash;
+	size_t count;
+};
+
+static void bench_ring_on_event(void *user, const struct win_key_event *event)
+{
+	struct bench_ring_consumer *c = (struct bench_ring_consumer *)user;
+	c->hash = bench_ring_hash(c->hash, event);
+	c->count++;
+}
+
+static void bench_ring_on_text(void *, const char *, size_t)
+{
+}
+
+// App side, runs in child process: reads count key events from ring (if ring_name is given)
+// or from pty as ESC sequences, acks each of them in ping mode, then writes checksum to ack_fd.
+// If both are given, key events are read from pty until KEY_RING_START, and then from ring.
+static void bench_ring_consume(const char *ring_name, int pty, size_t count, int ping, int ack_fd)
+{
+	struct bench_ring_consumer c = { 2166136261u, 0 };
+	if (ring_name) {
+		struct key_ring ring;
+		if (!key_ring_connect(&ring, ring_name)) { _exit(1); }
+		if (pty >= 0) {
+			struct win32_input_decoder decoder;
+			win32_input_decoder_init(&decoder, bench_ring_on_event, bench_ring_on_text, &c);
+			struct key_ring_scanner scanner = { 0 };
+			// Small reads, so KEY_RING_START is split between them
+			char buf[7];
+			for (const char *start = NULL; !start; ) {
+				ssize_t n = read(pty, buf, sizeof(buf));
+				if (n <= 0) { _exit(1); }
+				start = key_ring_find_start(&scanner, buf, n);
+				win32_input_decode(&decoder, buf, start ? (size_t)(start - buf) : (size_t)n);
+			}
+		}
+		struct win_key_event events[256];
+		while (c.count < count) {
+			size_t n = key_ring_pop(&ring, events, 256);
+			for (size_t i = 0; i < n; i++) { bench_ring_on_event(&c, &events[i]); }
+			if (n) {
+				if (ping && write(ack_fd, "", 1) != 1) { _exit(1); }
+			} else if (key_ring_prepare_wait(&ring)) {
+				struct pollfd pfd = { ring.eventfd, POLLIN, 0 };
+				poll(&pfd, 1, -1);
+				key_ring_wakeup(&ring);
+			}
+		}
+		key_ring_free(&ring);
+	} else {
+		struct win32_input_decoder decoder;
+		win32_input_decoder_init(&decoder, bench_ring_on_event, bench_ring_on_text, &c);
+		char buf[4096];
+		while (c.count < count) {
+			ssize_t n = read(pty, buf, sizeof(buf));
+			if (n <= 0) { _exit(1); }
+			size_t before = c.count;
+			win32_input_decode(&decoder, buf, n);
+			if (ping && c.count > before && write(ack_fd, "", 1) != 1) { _exit(1); }
+		}
+	}
+	_exit(write(ack_fd, &c.hash, sizeof(c.hash)) == sizeof(c.hash) ? 0 : 1);
+}
+
+// Helper function to read exactly len bytes
+static int bench_ring_read(int fd, void *buf, size_t len)
+{
+	for (size_t got = 0; got < len; ) {
+		ssize_t n = read(fd, (char *)buf + got, len - got);
+		if (n <= 0) { return 0; }
+		got += n;
+	}
+	return 1;
+}
+
+// Helper function to wait until app reads key events from full ring, as event loop does
+// return
+//   1 if there is space in ring, 0 if app has not read anything for 5 s
+static int bench_ring_wait_space(struct key_ring *ring)
+{
+	if (!key_ring_prepare_space_wait(ring)) { return 1; }
+	struct pollfd pfd = { ring->space_eventfd, POLLIN, 0 };
+	int ready = poll(&pfd, 1, 5000) == 1;
+	key_ring_space_wakeup(ring);
+	return ready;
+}
+
+// Passes key events to child process through ring, or through pty as terminal does without it.
+// In ping mode each key event waits until child gets it.
+// return
+//   elapsed ns, or 0 if child got different key events
+static double bench_ring_run(int use_ring, const struct win_key_event *events, size_t count, int ping,
+	unsigned int expected)
+{
+	struct key_ring ring;
+	key_ring_init(&ring);
+	int master = -1, slave = -1, ack[2];
+	if (pipe(ack) < 0) { return 0; }
+	if (use_ring) {
+		if (!key_ring_create(&ring)) { return 0; }
+	} else {
+		// Raw mode: no echo, no flow control, bytes pass as they are
+		master = posix_openpt(O_RDWR | O_NOCTTY);
+		if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) { return 0; }
+		slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+		struct termios tio;
+		if (slave < 0 || tcgetattr(slave, &tio) < 0) { return 0; }
+		cfmakeraw(&tio);
+		tcsetattr(slave, TCSANOW, &tio);
+	}
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(ack[0]);
+		if (master >= 0) { close(master); }
+		bench_ring_consume(use_ring ? ring.name : NULL, slave, count, ping, ack[1]);
+	}
+	close(ack[1]);
+	if (slave >= 0) { close(slave); }
+
+	int ok = (pid > 0);
+	if (ok && use_ring) {
+		struct pollfd pfd = { ring.listen_fd, POLLIN, 0 };
+		ok = poll(&pfd, 1, 5000) == 1 && key_ring_accept(&ring);
+	}
+
+	char *buf = (char *)malloc(4096);
+	double start = now_ns();
+	for (size_t i = 0; i < count && ok; ) {
+		size_t n = ping ? 1 : count - i;
+		if (use_ring) {
+			n = key_ring_push(&ring, events + i, n);
+			if (!n) { ok = bench_ring_wait_space(&ring); }
+		} else {
+			size_t len = win32_input_mode_encode(events + i, n, buf, 4096, &n);
+			ok = write(master, buf, len) == (ssize_t)len;
+		}
+		i += n;
+		char byte;
+		if (ping && n) { ok = ok && bench_ring_read(ack[0], &byte, 1); }
+	}
+	unsigned int hash = 0;
+	ok = ok && bench_ring_read(ack[0], &hash, sizeof(hash));
+	double elapsed = now_ns() - start;
+
+	if (pid > 0) {
+		if (!ok) { kill(pid, SIGKILL); }
+		waitpid(pid, NULL, 0);
+	}
+	free(buf);
+	close(ack[0]);
+	if (master >= 0) { close(master); }
+	key_ring_free(&ring);
+	return (ok && hash == expected) ? elapsed : 0;
+}
+
+static int bench_ring()
+{
+	const int count = 1 << 20;
+	const int pings = 10000;
+	srand(7);
+	struct win_key_event *events = bench_random_events(count);
+	unsigned int expected = 2166136261u, expected_pings = 2166136261u;
+	for (int i = 0; i < count; i++) {
+		expected = bench_ring_hash(expected, &events[i]);
+		if (i < pings) { expected_pings = bench_ring_hash(expected_pings, &events[i]); }
+	}
+
+	// Best of several runs, for throughput and for round trip of single key event
+	double best[2][2] = { { 1e18, 1e18 }, { 1e18, 1e18 } };
+	int failed = 0;
+	const int repeats = bench_repeats ? bench_repeats : 1;
+	for (int repeat = 0; repeat < repeats && !failed; repeat++) {
+		for (int use_ring = 0; use_ring < 2 && !failed; use_ring++) {
+			for (int ping = 0; ping < 2 && !failed; ping++) {
+				double elapsed = bench_ring_run(use_ring, events, ping ? pings : count, ping,
+					ping ? expected_pings : expected);
+				if (!elapsed) {
+					fprintf(stderr, "ring: app got different key events through %s\n", use_ring ? "ring" : "pty");
+					failed = 1;
+				}
+				if (elapsed < best[use_ring][ping]) { best[use_ring][ping] = elapsed; }
+			}
+		}
+	}
+
+	if (!failed && bench_repeats) {
+		printf("ring: throughput pty %.1f M events/s, ring %.1f M events/s (x%.1f); "
+			"round trip pty %.1f us, ring %.1f us (x%.1f)\n",
+			count * 1e3 / best[0][0], count * 1e3 / best[1][0], best[0][0] / best[1][0],
+			best[0][1] / pings / 1e3, best[1][1] / pings / 1e3, best[0][1] / best[1][1]);
+	}
+
+	free(events);
+	return failed;
+}
+
+// Checks event loop output path on fds epoll can not watch (regular file, /dev/null) and on pipe:
+// everything appended is written, in the same bytes encoder gives
+static int bench_output()
+{
+	// Event loop is not run, so X11 connection is only needed for its fd
+	int x11[2];
+	if (pipe(x11) < 0) { return 1; }
+	_XPrivDisplay display = (_XPrivDisplay)calloc(1, sizeof(*(_XPrivDisplay)NULL));
+	display->fd = x11[0];
+
+	// Larger than output chunk, and than pipe buffer for regular file
+	const int counts[3] = { 20000, 20000, 100 };
+	srand(12);
+	struct win_key_event *events = bench_random_events(counts[0]);
+	char *expected = (char *)malloc(counts[0] * 64);
+	char *got = (char *)malloc(counts[0] * 64);
+
+	char path[] = "/tmp/xkb2win-output-XXXXXX";
+	int file = mkstemp(path);
+	int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	int out[2] = { -1, -1 };
+	int failed = file < 0 || null < 0 || pipe(out) < 0;
+	const int fds[3] = { file, null, out[1] };
+	const char *const names[3] = { "regular file", "/dev/null", "pipe" };
+	for (int f = 0; f < 3 && !failed; f++) {
+		size_t encoded, len = win32_input_mode_encode(events, counts[f], expected, counts[f] * 64, &encoded);
+		struct x11_event_loop loop;
+		if (!x11_event_loop_init(&loop, (Display *)display, NULL, NULL, fds[f]) || loop.pty_watched != (f == 2)) {
+			fprintf(stderr, "output: %s: cannot create event loop, or it is %swatched\n", names[f],
+				loop.pty_watched ? "" : "not ");
+			failed = 1;
+		} else {
+			x11_event_loop_append(&loop, events, counts[f]);
+			if (x11_event_loop_output(&loop) != 1) {
+				fprintf(stderr, "output: %s: output is not written completely\n", names[f]);
+				failed = 1;
+			}
+		}
+		x11_event_loop_free(&loop);
+
+		if (f == 2) {
+			close(out[1]);
+			out[1] = -1;
+		}
+		int in = (f == 0) ? open(path, O_RDONLY | O_CLOEXEC) : (f == 2) ? out[0] : -1;
+		if (!failed && in >= 0 && (!bench_ring_read(in, got, len) || memcmp(got, expected, len) || read(in, got, 1) > 0)) {
+			fprintf(stderr, "output: %s: written bytes differ from encoder output\n", names[f]);
+			failed = 1;
+		}
+		if (f == 0 && in >= 0) { close(in); }
+	}
+
+	if (file >= 0) { close(file); unlink(path); }
+	if (null >= 0) { close(null); }
+	if (out[0] >= 0) { close(out[0]); }
+	if (out[1] >= 0) { close(out[1]); }
+	close(x11[0]);
+	close(x11[1]);
+	free(display);
+	free(got);
+	free(expected);
+	free(events);
+	return failed;
+}
+
+// App output split in pieces as it may come from pty, and count of KEY_RING_REQUEST in it
+struct bench_handshake_case {
+	const char *what;
+	const char *output;
+	size_t requests;
+};
+
+static const struct bench_handshake_case bench_handshake_cases[] = {
+	{ "request", KEY_RING_REQUEST, 1 },
+	{ "request in text", "text" KEY_RING_REQUEST "text", 1 },
+	{ "two requests", KEY_RING_REQUEST "\x1b[0m" KEY_RING_REQUEST, 2 },
+	{ "request after ESC", "\x1b" KEY_RING_REQUEST, 1 },
+	{ "request after cut request", "\x1b_xkb2win-ring\x1b" KEY_RING_REQUEST, 1 },
+	{ "request starting at ESC of cut request", "\x1b_xkb2win-ring" KEY_RING_REQUEST, 1 },
+	{ "request after cut name", "\x1b_xkb2win-" KEY_RING_REQUEST, 1 },
+	{ "cut name", "\x1b_xkb2win-rin\x1b\\", 0 },
+	{ "other APC", "\x1b_xkb2win-ringing\x1b\\", 0 },
+	{ "reply", KEY_RING_REPLY_PREFIX "name" KEY_RING_REPLY_SUFFIX, 0 },
+	{ "no ESC", "_xkb2win-ring\x1b\\", 0 },
+};
+
+// App input with KEY_RING_START, and offset of the char next to it (0 if it should not be found)
+struct bench_switch_case {
+	const char *what;
+	const char *input;
+	size_t next;
+};
+
+static const struct bench_switch_case bench_switch_cases[] = {
+	{ "start", KEY_RING_START, sizeof(KEY_RING_START) - 1 },
+	{ "start after key event", "\x1b[65;30;97;1;0;1_" KEY_RING_START "\x1b[B", sizeof("\x1b[65;30;97;1;0;1_" KEY_RING_START) - 1 },
+	{ "start after request", KEY_RING_REQUEST KEY_RING_START, sizeof(KEY_RING_REQUEST KEY_RING_START) - 1 },
+	{ "start after cut start", "\x1b_xkb2win-ring-st" KEY_RING_START, sizeof("\x1b_xkb2win-ring-st" KEY_RING_START) - 1 },
+	{ "request", KEY_RING_REQUEST, 0 },
+	{ "reply", KEY_RING_REPLY_PREFIX "name" KEY_RING_REPLY_SUFFIX, 0 },
+	{ "cut start", "\x1b_xkb2win-ring-star\x1b\\", 0 },
+};
+
+// Checks switch of app input from pty to ring: KEY_RING_START is found however it is split
+// between reads, and key events event loop has queued for pty before app connects are followed
+// by it, so app gets all key events in order
+static int bench_handshake_switch()
+{
+	int failed = 0;
+	for (size_t c = 0; c < sizeof(bench_switch_cases) / sizeof(bench_switch_cases[0]); c++) {
+		const struct bench_switch_case *sc = &bench_switch_cases[c];
+		size_t len = strlen(sc->input);
+		// Whole, split in two at every position, and byte by byte
+		for (size_t split = 0; split <= len + 1 && !failed; split++) {
+			struct key_ring_scanner scanner = { 0 };
+			const char *next = NULL;
+			if (split <= len) {
+				next = key_ring_find_start(&scanner, sc->input, split);
+				if (!next) { next = key_ring_find_start(&scanner, sc->input + split, len - split); }
+			} else {
+				for (size_t i = 0; i < len && !next; i++) { next = key_ring_find_start(&scanner, sc->input + i, 1); }
+			}
+			if (next != (sc->next ? sc->input + sc->next : NULL)) {
+				fprintf(stderr, "handshake: %s: start is found at %td instead of %zu\n", sc->what,
+					next ? next - sc->input : (ptrdiff_t)0, sc->next);
+				failed = 1;
+			}
+		}
+	}
+
+	// Event loop is not run, so X11 connection is only needed for its fd
+	int x11[2], out[2] = { -1, -1 }, ack[2] = { -1, -1 };
+	if (pipe(x11) < 0) { return 1; }
+	_XPrivDisplay display = (_XPrivDisplay)calloc(1, sizeof(*(_XPrivDisplay)NULL));
+	display->fd = x11[0];
+	const size_t count = 1000;
+	srand(13);
+	struct win_key_event *events = bench_random_events(count);
+	unsigned int expected = 2166136261u, hash = 0;
+	for (size_t i = 0; i < count; i++) { expected = bench_ring_hash(expected, &events[i]); }
+
+	struct key_ring ring;
+	struct x11_event_loop loop;
+	key_ring_init(&ring);
+	memset(&loop, 0, sizeof(loop));
+	loop.epoll_fd = -1;
+	if (failed || pipe(out) < 0 || pipe(ack) < 0 || !key_ring_create(&ring)
+		|| !x11_event_loop_init(&loop, (Display *)display, NULL, NULL, out[1])) {
+		failed = 1;
+	}
+	loop.ring = &ring;
+
+	// Half of key events is queued for pty, and is not written yet when app connects
+	pid_t pid = failed ? -1 : fork();
+	if (pid == 0) {
+		close(out[1]);
+		close(ack[0]);
+		bench_ring_consume(ring.name, out[0], count, 0, ack[1]);
+	}
+	if (pid > 0) {
+		close(ack[1]);
+		ack[1] = -1;
+		x11_event_loop_append(&loop, events, count / 2);
+		struct pollfd pfd = { ring.listen_fd, POLLIN, 0 };
+		int ok = poll(&pfd, 1, 5000) == 1 && x11_event_loop_accept_ring(&loop);
+		if (ok) { x11_event_loop_append(&loop, events + count / 2, count - count / 2); }
+		for (int written = 0; ok && written != 1; ) {
+			written = x11_event_loop_output(&loop);
+			struct pollfd pty = { out[1], POLLOUT, 0 };
+			ok = written == 1 || (written == 0 && poll(&pty, 1, 5000) == 1);
+		}
+		// App waiting for KEY_RING_START after all pty output gets EOF instead
+		close(out[1]);
+		out[1] = -1;
+		while (ok && loop.ring_pending_count && !x11_event_loop_ring_flush(&loop)) { ok = bench_ring_wait_space(&ring); }
+		ok = ok && bench_ring_read(ack[0], &hash, sizeof(hash));
+		if (!ok) { kill(pid, SIGKILL); }
+		waitpid(pid, NULL, 0);
+	}
+	if (!failed && hash != expected) {
+		fprintf(stderr, "handshake: app switched from pty to ring got different key events\n");
+		failed = 1;
+	}
+
+	x11_event_loop_free(&loop);
+	key_ring_free(&ring);
+	const int fds[6] = { out[0], out[1], ack[0], ack[1], x11[0], x11[1] };
+	for (int i = 0; i < 6; i++) {
+		if (fds[i] >= 0) { close(fds[i]); }
+	}
+	free(display);
+	free(events);
+	return failed;
+}
+
+// Checks negotiation of key ring, as app and terminal do it over pty:
+// request is found in app output however it is split between reads, reply is found in app input
+// however it is split too, and app that connected with name from reply gets key events through ring
+static int bench_handshake()
+{
+	int failed = 0;
+	for (size_t c = 0; c < sizeof(bench_handshake_cases) / sizeof(bench_handshake_cases[0]); c++) {
+		const struct bench_handshake_case *hc = &bench_handshake_cases[c];
+		size_t len = strlen(hc->output);
+		// Whole, split in two at every position, and byte by byte
+		for (size_t split = 0; split <= len + 1; split++) {
+			struct key_ring_scanner scanner = { 0 };
+			size_t found = 0;
+			if (split <= len) {
+				found += key_ring_scan(&scanner, hc->output, split);
+				found += key_ring_scan(&scanner, hc->output + split, len - split);
+			} else {
+				for (size_t i = 0; i < len; i++) { found += key_ring_scan(&scanner, hc->output + i, 1); }
+			}
+			if (found != hc->requests) {
+				fprintf(stderr, "handshake: %s: %zu requests found instead of %zu\n", hc->what, found, hc->requests);
+				failed = 1;
+				break;
+			}
+		}
+	}
+
+	struct key_ring ring;
+	if (!key_ring_create(&ring)) {
+		fprintf(stderr, "handshake: cannot create ring\n");
+		return 1;
+	}
+	char reply[128], input[256], name[64];
+	size_t reply_len = key_ring_reply(&ring, reply, sizeof(reply));
+	int input_len = snprintf(input, sizeof(input), "\x1b[Ax%.*s\x1b[B", (int)reply_len, reply);
+	const size_t reply_at = 4;
+
+	// App may have read only part of reply
+	for (size_t len = 0; len < reply_at + reply_len && !failed; len++) {
+		if (key_ring_parse_reply(input, len, name, sizeof(name))) {
+			fprintf(stderr, "handshake: reply found in its first %zu bytes\n", len - reply_at);
+			failed = 1;
+		}
+	}
+	const char *next = key_ring_parse_reply(input, input_len, name, sizeof(name));
+	if (!next || next != input + reply_at + reply_len || strcmp(name, ring.name)) {
+		fprintf(stderr, "handshake: reply not found in app input\n");
+		failed = 1;
+	}
+	if (key_ring_parse_reply(input, input_len, name, strlen(ring.name))) {
+		fprintf(stderr, "handshake: socket name is longer than buffer, but reply is accepted\n");
+		failed = 1;
+	}
+
+	// App connects with that name and gets key events
+	const size_t count = 1000;
+	srand(11);
+	struct win_key_event *events = bench_random_events(count);
+	unsigned int expected = 2166136261u, hash = 0;
+	for (size_t i = 0; i < count; i++) { expected = bench_ring_hash(expected, &events[i]); }
+	int ack[2];
+	pid_t pid = (!failed && pipe(ack) == 0) ? fork() : -1;
+	if (pid == 0) {
+		close(ack[0]);
+		bench_ring_consume(name, -1, count, 0, ack[1]);
+	}
+	if (pid > 0) {
+		close(ack[1]);
+		struct pollfd pfd = { ring.listen_fd, POLLIN, 0 };
+		int ok = poll(&pfd, 1, 5000) == 1 && key_ring_accept(&ring);
+
+		// Other process can not take ring over while app is connected
+		int conn_fd = ring.conn_fd, status = -1;
+		pid_t other = ok ? fork() : -1;
+		if (other == 0) {
+			struct key_ring taken;
+			_exit(key_ring_connect(&taken, name) ? 1 : 0);
+		}
+		if (other > 0) {
+			int refused = poll(&pfd, 1, 5000) == 1 && !key_ring_accept(&ring) && ring.conn_fd == conn_fd;
+			if (waitpid(other, &status, 0) != other || !WIFEXITED(status) || WEXITSTATUS(status) || !refused) {
+				fprintf(stderr, "handshake: second connection is not refused while app is connected\n");
+				failed = 1;
+			}
+		}
+
+		for (size_t i = 0; i < count && ok; ) {
+			size_t n = key_ring_push(&ring, events + i, count - i);
+			if (!n) { ok = bench_ring_wait_space(&ring); }
+			i += n;
+		}
+		ok = ok && bench_ring_read(ack[0], &hash, sizeof(hash));
+		if (!ok) { kill(pid, SIGKILL); }
+		waitpid(pid, NULL, 0);
+		close(ack[0]);
+	}
+	if (!failed && hash != expected) {
+		fprintf(stderr, "handshake: app connected with name from reply got different key events\n");
+		failed = 1;
+	}
+
+	free(events);
+	key_ring_free(&ring);
+	return bench_handshake_switch() || failed;
+}
+
+#ifdef XKB2WIN_LATENCY
+// Checks latency histogram math: buckets cover all values without gaps or overlaps,
+// with error below 1/8, and percentiles come from the right buckets
+static int bench_latency()
+{
+	int failed = 0;
+	for (unsigned int b = 0; b < KEY_LATENCY_BUCKETS && !failed; b++) {
+		unsigned long long max = key_latency_bucket_max(b);
+		unsigned long long min = b ? key_latency_bucket_max(b - 1) + 1 : 0;
+		if (min > max || key_latency_bucket(min) != b || key_latency_bucket(max) != b) {
+			fprintf(stderr, "latency: bucket %u is %llu..%llu, they fall into buckets %u and %u\n",
+				b, min, max, key_latency_bucket(min), key_latency_bucket(max));
+			failed = 1;
+		} else if (min >= 8 && (max - min) * 8 >= min) {
+			fprintf(stderr, "latency: bucket %u is %llu..%llu, error is 1/8 or more\n", b, min, max);
+			failed = 1;
+		}
+	}
+	if (!failed && key_latency_bucket_max(KEY_LATENCY_BUCKETS - 1) != ~0ULL) {
+		fprintf(stderr, "latency: last bucket ends at %llu\n", key_latency_bucket_max(KEY_LATENCY_BUCKETS - 1));
+		failed = 1;
+	}
+
+	// Percentiles of 1..1000 ns, of single value, and of values in two distant buckets
+	static struct key_latency_histogram h;
+	const unsigned int permille[4] = { 1, 500, 990, 999 };
+	const struct {
+		const char *what;
+		unsigned long long values[3]; // first value, last value, step
+		unsigned long long expected[4];
+	} cases[] = {
+		{ "1..1000", { 1, 1000, 1 }, { 1, 511, 1023, 1023 } },
+		{ "single value", { 12345, 12345, 1 }, { 13311, 13311, 13311, 13311 } },
+		{ "two buckets", { 100, 1000000, 999900 }, { 103, 103, 1048575, 1048575 } },
+	};
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]) && !failed; c++) {
+		memset(&h, 0, sizeof(h));
+		unsigned long long total = 0;
+		for (unsigned long long v = cases[c].values[0]; v <= cases[c].values[1]; v += cases[c].values[2]) {
+			h.buckets[key_latency_bucket(v)]++;
+			total++;
+		}
+		for (int i = 0; i < 4; i++) {
+			unsigned long long p = key_latency_percentile(&h, total, permille[i]);
+			if (p != cases[c].expected[i]) {
+				fprintf(stderr, "latency: %s: p%.1f is %llu instead of %llu\n", cases[c].what, permille[i] / 10.0,
+					p, cases[c].expected[i]);
+				failed = 1;
+			}
+		}
+	}
+
+	// Recording goes to stage histogram
+	key_latency_record(KEY_LATENCY_ENCODE, 1000);
+	key_latency_record(KEY_LATENCY_ENCODE, 30);
+	const struct key_latency_histogram *encode = &key_latency_histograms[KEY_LATENCY_ENCODE];
+	if (encode->count < 2 || encode->max < 1000 || !encode->buckets[key_latency_bucket(30)]) {
+		fprintf(stderr, "latency: recorded values are not in histogram\n");
+		failed = 1;
+	}
+	return failed;
+}
+#endif // XKB2WIN_LATENCY
+
+struct benchmark {
+	const char *name;
+	int (*run)();
+};
+
+static const struct benchmark benchmarks[] = {
+	{ "lookup", bench_lookup },
+	{ "keycode", bench_keycode },
+	{ "encode", bench_encode },
+	{ "decode", bench_decode },
+	{ "utf8", bench_utf8 },
+	{ "translate", bench_translate },
+	{ "trace", bench_trace },
+	{ "autorepeat", bench_autorepeat },
+	{ "text", bench_text },
+	{ "sessions", bench_sessions },
+	{ "cache", bench_cache },
+	{ "overrides", bench_overrides },
+	{ "reload", bench_reload },
+	{ "output", bench_output },
+	{ "ring", bench_ring },
+	{ "handshake", bench_handshake },
+#ifdef XKB2WIN_LATENCY
+	{ "latency", bench_latency },
+#endif
+};
+
+int main(int argc, char **argv)
+{
+	int failed = 0;
+	int names = 0;
+	for (int a = 1; a < argc; a++) {
+		if (!strcmp(argv[a], "--check")) { bench_repeats = 0; }
+		else { names++; }
+	}
+	for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+		int selected = !names;
+		for (int a = 1; a < argc; a++) {
+			if (!strcmp(argv[a], benchmarks[i].name)) { selected = 1; }
+		}
+		if (!selected) { continue; }
+		int result = benchmarks[i].run();
+		if (result) { failed = 1; }
+		if (!bench_repeats) { printf("%s: %s\n", benchmarks[i].name, result ? "FAILED" : "ok"); }
+	}
+	return failed;
+}
@@ -1,3 +1,56 @@
 #!/bin/bash
-rm -rf kp
-gcc ./kp.cpp -lX11 -lxkbcommon -o kp
\ No newline at end of file
+# Usage: ./build.sh [target...]; builds lib, demo and bench if no targets given.
+#   lib   - compile every module on its own, as C and as C++, without and with -DXKB2WIN_LATENCY;
+#           modules are used by including them, so this checks each of them has everything it needs
+#   demo  - kp (needs X11) and kp_replay
+#   bench - xkb2win_bench, headless benchmarks (see bench/bench.cpp); links libX11, but needs no display
+#   test  - build xkb2win_bench and run its exhaustive checks against reference code, without measuring;
+#           then check latency instrumentation in xkb2win_bench built with -DXKB2WIN_LATENCY
+set -e
+cd "$(dirname "$0")"
+
+MODULES="xkb2win.c win32_input_decoder.c x11_translator.c key_latency.c key_trace.c keymap_cache.c
+	x11_session.c key_overrides.c xkb_text.c key_ring.c x11_event_loop.c"
+
+build_lib() {
+	for m in $MODULES; do
+		for latency in "" -DXKB2WIN_LATENCY; do
+			gcc -Wall -Wno-unused-function $latency -D_GNU_SOURCE -x c -c "$m" -o /dev/null
+			gcc -Wall -Wno-unused-function $latency -x c++ -c "$m" -o /dev/null
+		done
+	done
+}
+
+build_demo() {
+	rm -rf kp kp_replay
+	gcc ./kp.cpp -lX11 -lX11-xcb -lxkbcommon -lxkbcommon-x11 -o kp
+	gcc -O2 ./kp_replay.cpp -lxkbcommon -o kp_replay
+}
+
+build_bench() {
+	rm -rf xkb2win_bench
+	gcc -O2 ./bench/bench.cpp -lX11 -lX11-xcb -lxkbcommon -lxkbcommon-x11 -pthread -o xkb2win_bench
+}
+
+run_test() {
+	build_bench
+	# Keymap cache goes to temporary directory, so user's cache is not used or changed
+	test_cache="$(mktemp -d)"
+	trap 'rm -rf "$test_cache"' EXIT
+	XDG_CACHE_HOME="$test_cache" ./xkb2win_bench --check
+	# Instrumented translation path and histogram math
+	rm -rf xkb2win_bench_latency
+	gcc -O2 -DXKB2WIN_LATENCY ./bench/bench.cpp -lX11 -lX11-xcb -lxkbcommon -lxkbcommon-x11 -pthread -o xkb2win_bench_latency
+	XDG_CACHE_HOME="$test_cache" ./xkb2win_bench_latency --check latency translate
+}
+
+[ $# -eq 0 ] && set -- lib demo bench
+for target in "$@"; do
+	case "$target" in
+		lib) build_lib ;;
+		demo) build_demo ;;
+		bench) build_bench ;;
+		test) run_test ;;
+		*) echo "Unknown target: $target" >&2; exit 1 ;;
+	esac
+done
@@ -0,0 +1,196 @@
+// https://github.com/unxed/xkb2win
+// License: CC0-1.0 license
+
+#ifndef KEY_LATENCY_C
+#define KEY_LATENCY_C
+
+// Optional latency instrumentation of key translation path.
+// Build with -DXKB2WIN_LATENCY to enable it; otherwise all KEY_LATENCY_* macros compile to nothing.
+// Time spent in each stage is counted in log-linear histograms (8 buckets per power of two,
+// so error is below 12.5%), that are updated with atomic increments and can be read at any moment.
+// Percentiles are printed to stderr on SIGUSR1 and at exit, see key_latency_install().
+
+// Stages of translation path
+#define KEY_LATENCY_QUEUE     0 // X server event timestamp to event taken from Xlib queue
+#define KEY_LATENCY_LOOKUP    1 // Xutf8LookupString
+#define KEY_LATENCY_KEY       2 // control key state update and KeySym / Windows key codes lookup
+#define KEY_LATENCY_TEXT      3 // UTF-8 to UTF-16 conversion
+#define KEY_LATENCY_ENCODE    4 // ESC sequences encoding
+#define KEY_LATENCY_WRITE     5 // writing to pty
+#define KEY_LATENCY_WAKEUP    6 // whole wakeup: first event taken to everything written
+#define KEY_LATENCY_STAGES    7
+
+#ifdef XKB2WIN_LATENCY
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define KEY_LATENCY_SUB_BITS  3
+#define KEY_LATENCY_BUCKETS   ((64 - KEY_LATENCY_SUB_BITS + 1) << KEY_LATENCY_SUB_BITS)
+
+struct key_latency_histogram {
+	unsigned long long buckets[KEY_LATENCY_BUCKETS]; // count of values in each bucket
+	unsigned long long count;                        // count of all values
+	unsigned long long max;                          // max value, ns
+};
+
+static struct key_latency_histogram key_latency_histograms[KEY_LATENCY_STAGES];
+
+static const char *const key_latency_names[KEY_LATENCY_STAGES] = {
+	"queue", "lookup", "key", "text", "encode", "write", "wakeup"
+};
+
+static inline unsigned long long key_latency_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Helper function to get histogram bucket of a value.
+// Values below 8 get bucket each, larger ones get 8 buckets per power of two.
+static inline unsigned int key_latency_bucket(unsigned long long ns)
+{
+	if (ns < (1u << KEY_LATENCY_SUB_BITS)) { return (unsigned int)ns; }
+	unsigned int exp = 63 - __builtin_clzll(ns);
+	unsigned int sub = (unsigned int)(ns >> (exp - KEY_LATENCY_SUB_BITS)) & ((1u << KEY_LATENCY_SUB_BITS) - 1);
+	return ((exp - KEY_LATENCY_SUB_BITS + 1) << KEY_LATENCY_SUB_BITS) + sub;
+}
+
+// Helper function to get largest value that falls into bucket
+static inline unsigned long long key_latency_bucket_max(unsigned int bucket)
+{
+	if (bucket < (1u << KEY_LATENCY_SUB_BITS)) { return bucket; }
+	unsigned int exp = (bucket >> KEY_LATENCY_SUB_BITS) + KEY_LATENCY_SUB_BITS - 1;
+	unsigned long long sub = bucket & ((1u << KEY_LATENCY_SUB_BITS) - 1);
+	unsigned long long width = 1ULL << (exp - KEY_LATENCY_SUB_BITS);
+	return ((1ULL << exp) + sub * width) + (width - 1);
+}
+
+// Helper function to get percentile from histogram buckets.
+// input:
+//   total - sum of buckets, taken beforehand as buckets may be updated meanwhile
+//   permille - percentile * 10, 500 for median
+// return
+//   largest value of bucket percentile falls into, ns
+static unsigned long long key_latency_percentile(const struct key_latency_histogram *h, unsigned long long total,
+	unsigned int permille)
+{
+	unsigned long long rank = (total * permille + 999) / 1000;
+	unsigned long long seen = 0;
+	unsigned int b = 0;
+	while (b < KEY_LATENCY_BUCKETS - 1) {
+		unsigned long long n = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+		if (seen + n >= rank) { break; }
+		seen += n;
+		b++;
+	}
+	return key_latency_bucket_max(b);
+}
+
+// This function counts time spent in stage. Can be called from any thread.
+static inline void key_latency_record(int stage, unsigned long long ns)
+{
+	struct key_latency_histogram *h = &key_latency_histograms[stage];
+	__atomic_fetch_add(&h->buckets[key_latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	unsigned long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+// Helper function to append string
+static inline char *key_latency_put_str(char *p, const char *s)
+{
+	size_t len = strlen(s);
+	memcpy(p, s, len);
+	return p + len;
+}
+
+// Helper function to append number, right aligned to width
+static inline char *key_latency_put_uint(char *p, unsigned long long v, int width)
+{
+	char tmp[20];
+	char *t = tmp + sizeof(tmp);
+	do { *--t = (char)('0' + v % 10); v /= 10; } while (v);
+	for (int pad = width - (int)(tmp + sizeof(tmp) - t); pad > 0; pad--) { *p++ = ' '; }
+	memcpy(p, t, tmp + sizeof(tmp) - t);
+	return p + (tmp + sizeof(tmp) - t);
+}
+
+// This function prints percentiles of every stage that has values, in ns.
+// Uses only write(), so it is safe to call from signal handler.
+static void key_latency_dump(int fd)
+{
+	static const unsigned int permille[3] = { 500, 990, 999 };
+	char line[256];
+	char *p = key_latency_put_str(line, "stage        count      p50      p99     p999      max (ns)\n");
+	if (write(fd, line, p - line) < 0) { return; }
+
+	for (int stage = 0; stage < KEY_LATENCY_STAGES; stage++) {
+		const struct key_latency_histogram *h = &key_latency_histograms[stage];
+		unsigned long long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+		if (!count) { continue; }
+
+		p = key_latency_put_str(line, key_latency_names[stage]);
+		for (int pad = 8 - (int)strlen(key_latency_names[stage]); pad > 0; pad--) { *p++ = ' '; }
+		p = key_latency_put_uint(p, count, 9);
+
+		// Buckets may be updated while we read them, so percentiles are taken from their own sum
+		unsigned long long total = 0;
+		for (unsigned int b = 0; b < KEY_LATENCY_BUCKETS; b++) {
+			total += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+		}
+		for (int i = 0; i < 3; i++) {
+			p = key_latency_put_uint(p, key_latency_percentile(h, total, permille[i]), 9);
+		}
+		p = key_latency_put_uint(p, __atomic_load_n(&h->max, __ATOMIC_RELAXED), 9);
+		*p++ = '\n';
+		if (write(fd, line, p - line) < 0) { return; }
+	}
+}
+
+static void key_latency_on_signal(int sig)
+{
+	(void)sig;
+	key_latency_dump(STDERR_FILENO);
+}
+
+static void key_latency_on_exit()
+{
+	key_latency_dump(STDERR_FILENO);
+}
+
+// This function makes percentiles printed to stderr on SIGUSR1 and at exit
+static void key_latency_install()
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = key_latency_on_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	atexit(key_latency_on_exit);
+}
+
+// Usage:
+//   KEY_LATENCY_START(t);
+//   ... stage code ...
+//   KEY_LATENCY_END(KEY_LATENCY_ENCODE, t);
+#define KEY_LATENCY_START(t)         unsigned long long t = key_latency_now()
+#define KEY_LATENCY_END(stage, t)    key_latency_record(stage, key_latency_now() - (t))
+#define KEY_LATENCY_RECORD(stage, ns) key_latency_record(stage, ns)
+#define KEY_LATENCY_INSTALL()        key_latency_install()
+
+#else
+
+#define KEY_LATENCY_START(t)
+#define KEY_LATENCY_END(stage, t)
+#define KEY_LATENCY_RECORD(stage, ns)
+#define KEY_LATENCY_INSTALL()
+
+#endif // XKB2WIN_LATENCY
+
+#endif // KEY_LATENCY_C
@@ -0,0 +1,325 @@
+// https://github.com/unxed/xkb2win
+// License: CC0-1.0 license
+
+#ifndef KEY_OVERRIDES_C
+#define KEY_OVERRIDES_C
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <xkbcommon/xkbcommon.h>
+#include "xkb2win.c"
+#include "x11_translator.c"
+
+// User overrides of Windows key codes, for layouts where English Virtual Scan Codes are not wanted.
+// Override file is a text file with one override per line:
+//   keysym <name or 0x value> <vk> <scan> [enhanced] - for every key with that KeySym
+//   keycode <X11 keycode> <vk> <scan> [enhanced]     - for single key, wins over keysym lines
+// Numbers are decimal or 0x-prefixed hex, '#' starts a comment. For example:
+//   keysym semicolon 0xBA 0x27
+//   keycode 108 0x12 0x38 1
+// KeySyms are those of US layout the translation table is built from, not of the layout
+// user has selected: "keysym Cyrillic_a" matches no key, use keycode line for such key.
+// KeySym names are looked up first, so "keysym 1" is the key with digit 1 on it;
+// line with KeySym that no key has is an error.
+// Overrides are applied to a copy of translation table at load time, so lookups stay
+// a single table access. File is watched with inotify, and new table replaces active one
+// with atomic pointer store: translating threads never wait for reload, they get either
+// old or new table. Each reload increments epoch after replacing active pointer, and each
+// attached translator announces epoch it has read before reading the pointer (see x11_translate()).
+// Replaced table is freed by one of later reloads, or with overrides, once every translator
+// is either not reading or has announced later epoch, so it has not got replaced table.
+// Reader does two atomic stores and two loads per lookup, and never waits or retries.
+// Tables are kept only while some lookup is in progress; reloads come at file edit rate,
+// so that is one or two tables, unless translating thread is stopped in the middle of lookup.
+
+// Table made by reload
+struct key_overrides_table {
+	struct xkb2win_keycode_table table;   // should be first, active points to it
+	struct key_overrides_table *next;     // next retired table
+	unsigned long long epoch;             // epoch table was replaced at
+};
+
+struct key_overrides {
+	const struct xkb2win_keycode_table *base;   // translation table without overrides
+	const struct xkb2win_keycode_table *active; // table with overrides, replaced atomically
+	char path[PATH_MAX];                        // override file
+	const char *name;                           // its name without directory, points into path
+	int inotify_fd;                             // -1 if file is not watched
+	int error_line;                             // line of last reload error, 0 if there was none
+	struct key_overrides_table *current;        // table made by last reload, NULL if there was none
+	struct key_overrides_table *retired;        // replaced tables some translator may still be reading
+	unsigned long long epoch;                   // incremented by each reload, after active is replaced
+	struct x11_translator *readers;             // attached translators, list is guarded by lock
+	pthread_mutex_t lock;
+};
+
+// Helper function to parse number, decimal or 0x-prefixed hex
+// return
+//   1 on success, 0 if token is not a number or is larger than max
+static int key_overrides_number(const char *token, unsigned long max, unsigned long *value)
+{
+	char *end;
+	errno = 0;
+	*value = strtoul(token, &end, 0);
+	return token[0] >= '0' && token[0] <= '9' && !*end && !errno && *value <= max;
+}
+
+// Helper function to parse override file into a new table
+// return
+//   1 on success, 0 on failure; error_line is set to line with error, or -1 if file can not be read
+static int key_overrides_parse(const struct key_overrides *ov, struct xkb2win_keycode_table *table, int *error_line)
+{
+	*table = *ov->base;
+	*error_line = 0;
+
+	FILE *f = fopen(ov->path, "r");
+	if (!f) {
+		// No file means no overrides
+		if (errno == ENOENT) { return 1; }
+		*error_line = -1;
+		return 0;
+	}
+
+	// Keycode lines are applied after keysym ones, as they are more specific
+	struct winkey keycodes[256];
+	unsigned char keycode_set[256];
+	memset(keycode_set, 0, sizeof(keycode_set));
+
+	char line[256];
+	int line_no = 0;
+	while (fgets(line, sizeof(line), f)) {
+		line_no++;
+		// Line longer than buffer is an error, or its rest would be parsed as next line
+		if (!strchr(line, '\n') && !feof(f)) {
+			*error_line = line_no;
+			fclose(f);
+			return 0;
+		}
+		char *comment = strchr(line, '#');
+		if (comment) { *comment = 0; }
+
+		char *tokens[6];
+		int count = 0;
+		for (char *save, *t = strtok_r(line, " \t\r\n", &save); t; t = strtok_r(NULL, " \t\r\n", &save)) {
+			if (count == 6) { count++; break; }
+			tokens[count++] = t;
+		}
+		if (!count) { continue; }
+
+		unsigned long vk, scan, enhanced = 0;
+		int ok = (count == 4 || count == 5)
+			&& key_overrides_number(tokens[2], 0xFF, &vk)
+			&& key_overrides_number(tokens[3], 0xFF, &scan)
+			&& (count == 4 || key_overrides_number(tokens[4], 1, &enhanced));
+		struct winkey key = { (unsigned char)vk, (unsigned char)scan, (unsigned char)enhanced };
+
+		unsigned long keycode;
+		if (ok && !strcmp(tokens[0], "keycode") && key_overrides_number(tokens[1], 0xFF, &keycode)) {
+			keycodes[keycode] = key;
+			keycode_set[keycode] = 1;
+		} else if (ok && !strcmp(tokens[0], "keysym")) {
+			// Names like "1" are KeySym names, not values
+			unsigned long value;
+			xkb_keysym_t sym = xkb_keysym_from_name(tokens[1], XKB_KEYSYM_NO_FLAGS);
+			if (sym == XKB_KEY_NoSymbol && !strncmp(tokens[1], "0x", 2)
+				&& key_overrides_number(tokens[1], 0x1FFFFFFF, &value)) {
+				sym = (xkb_keysym_t)value;
+			}
+			int matched = 0;
+			for (int numlock = 0; numlock < 2 && sym != XKB_KEY_NoSymbol; numlock++) {
+				for (int k = 0; k < 256; k++) {
+					if (table->keys[numlock][k].sym == sym) {
+						table->keys[numlock][k].key = key;
+						matched = 1;
+					}
+				}
+			}
+			// KeySym is unknown, or it is not in US layout
+			if (!matched) { ok = 0; }
+		} else {
+			ok = 0;
+		}
+
+		if (!ok) {
+			*error_line = line_no;
+			fclose(f);
+			return 0;
+		}
+	}
+	fclose(f);
+
+	for (int k = 0; k < 256; k++) {
+		if (keycode_set[k]) { table->keys[0][k].key = table->keys[1][k].key = keycodes[k]; }
+	}
+	return 1;
+}
+
+// Helper function to free retired tables no attached translator may be reading.
+// Translator that has announced epoch later than the one table was replaced at
+// has read active pointer after it was replaced, so it does not use the table.
+static void key_overrides_reclaim(struct key_overrides *ov)
+{
+	pthread_mutex_lock(&ov->lock);
+	struct key_overrides_table **link = &ov->retired;
+	while (*link) {
+		struct key_overrides_table *t = *link;
+		int used = 0;
+		for (const struct x11_translator *tr = ov->readers; tr && !used; tr = tr->next_reader) {
+			unsigned long long reading = __atomic_load_n(&tr->reading, __ATOMIC_SEQ_CST);
+			used = reading && (reading - 1 <= t->epoch);
+		}
+		if (used) {
+			link = &t->next;
+		} else {
+			*link = t->next;
+			free(t);
+		}
+	}
+	pthread_mutex_unlock(&ov->lock);
+}
+
+// This function reads override file again and makes new table active.
+// If file has errors, active table is left as is.
+// return
+//   1 on success, 0 on failure (see error_line)
+static int key_overrides_reload(struct key_overrides *ov)
+{
+	struct key_overrides_table *t = (struct key_overrides_table *)malloc(sizeof(struct key_overrides_table));
+	if (!t) { return 0; }
+	if (!key_overrides_parse(ov, &t->table, &ov->error_line)) {
+		free(t);
+		return 0;
+	}
+	__atomic_store_n(&ov->active, &t->table, __ATOMIC_SEQ_CST);
+	if (ov->current) {
+		ov->current->epoch = ov->epoch;
+		ov->current->next = ov->retired;
+		ov->retired = ov->current;
+	}
+	ov->current = t;
+	__atomic_store_n(&ov->epoch, ov->epoch + 1, __ATOMIC_SEQ_CST);
+	key_overrides_reclaim(ov);
+	return 1;
+}
+
+// input:
+//   base - translation table overrides are applied to, should outlive overrides
+//   path - override file, does not have to exist yet
+//   watch - 1 to reload file when it changes, see key_overrides_poll()
+// return
+//   1 on success, 0 if file has errors (see error_line; base table is active then)
+static int key_overrides_init(struct key_overrides *ov, const struct xkb2win_keycode_table *base,
+	const char *path, int watch)
+{
+	memset(ov, 0, sizeof(*ov));
+	ov->base = base;
+	ov->active = base;
+	ov->inotify_fd = -1;
+	pthread_mutex_init(&ov->lock, NULL);
+	snprintf(ov->path, sizeof(ov->path), "%s", path);
+
+	// Editors usually save files by renaming new file over old one,
+	// so directory is watched, not the file itself
+	char *slash = strrchr(ov->path, '/');
+	ov->name = slash ? slash + 1 : ov->path;
+	if (watch) {
+		char dir[PATH_MAX];
+		snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - ov->path) + 1 : 1, slash ? ov->path : ".");
+		ov->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (ov->inotify_fd >= 0 && inotify_add_watch(ov->inotify_fd, dir,
+			IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) < 0) {
+			close(ov->inotify_fd);
+			ov->inotify_fd = -1;
+		}
+	}
+
+	return key_overrides_reload(ov);
+}
+
+// Translators should not be translating anymore, tables are freed
+static void key_overrides_free(struct key_overrides *ov)
+{
+	if (ov->inotify_fd >= 0) { close(ov->inotify_fd); }
+	free(ov->current);
+	while (ov->retired) {
+		struct key_overrides_table *t = ov->retired;
+		ov->retired = t->next;
+		free(t);
+	}
+	pthread_mutex_destroy(&ov->lock);
+	memset(ov, 0, sizeof(*ov));
+	ov->inotify_fd = -1;
+}
+
+// This function returns table with overrides. Table is freed by later reload,
+// so it should be called by thread that reloads, other threads read table through
+// attached translator.
+static inline const struct xkb2win_keycode_table *key_overrides_table(const struct key_overrides *ov)
+{
+	return __atomic_load_n(&ov->active, __ATOMIC_ACQUIRE);
+}
+
+// This function makes translator use table with overrides, following reloads.
+// Can be called from any thread, while other translators translate.
+static void key_overrides_attach(struct key_overrides *ov, struct x11_translator *tr)
+{
+	pthread_mutex_lock(&ov->lock);
+	tr->reading = 0;
+	tr->epoch = &ov->epoch;
+	tr->next_reader = ov->readers;
+	ov->readers = tr;
+	tr->active = &ov->active;
+	pthread_mutex_unlock(&ov->lock);
+}
+
+// This function makes translator use its own table again; should be called before translator
+// is freed, from thread translator is used by, or when it is not translating.
+static void key_overrides_detach(struct key_overrides *ov, struct x11_translator *tr)
+{
+	pthread_mutex_lock(&ov->lock);
+	for (struct x11_translator **link = &ov->readers; *link; link = &(*link)->next_reader) {
+		if (*link == tr) {
+			*link = tr->next_reader;
+			break;
+		}
+	}
+	tr->active = NULL;
+	tr->epoch = NULL;
+	tr->reading = 0;
+	tr->next_reader = NULL;
+	pthread_mutex_unlock(&ov->lock);
+}
+
+// This function should be called when inotify_fd is readable.
+// Reloads override file if it was changed.
+// return
+//   1 if file was reloaded, 0 if it was not changed, -1 if reloading failed (see error_line)
+static int key_overrides_poll(struct key_overrides *ov)
+{
+	if (ov->inotify_fd < 0) { return 0; }
+
+	int changed = 0;
+	union {
+		struct inotify_event event;
+		char bytes[4096];
+	} buf;
+	ssize_t len;
+	while ((len = read(ov->inotify_fd, buf.bytes, sizeof(buf))) > 0) {
+		for (ssize_t offset = 0; offset < len; ) {
+			const struct inotify_event *event = (const struct inotify_event *)(buf.bytes + offset);
+			if (event->len && !strcmp(event->name, ov->name)) { changed = 1; }
+			offset += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	if (!changed) { return 0; }
+	return key_overrides_reload(ov) ? 1 : -1;
+}
+
+#endif // KEY_OVERRIDES_C
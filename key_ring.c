@@ -0,0 +1,496 @@
+// https://github.com/unxed/xkb2win
+// License: CC0-1.0 license
+
+#ifndef KEY_RING_C
+#define KEY_RING_C
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xkb2win.c"
+
+// Shared memory transport of key events, for apps running on the same host as terminal.
+// Key events are passed as binary records through single-producer/single-consumer ring
+// in memfd-backed shared memory, so there is no ESC sequence formatting and parsing at all.
+// Negotiation goes over the pty:
+//   1. app writes KEY_RING_REQUEST to its output
+//   2. terminal creates ring and writes reply with name of unix socket to app's input:
+//      ESC _ xkb2win-ring=<name> ESC \ (see key_ring_reply())
+//   3. app connects to the socket and gets memfd and both eventfds from terminal
+//      (only processes of the same user are accepted, and only while no other app is connected)
+//   4. terminal writes KEY_RING_START to app's input after key events it has already sent there,
+//      and passes following key events through the ring instead of pty, until app disconnects
+// Key events keep coming through pty between reply and connection, and pty output may still be
+// queued when app connects, so app should keep decoding pty until KEY_RING_START
+// (see key_ring_find_start()), and only then read the ring; key events are neither lost nor
+// reordered then. If connection is closed before KEY_RING_START, app stays with pty.
+// Terminals that do not support it ignore APC sequence of step 1, so app gets no reply.
+// Consumer sleeps on eventfd when ring is empty; terminal signals it only then.
+// Likewise terminal sleeps on space_eventfd when ring is full, and app signals it only then.
+
+#define KEY_RING_REQUEST        "\x1b_xkb2win-ring\x1b\\"
+#define KEY_RING_REPLY_PREFIX   "\x1b_xkb2win-ring="
+#define KEY_RING_REPLY_SUFFIX   "\x1b\\"
+#define KEY_RING_START          "\x1b_xkb2win-ring-start\x1b\\"
+
+#define KEY_RING_MAGIC     0x474E5258 // "XRNG"
+#define KEY_RING_VERSION   2
+#define KEY_RING_CAPACITY  4096       // records, power of two
+
+// win_key_event as stored in ring
+struct key_ring_record {
+	uint16_t vk;                // VirtualKeyCode
+	uint16_t scan;              // VirtualScanCode
+	uint16_t unicode;           // UnicodeChar
+	uint16_t repeat_count;      // RepeatCount
+	uint32_t control_key_state; // dwControlKeyState, *_PRESSED and *_ON bits of xkb2win.c
+	uint32_t key_down;          // 1 for KeyDown, 0 for KeyUp
+};
+
+// Shared memory layout. Producer and consumer fields are on separate cache lines
+struct key_ring_shared {
+	uint32_t magic;            // KEY_RING_MAGIC
+	uint32_t version;          // KEY_RING_VERSION
+	uint32_t capacity;         // count of records, power of two
+	uint32_t record_size;      // sizeof(struct key_ring_record)
+	char pad0[48];
+	uint32_t head;             // count of records written, changed by producer only
+	uint32_t producer_waiting; // producer sleeps on space_eventfd, changed by producer only
+	char pad1[56];
+	uint32_t tail;             // count of records read, changed by consumer only
+	uint32_t consumer_waiting; // consumer sleeps on eventfd, changed by consumer only
+	char pad2[56];
+	struct key_ring_record records[KEY_RING_CAPACITY];
+};
+
+struct key_ring {
+	struct key_ring_shared *shared; // NULL if there is no ring
+	int memfd;
+	int eventfd;                    // consumer wakeup
+	int space_eventfd;              // producer wakeup, when consumer frees space in full ring
+	int listen_fd;                  // terminal side: socket app connects to, -1 if none
+	int conn_fd;                    // terminal side: connection with app, -1 if app is not connected
+	char name[64];                  // terminal side: abstract socket name, without leading null
+};
+
+static void key_ring_init(struct key_ring *ring)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->memfd = ring->eventfd = ring->space_eventfd = ring->listen_fd = ring->conn_fd = -1;
+}
+
+static void key_ring_free(struct key_ring *ring)
+{
+	if (ring->shared) { munmap(ring->shared, sizeof(struct key_ring_shared)); }
+	if (ring->memfd >= 0) { close(ring->memfd); }
+	if (ring->eventfd >= 0) { close(ring->eventfd); }
+	if (ring->space_eventfd >= 0) { close(ring->space_eventfd); }
+	if (ring->listen_fd >= 0) { close(ring->listen_fd); }
+	if (ring->conn_fd >= 0) { close(ring->conn_fd); }
+	key_ring_init(ring);
+}
+
+// Helper function to make abstract unix socket address
+static socklen_t key_ring_address(struct sockaddr_un *addr, const char *name)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	size_t len = strlen(name);
+	if (len > sizeof(addr->sun_path) - 1) { len = sizeof(addr->sun_path) - 1; }
+	memcpy(addr->sun_path + 1, name, len);
+	return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + len);
+}
+
+// Terminal side.
+// This function creates ring memory and socket app connects to.
+// return
+//   1 on success, 0 on failure
+static int key_ring_create(struct key_ring *ring)
+{
+	key_ring_init(ring);
+	ring->memfd = memfd_create("xkb2win-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	ring->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ring->space_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ring->memfd < 0 || ring->eventfd < 0 || ring->space_eventfd < 0 || ftruncate(ring->memfd, sizeof(struct key_ring_shared)) < 0) {
+		key_ring_free(ring);
+		return 0;
+	}
+	// Size can not be changed by app, so it can not make terminal crash with SIGBUS
+	fcntl(ring->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+	void *p = mmap(NULL, sizeof(struct key_ring_shared), PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+	if (p == MAP_FAILED) {
+		key_ring_free(ring);
+		return 0;
+	}
+	ring->shared = (struct key_ring_shared *)p;
+	ring->shared->magic = KEY_RING_MAGIC;
+	ring->shared->version = KEY_RING_VERSION;
+	ring->shared->capacity = KEY_RING_CAPACITY;
+	ring->shared->record_size = sizeof(struct key_ring_record);
+
+	// Name only keeps sockets of different terminals apart: abstract socket names are listed
+	// in /proc/net/unix. Access is limited by SO_PEERCRED uid check in key_ring_accept()
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	unsigned long long nonce = ((unsigned long long)ts.tv_nsec << 20) ^ (uintptr_t)p ^ ts.tv_sec;
+	int urandom = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (urandom >= 0) {
+		if (read(urandom, &nonce, sizeof(nonce)) != sizeof(nonce)) { nonce ^= (unsigned long long)getpid() << 32; }
+		close(urandom);
+	}
+	snprintf(ring->name, sizeof(ring->name), "xkb2win-%d-%016llx", (int)getpid(), nonce);
+
+	struct sockaddr_un addr;
+	socklen_t addr_len = key_ring_address(&addr, ring->name);
+	ring->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (ring->listen_fd < 0 || bind(ring->listen_fd, (struct sockaddr *)&addr, addr_len) < 0
+		|| listen(ring->listen_fd, 1) < 0) {
+		key_ring_free(ring);
+		return 0;
+	}
+	return 1;
+}
+
+// Terminal side.
+// This function writes reply to KEY_RING_REQUEST, that should be written to app's input.
+// return
+//   length of reply
+static size_t key_ring_reply(const struct key_ring *ring, char *buf, size_t size)
+{
+	int n = snprintf(buf, size, "%s%s%s", KEY_RING_REPLY_PREFIX, ring->name, KEY_RING_REPLY_SUFFIX);
+	return (n > 0 && (size_t)n < size) ? (size_t)n : 0;
+}
+
+// Terminal side.
+// This function should be called when listen_fd is readable. Passes memfd and eventfds to app.
+// While app is connected, other connections are refused, so other process of the same user
+// can not take ring over silently; it can be connected to again once app disconnects.
+// return
+//   1 if app is connected, 0 otherwise
+static int key_ring_accept(struct key_ring *ring)
+{
+	int fd = accept4(ring->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) { return 0; }
+	if (ring->conn_fd >= 0) {
+		close(fd);
+		return 0;
+	}
+
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 || cred.uid != getuid()) {
+		close(fd);
+		return 0;
+	}
+
+	union {
+		struct cmsghdr header;
+		char bytes[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	char byte = 0;
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.bytes;
+	msg.msg_controllen = sizeof(control.bytes);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+	int fds[3] = { ring->memfd, ring->eventfd, ring->space_eventfd };
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+		close(fd);
+		return 0;
+	}
+
+	// New app starts with empty ring
+	ring->conn_fd = fd;
+	__atomic_store_n(&ring->shared->producer_waiting, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->shared->tail, __atomic_load_n(&ring->shared->head, __ATOMIC_RELAXED), __ATOMIC_RELEASE);
+	return 1;
+}
+
+// Terminal side.
+// This function should be called when conn_fd is readable or hung up: app disconnected,
+// key events should go to pty again.
+static void key_ring_disconnect(struct key_ring *ring)
+{
+	if (ring->conn_fd >= 0) { close(ring->conn_fd); }
+	ring->conn_fd = -1;
+}
+
+// Terminal side.
+// This function writes key events to ring and wakes app up if it sleeps.
+// return
+//   count of key events written, less than count if ring is full
+static size_t key_ring_push(struct key_ring *ring, const struct win_key_event *events, size_t count)
+{
+	struct key_ring_shared *shared = ring->shared;
+	uint32_t head = shared->head;
+	uint32_t tail = __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE);
+	uint32_t space = KEY_RING_CAPACITY - (head - tail);
+	if (space > KEY_RING_CAPACITY) { space = 0; } // app wrote nonsense to tail
+	if (count > space) { count = space; }
+	if (!count) { return 0; }
+
+	for (size_t i = 0; i < count; i++) {
+		struct key_ring_record *r = &shared->records[(head + i) & (KEY_RING_CAPACITY - 1)];
+		r->vk = events[i].vk;
+		r->scan = events[i].scan;
+		r->unicode = events[i].unicode;
+		r->repeat_count = events[i].repeat_count;
+		r->control_key_state = events[i].control_key_state;
+		r->key_down = events[i].key_down;
+	}
+	__atomic_store_n(&shared->head, head + (uint32_t)count, __ATOMIC_RELEASE);
+
+	// Pairs with fence in key_ring_prepare_wait(): either app sees new head, or we see it waiting
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&shared->consumer_waiting, __ATOMIC_RELAXED)) {
+		uint64_t one = 1;
+		if (write(ring->eventfd, &one, sizeof(one)) < 0) { /* counter is already signaled */ }
+	}
+	return count;
+}
+
+// State of search for KEY_RING_REQUEST in app output (terminal side),
+// or for KEY_RING_START in app input (app side)
+struct key_ring_scanner {
+	size_t matched; // chars of APC sequence matched at the end of previous buffer
+};
+
+// Helper function to find APC sequence that may be split between reads
+// output:
+//   *next - offset of the char next to the sequence, or len if it is not found
+// return
+//   1 if complete sequence is found, 0 otherwise
+static int key_ring_match(struct key_ring_scanner *scanner, const char *apc, const char *buf, size_t len, size_t *next)
+{
+	const size_t apc_len = strlen(apc);
+	size_t matched = scanner->matched;
+	for (size_t i = 0; i < len; i++) {
+		// ESC is the only char sequence starts with, so partial match can only restart from it
+		while (matched && buf[i] != apc[matched]) {
+			matched = (matched > 1 && apc[matched - 1] == '\x1b') ? 1 : 0;
+		}
+		if (buf[i] == apc[matched]) { matched++; }
+		if (matched == apc_len) {
+			scanner->matched = 0;
+			*next = i + 1;
+			return 1;
+		}
+	}
+	scanner->matched = matched;
+	*next = len;
+	return 0;
+}
+
+// Terminal side.
+// This function finds KEY_RING_REQUEST in app output read from pty.
+// Request may be split between reads, so the scanner keeps partial match between calls.
+// input:
+//   scanner - zeroed before first call
+// return
+//   count of complete requests found
+static size_t key_ring_scan(struct key_ring_scanner *scanner, const char *buf, size_t len)
+{
+	size_t count = 0;
+	size_t next;
+	for (size_t offset = 0; offset < len; offset += next) {
+		count += key_ring_match(scanner, KEY_RING_REQUEST, buf + offset, len - offset, &next);
+	}
+	return count;
+}
+
+// Terminal side.
+// This function should be called when ring is full, before waiting for space_eventfd to become readable.
+// return
+//   1 if terminal can wait for space_eventfd, 0 if app read key events meanwhile and push should be retried
+static int key_ring_prepare_space_wait(struct key_ring *ring)
+{
+	struct key_ring_shared *shared = ring->shared;
+	uint64_t value;
+	if (read(ring->space_eventfd, &value, sizeof(value)) < 0) { /* nothing signaled */ }
+	__atomic_store_n(&shared->producer_waiting, 1, __ATOMIC_RELAXED);
+	// Pairs with fence in key_ring_pop(): either we see new tail, or app sees us waiting
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (shared->head - __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE) < KEY_RING_CAPACITY) {
+		__atomic_store_n(&shared->producer_waiting, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+// Terminal side.
+// This function should be called after space_eventfd became readable.
+static void key_ring_space_wakeup(struct key_ring *ring)
+{
+	uint64_t value;
+	if (read(ring->space_eventfd, &value, sizeof(value)) < 0) { /* already read */ }
+	__atomic_store_n(&ring->shared->producer_waiting, 0, __ATOMIC_RELAXED);
+}
+
+// App side.
+// This function finds terminal reply in app input and extracts socket name from it.
+// return
+//   pointer to the char next to reply, or NULL if there is no (complete) reply
+static const char *key_ring_parse_reply(const char *buf, size_t len, char *name, size_t name_size)
+{
+	const size_t prefix_len = sizeof(KEY_RING_REPLY_PREFIX) - 1;
+	for (const char *p = buf; (p = (const char *)memchr(p, '\x1b', buf + len - p)) != NULL; p++) {
+		if ((size_t)(buf + len - p) < prefix_len || memcmp(p, KEY_RING_REPLY_PREFIX, prefix_len)) { continue; }
+		const char *start = p + prefix_len;
+		const char *end = (const char *)memchr(start, '\x1b', buf + len - start);
+		if (!end || end + 1 >= buf + len || end[1] != '\\' || (size_t)(end - start) >= name_size) { return NULL; }
+		memcpy(name, start, end - start);
+		name[end - start] = 0;
+		return end + 2;
+	}
+	return NULL;
+}
+
+// App side.
+// This function finds KEY_RING_START in app input read from pty, after app has connected:
+// key events before it come through pty, key events after it come through ring.
+// It may be split between reads, so the scanner keeps partial match between calls.
+// input:
+//   scanner - zeroed before first call
+// return
+//   pointer to the char next to KEY_RING_START, or NULL if it is not found yet
+static const char *key_ring_find_start(struct key_ring_scanner *scanner, const char *buf, size_t len)
+{
+	size_t next;
+	return key_ring_match(scanner, KEY_RING_START, buf, len, &next) ? buf + next : NULL;
+}
+
+// App side.
+// This function connects to terminal and maps the ring.
+// return
+//   1 on success, 0 on failure (app should keep using ESC sequences then)
+static int key_ring_connect(struct key_ring *ring, const char *name)
+{
+	key_ring_init(ring);
+	struct sockaddr_un addr;
+	socklen_t addr_len = key_ring_address(&addr, name);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) { return 0; }
+	if (connect(fd, (struct sockaddr *)&addr, addr_len) < 0) {
+		close(fd);
+		return 0;
+	}
+
+	union {
+		struct cmsghdr header;
+		char bytes[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.bytes;
+	msg.msg_controllen = sizeof(control.bytes);
+	ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (n != 1 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+		close(fd);
+		return 0;
+	}
+	int fds[3];
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	ring->memfd = fds[0];
+	ring->eventfd = fds[1];
+	ring->space_eventfd = fds[2];
+	ring->conn_fd = fd; // kept open: terminal sees app disconnect when it is closed
+
+	void *p = mmap(NULL, sizeof(struct key_ring_shared), PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+	if (p == MAP_FAILED) {
+		key_ring_free(ring);
+		return 0;
+	}
+	ring->shared = (struct key_ring_shared *)p;
+	if (ring->shared->magic != KEY_RING_MAGIC || ring->shared->version != KEY_RING_VERSION
+		|| ring->shared->capacity != KEY_RING_CAPACITY || ring->shared->record_size != sizeof(struct key_ring_record)) {
+		key_ring_free(ring);
+		return 0;
+	}
+	return 1;
+}
+
+// App side.
+// This function reads key events from ring.
+// return
+//   count of key events read, 0 if ring is empty
+static size_t key_ring_pop(struct key_ring *ring, struct win_key_event *events, size_t max_events)
+{
+	struct key_ring_shared *shared = ring->shared;
+	uint32_t tail = shared->tail;
+	uint32_t head = __atomic_load_n(&shared->head, __ATOMIC_ACQUIRE);
+	size_t count = head - tail;
+	if (count > KEY_RING_CAPACITY) { count = 0; }
+	if (count > max_events) { count = max_events; }
+
+	for (size_t i = 0; i < count; i++) {
+		const struct key_ring_record *r = &shared->records[(tail + i) & (KEY_RING_CAPACITY - 1)];
+		events[i].vk = r->vk;
+		events[i].scan = r->scan;
+		events[i].unicode = r->unicode;
+		events[i].repeat_count = r->repeat_count;
+		events[i].control_key_state = r->control_key_state;
+		events[i].key_down = r->key_down ? 1 : 0;
+	}
+	__atomic_store_n(&shared->tail, tail + (uint32_t)count, __ATOMIC_RELEASE);
+
+	// Pairs with fence in key_ring_prepare_space_wait(): either terminal sees new tail, or we see it waiting
+	if (count) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&shared->producer_waiting, __ATOMIC_RELAXED)) {
+			uint64_t one = 1;
+			if (write(ring->space_eventfd, &one, sizeof(one)) < 0) { /* counter is already signaled */ }
+		}
+	}
+	return count;
+}
+
+// App side.
+// This function should be called when ring is empty, before waiting for eventfd to become readable.
+// return
+//   1 if app can wait for eventfd, 0 if key events came meanwhile and should be read first
+static int key_ring_prepare_wait(struct key_ring *ring)
+{
+	struct key_ring_shared *shared = ring->shared;
+	uint64_t value;
+	if (read(ring->eventfd, &value, sizeof(value)) < 0) { /* nothing signaled */ }
+	__atomic_store_n(&shared->consumer_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&shared->head, __ATOMIC_ACQUIRE) != shared->tail) {
+		__atomic_store_n(&shared->consumer_waiting, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+// App side.
+// This function should be called after eventfd became readable.
+static void key_ring_wakeup(struct key_ring *ring)
+{
+	__atomic_store_n(&ring->shared->consumer_waiting, 0, __ATOMIC_RELAXED);
+}
+
+#endif // KEY_RING_C
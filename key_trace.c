@@ -0,0 +1,155 @@
+// https://github.com/unxed/xkb2win
+// License: CC0-1.0 license
+
+#ifndef KEY_TRACE_C
+#define KEY_TRACE_C
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Binary trace of X11 key events, for replaying them through translation without X11 connection.
+// File starts with header, followed by records, each padded to 4 bytes so records
+// can be read directly from mmap-ed file. Values are stored in host byte order.
+
+#define KEY_TRACE_MAGIC    "XKBT"
+#define KEY_TRACE_VERSION  2
+
+#define KEY_TRACE_NUMLOCK  0x0001 // header flag: NumLock was on when recording started
+
+struct key_trace_header {
+	char magic[4];    // KEY_TRACE_MAGIC
+	uint32_t version; // KEY_TRACE_VERSION
+	uint32_t flags;   // KEY_TRACE_* flags
+};
+
+// Single X11 key event, followed by utf8_len bytes of Xutf8LookupString output
+struct key_trace_record {
+	uint32_t time;     // X11 event timestamp, ms
+	uint16_t state;    // X11 modifiers mask
+	uint8_t keycode;   // X11 keycode
+	uint8_t key_down;  // 1 for KeyPress, 0 for KeyRelease
+	uint16_t utf8_len; // length of UTF-8 string
+	char utf8[];
+};
+
+// Size of record with given length of UTF-8 string, including padding
+#define KEY_TRACE_RECORD_SIZE(utf8_len) \
+	((offsetof(struct key_trace_record, utf8) + (utf8_len) + 3) & ~(size_t)3)
+
+// This function creates trace file and writes its header.
+// return
+//   file to pass to key_trace_write(), or NULL on failure
+static FILE *key_trace_create(const char *path, int numlock)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f) { return NULL; }
+
+	struct key_trace_header header;
+	memcpy(header.magic, KEY_TRACE_MAGIC, sizeof(header.magic));
+	header.version = KEY_TRACE_VERSION;
+	header.flags = numlock ? KEY_TRACE_NUMLOCK : 0;
+	if (fwrite(&header, sizeof(header), 1, f) != 1) { fclose(f); return NULL; }
+	return f;
+}
+
+// This function appends key event to trace file.
+// UTF-8 strings longer than 0xFFFF bytes are cut at last char boundary before that.
+// return
+//   1 on success, 0 on failure
+static int key_trace_write(FILE *f, unsigned int keycode, int key_down, unsigned int state,
+	unsigned int time, const char *utf8, size_t utf8_len)
+{
+	union {
+		struct key_trace_record record;
+		char bytes[KEY_TRACE_RECORD_SIZE(1024)];
+	} r;
+	struct key_trace_record *record = &r.record;
+	if (utf8_len > 0xFFFF) {
+		utf8_len = 0xFFFF;
+		while (utf8_len && ((unsigned char)utf8[utf8_len] & 0xC0) == 0x80) { utf8_len--; }
+	}
+	if (KEY_TRACE_RECORD_SIZE(utf8_len) > sizeof(r)) {
+		// Long IME commit strings
+		record = (struct key_trace_record *)malloc(KEY_TRACE_RECORD_SIZE(utf8_len));
+		if (!record) { return 0; }
+	}
+
+	memset(record, 0, KEY_TRACE_RECORD_SIZE(utf8_len));
+	record->time = time;
+	record->state = (uint16_t)state;
+	record->keycode = (uint8_t)keycode;
+	record->key_down = key_down ? 1 : 0;
+	record->utf8_len = (uint16_t)utf8_len;
+	memcpy(record->utf8, utf8, utf8_len);
+	int ok = (fwrite(record, KEY_TRACE_RECORD_SIZE(utf8_len), 1, f) == 1);
+	if (record != &r.record) { free(record); }
+	return ok;
+}
+
+// Trace file mapped into memory
+struct key_trace {
+	const char *data; // whole file
+	size_t size;      // file size
+	int numlock;      // NumLock state when recording started
+};
+
+// return
+//   1 on success, 0 on failure (can not read file or it is not a trace)
+static int key_trace_open(struct key_trace *trace, const char *path)
+{
+	memset(trace, 0, sizeof(*trace));
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) { return 0; }
+
+	struct stat st;
+	void *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct key_trace_header)) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED) { return 0; }
+
+	const struct key_trace_header *header = (const struct key_trace_header *)data;
+	if (memcmp(header->magic, KEY_TRACE_MAGIC, sizeof(header->magic)) || header->version != KEY_TRACE_VERSION) {
+		munmap(data, st.st_size);
+		return 0;
+	}
+
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	trace->data = (const char *)data;
+	trace->size = st.st_size;
+	trace->numlock = (header->flags & KEY_TRACE_NUMLOCK) ? 1 : 0;
+	return 1;
+}
+
+static void key_trace_close(struct key_trace *trace)
+{
+	if (trace->data) { munmap((void *)trace->data, trace->size); }
+	memset(trace, 0, sizeof(*trace));
+}
+
+// This function returns record at given offset and moves offset to the next one.
+// Start with offset 0.
+// return
+//   record, or NULL when there are no more (complete) records
+static const struct key_trace_record *key_trace_next(const struct key_trace *trace, size_t *offset)
+{
+	size_t pos = *offset ? *offset : sizeof(struct key_trace_header);
+	if (trace->size - pos < KEY_TRACE_RECORD_SIZE(0)) { return NULL; }
+
+	const struct key_trace_record *record = (const struct key_trace_record *)(trace->data + pos);
+	size_t size = KEY_TRACE_RECORD_SIZE(record->utf8_len);
+	if (trace->size - pos < size) { return NULL; }
+
+	*offset = pos + size;
+	return record;
+}
+
+#endif // KEY_TRACE_C
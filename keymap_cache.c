@@ -0,0 +1,329 @@
+// https://github.com/unxed/xkb2win
+// License: CC0-1.0 license
+
+#ifndef KEYMAP_CACHE_C
+#define KEYMAP_CACHE_C
+
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <xkbcommon/xkbcommon.h>
+#include "xkb2win.c"
+
+// Startup cache of compiled keymap and translation table built from it.
+// Compiling keymap from XKB rules reads and parses lots of files from XKB data directory,
+// so result is stored in $XDG_CACHE_HOME/xkb2win/keymap-<layout>.cache (~/.cache if not set),
+// and next startups just mmap it: translation table is used right from the mapped file.
+// File is rebuilt when its fingerprint differs, that is a hash of layout, RMLVO environment
+// variables, built-in Windows key codes, libxkbcommon library file and modification times
+// of XKB data directories. File that is truncated or has damaged table is rebuilt too.
+// Values are stored in host byte order.
+
+#define KEYMAP_CACHE_MAGIC    "XKBC"
+#define KEYMAP_CACHE_VERSION  2
+
+struct keymap_cache_header {
+	char magic[4];          // KEYMAP_CACHE_MAGIC
+	uint32_t version;       // KEYMAP_CACHE_VERSION
+	uint64_t fingerprint;   // see keymap_cache_fingerprint()
+	uint64_t table_hash;    // FNV-1a hash of table
+	uint32_t table_offset;  // struct xkb2win_keycode_table
+	uint32_t table_size;
+	uint32_t keymap_offset; // xkb_keymap_get_as_string() output, null terminated
+	uint32_t keymap_size;   // including terminating null
+};
+
+// Translation data loaded from cache file, or built if there was no valid one
+struct keymap_cache {
+	const char *data;                          // whole file image
+	size_t size;                               // its size
+	int mapped;                                // 1 if data is mmap-ed file, 0 if it is malloc-ed
+	const struct xkb2win_keycode_table *table; // translation table, points into data
+	const char *keymap_string;                 // keymap in XKB text format, points into data
+};
+
+#define KEYMAP_CACHE_HASH_INIT 0xcbf29ce484222325ULL // FNV-1a offset basis
+
+// Helper function for FNV-1a hash
+static inline uint64_t keymap_cache_hash(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// Helper function to hash a string, NULL is hashed differently from empty string
+static inline uint64_t keymap_cache_hash_str(uint64_t hash, const char *s)
+{
+	return s ? keymap_cache_hash(hash, s, strlen(s) + 1) : keymap_cache_hash(hash, "\xff", 1);
+}
+
+// Helper function to hash identity and modification time of a file or directory
+static uint64_t keymap_cache_hash_stat(uint64_t hash, const char *dir, const char *name)
+{
+	char path[4096];
+	snprintf(path, sizeof(path), "%s%s", dir, name);
+	struct stat st;
+	uint64_t values[4] = { 0, 0, 0, 0 };
+	if (stat(path, &st) == 0) {
+		values[0] = st.st_ino;
+		values[1] = st.st_size;
+		values[2] = st.st_mtim.tv_sec;
+		values[3] = st.st_mtim.tv_nsec;
+	}
+	return keymap_cache_hash(hash, values, sizeof(values));
+}
+
+// Helper function for keymap_cache_library(), checks single loaded object
+static int keymap_cache_library_find(struct dl_phdr_info *info, size_t size, void *data)
+{
+	(void)size;
+	const char *slash = strrchr(info->dlpi_name, '/');
+	const char *name = slash ? slash + 1 : info->dlpi_name;
+	if (strncmp(name, "libxkbcommon.so", 15)) { return 0; }
+	*(const char **)data = info->dlpi_name;
+	return 1;
+}
+
+// Helper function to get file of libxkbcommon library in use (or of executable, if it is linked statically).
+// Loaded objects are searched by name: address of library function can not be used to find it,
+// as in executable that is not position independent it is address of executable's PLT entry.
+// return
+//   path
+static const char *keymap_cache_library()
+{
+	const char *library = NULL;
+	dl_iterate_phdr(keymap_cache_library_find, &library);
+	return library ? library : "/proc/self/exe";
+}
+
+// This function computes fingerprint of everything compiled keymap and translation table depend on.
+// Package updates replace XKB data files, which changes modification time of directories containing them;
+// files "us" layout is made of are checked themselves too, in case they are edited in place.
+static uint64_t keymap_cache_fingerprint(const char *layout)
+{
+	uint64_t hash = KEYMAP_CACHE_HASH_INIT;
+	uint32_t sizes[2] = { (uint32_t)sizeof(struct xkb2win_keycode_table), (uint32_t)sizeof(xkb2win_table) };
+	hash = keymap_cache_hash(hash, sizes, sizeof(sizes));
+	hash = keymap_cache_hash(hash, xkb2win_table, sizeof(xkb2win_table));
+	hash = keymap_cache_hash_str(hash, layout);
+
+	// Other libxkbcommon version may compile keymap differently; library file is replaced when it is updated
+	const char *library = keymap_cache_library();
+	hash = keymap_cache_hash_str(hash, library);
+	hash = keymap_cache_hash_stat(hash, library, "");
+
+	// Rules, model and options not given explicitly are taken from environment by libxkbcommon
+	static const char *const vars[] = { "XKB_CONFIG_ROOT", "XKB_CONFIG_EXTRA_PATH", "XKB_DEFAULT_RULES",
+		"XKB_DEFAULT_MODEL", "XKB_DEFAULT_VARIANT", "XKB_DEFAULT_OPTIONS" };
+	for (size_t i = 0; i < sizeof(vars) / sizeof(vars[0]); i++) {
+		hash = keymap_cache_hash_str(hash, getenv(vars[i]));
+	}
+
+	const char *root = getenv("XKB_CONFIG_ROOT");
+	if (!root) { root = "/usr/share/X11/xkb"; }
+	static const char *const names[] = { "", "/rules", "/rules/evdev", "/keycodes", "/keycodes/evdev",
+		"/keycodes/aliases", "/symbols", "/symbols/pc", "/types", "/compat" };
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		hash = keymap_cache_hash_stat(hash, root, names[i]);
+	}
+	char symbols[256];
+	snprintf(symbols, sizeof(symbols), "/symbols/%s", layout);
+	hash = keymap_cache_hash_stat(hash, root, symbols);
+
+	// User XKB data, libxkbcommon looks for it before system one
+	const char *home = getenv("HOME");
+	const char *config = getenv("XDG_CONFIG_HOME");
+	if (config) { hash = keymap_cache_hash_stat(hash, config, "/xkb"); }
+	if (home) {
+		hash = keymap_cache_hash_stat(hash, home, "/.config/xkb");
+		hash = keymap_cache_hash_stat(hash, home, "/.xkb");
+	}
+	return hash;
+}
+
+// Helper function to get cache file path, creating its directory
+// return
+//   1 on success, 0 if there is no place for cache
+static int keymap_cache_path(char *path, size_t size, const char *layout)
+{
+	// Layout name becomes part of file name
+	for (const char *c = layout; *c; c++) {
+		if (!((*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9') || *c == '_' || *c == '-')) { return 0; }
+	}
+
+	const char *cache = getenv("XDG_CACHE_HOME");
+	int n;
+	if (cache && *cache) {
+		mkdir(cache, 0700);
+		n = snprintf(path, size, "%s/xkb2win", cache);
+	} else {
+		const char *home = getenv("HOME");
+		if (!home || !*home) { return 0; }
+		n = snprintf(path, size, "%s/.cache", home);
+		if (n < 0 || (size_t)n >= size) { return 0; }
+		mkdir(path, 0700);
+		n = snprintf(path, size, "%s/.cache/xkb2win", home);
+	}
+	if (n < 0 || (size_t)n >= size) { return 0; }
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) { return 0; }
+
+	size_t len = n;
+	n = snprintf(path + len, size - len, "/keymap-%s.cache", layout);
+	return n >= 0 && (size_t)n < size - len;
+}
+
+// Helper function to check file image and set pointers into it
+// return
+//   1 if image is valid, 0 otherwise
+static int keymap_cache_attach(struct keymap_cache *cache, uint64_t fingerprint)
+{
+	const struct keymap_cache_header *header = (const struct keymap_cache_header *)cache->data;
+	if (cache->size < sizeof(*header)
+		|| memcmp(header->magic, KEYMAP_CACHE_MAGIC, sizeof(header->magic))
+		|| header->version != KEYMAP_CACHE_VERSION
+		|| header->fingerprint != fingerprint
+		|| header->table_size != sizeof(struct xkb2win_keycode_table)
+		|| header->table_offset % sizeof(uint64_t)
+		|| header->table_offset > cache->size || cache->size - header->table_offset < header->table_size
+		|| header->keymap_size == 0
+		|| header->keymap_offset > cache->size || cache->size - header->keymap_offset < header->keymap_size
+		|| cache->data[header->keymap_offset + header->keymap_size - 1] != 0
+		|| header->table_hash != keymap_cache_hash(KEYMAP_CACHE_HASH_INIT,
+			cache->data + header->table_offset, header->table_size)) {
+		return 0;
+	}
+	cache->table = (const struct xkb2win_keycode_table *)(cache->data + header->table_offset);
+	cache->keymap_string = cache->data + header->keymap_offset;
+	return 1;
+}
+
+// Helper function to compile keymap and make file image from it
+// return
+//   malloc-ed image, or NULL on failure
+static char *keymap_cache_build(const char *layout, uint64_t fingerprint, size_t *size)
+{
+	struct xkb_context *ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	if (!ctx) { return NULL; }
+	struct xkb_rule_names names;
+	memset(&names, 0, sizeof(names));
+	names.layout = layout;
+	struct xkb_keymap *keymap = xkb_keymap_new_from_names(ctx, &names, XKB_KEYMAP_COMPILE_NO_FLAGS);
+	char *keymap_string = keymap ? xkb_keymap_get_as_string(keymap, XKB_KEYMAP_FORMAT_TEXT_V1) : NULL;
+
+	char *image = NULL;
+	if (keymap_string) {
+		struct keymap_cache_header header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, KEYMAP_CACHE_MAGIC, sizeof(header.magic));
+		header.version = KEYMAP_CACHE_VERSION;
+		header.fingerprint = fingerprint;
+		header.table_offset = (sizeof(header) + 7) & ~7u;
+		header.table_size = sizeof(struct xkb2win_keycode_table);
+		header.keymap_offset = header.table_offset + header.table_size;
+		header.keymap_size = strlen(keymap_string) + 1;
+
+		*size = header.keymap_offset + header.keymap_size;
+		image = (char *)calloc(1, *size);
+		if (image && xkb2win_keycode_table_build((struct xkb2win_keycode_table *)(image + header.table_offset), keymap)) {
+			header.table_hash = keymap_cache_hash(KEYMAP_CACHE_HASH_INIT, image + header.table_offset, header.table_size);
+			memcpy(image, &header, sizeof(header));
+			memcpy(image + header.keymap_offset, keymap_string, header.keymap_size);
+		} else {
+			free(image);
+			image = NULL;
+		}
+	}
+
+	free(keymap_string);
+	if (keymap) { xkb_keymap_unref(keymap); }
+	xkb_context_unref(ctx);
+	return image;
+}
+
+// Helper function to write file image, via temporary file so readers never see partial file
+static void keymap_cache_store(const char *path, const char *image, size_t size)
+{
+	char tmp[4096 + 16];
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) { return; }
+	int ok = (write(fd, image, size) == (ssize_t)size);
+	ok = (close(fd) == 0) && ok;
+	if (!ok || rename(tmp, path) != 0) { unlink(tmp); }
+}
+
+// This function loads translation data for keyboard layout from cache,
+// or compiles keymap and updates cache if there is no valid cache file.
+// Works without cache too, if there is no place for it.
+// input:
+//   layout - XKB layout name, like "us"
+// return
+//   1 on success, 0 if keymap can not be compiled
+static int keymap_cache_load(struct keymap_cache *cache, const char *layout)
+{
+	memset(cache, 0, sizeof(*cache));
+	uint64_t fingerprint = keymap_cache_fingerprint(layout);
+
+	char path[4096];
+	int have_path = keymap_cache_path(path, sizeof(path), layout);
+	if (have_path) {
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+			void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED) {
+				cache->data = (const char *)data;
+				cache->size = st.st_size;
+				cache->mapped = 1;
+				if (keymap_cache_attach(cache, fingerprint)) {
+					close(fd);
+					return 1;
+				}
+				munmap(data, st.st_size);
+				memset(cache, 0, sizeof(*cache));
+			}
+		}
+		if (fd >= 0) { close(fd); }
+	}
+
+	size_t size;
+	char *image = keymap_cache_build(layout, fingerprint, &size);
+	if (!image) { return 0; }
+	if (have_path) { keymap_cache_store(path, image, size); }
+	cache->data = image;
+	cache->size = size;
+	cache->mapped = 0;
+	if (keymap_cache_attach(cache, fingerprint)) { return 1; }
+	free(image);
+	memset(cache, 0, sizeof(*cache));
+	return 0;
+}
+
+static void keymap_cache_close(struct keymap_cache *cache)
+{
+	if (cache->mapped) { munmap((void *)cache->data, cache->size); }
+	else { free((void *)cache->data); }
+	memset(cache, 0, sizeof(*cache));
+}
+
+// This function compiles keymap from cached text, for those who need keymap itself.
+// It still has to be parsed, but no XKB rules and data files are read.
+// return
+//   keymap, or NULL on failure
+static struct xkb_keymap *keymap_cache_keymap(const struct keymap_cache *cache, struct xkb_context *ctx)
+{
+	return xkb_keymap_new_from_string(ctx, cache->keymap_string, XKB_KEYMAP_FORMAT_TEXT_V1, XKB_KEYMAP_COMPILE_NO_FLAGS);
+}
+
+#endif // KEYMAP_CACHE_C
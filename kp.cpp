@@ -2,24 +2,154 @@
 // License: CC0-1.0 license
 
 #include <X11/Xlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <X11/Xutil.h>
+#include <X11/XKBlib.h>
 
 #include <xkbcommon/xkbcommon.h>
 #include "xkb2win.c"
+#include "x11_translator.c"
+#include "key_trace.c"
+#include "keymap_cache.c"
+#include "key_overrides.c"
+#include "xkb_text.c"
+#include "x11_event_loop.c"
+#include "key_ring.c"
+#include "key_latency.c"
+
+// Demo state passed to event loop callbacks
+struct kp_demo {
+	x11_event_loop *loop;
+	const xkb2win_keycode_table *table;
+	x11_translator *translator;
+	FILE *trace; // trace file, or nullptr
+	key_overrides *overrides; // Windows key codes overrides, or nullptr
+};
+
+// Reports result of override file (re)load
+static void kp_report_overrides(const key_overrides *overrides, int result)
+{
+	if (result > 0) {
+		printf ("Overrides loaded from %s\n\n", overrides->path);
+	} else if (overrides->error_line < 0) {
+		fprintf(stderr, "Cannot read overrides file %s\n", overrides->path);
+	} else {
+		fprintf(stderr, "Error in overrides file %s, line %i\n", overrides->path, overrides->error_line);
+	}
+}
+
+static void kp_on_overrides_reload(void *user, int result)
+{
+	kp_report_overrides(((kp_demo *)user)->overrides, result);
+}
+
+// Reads what app wrote to output, answering its request for key ring if there is one
+static void kp_on_pty_input(void *user, int fd)
+{
+	kp_demo *demo = (kp_demo *)user;
+	char buf[4096];
+	ssize_t n = read(fd, buf, sizeof(buf));
+	if (n > 0) {
+		if (x11_event_loop_pty_output(demo->loop, buf, n)) { fprintf(stderr, "Key ring offered: @%s\n", demo->loop->ring->name); }
+	} else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+		// App has gone, nobody reads output anymore
+		x11_event_loop_stop(demo->loop);
+	}
+}
+
+// Prints debug output for each key event, records it to trace file, exits on ESC key press
+static void kp_on_key(void *user, const x11_event_loop_key *key)
+{
+	kp_demo *demo = (kp_demo *)user;
+	XKeyEvent *event = key->xkey;
+
+	if (demo->trace) {
+		key_trace_write(demo->trace, event->keycode, event->type == KeyPress, event->state,
+			event->time, key->utf8, key->utf8_len);
+	}
+
+	// Autorepeat folded into previous key event is not passed anywhere
+	if (!key->repeats) {
+		printf ("Autorepeat, KeyCode: %i, folded into previous key event\n\n", event->keycode);
+		return;
+	}
+
+	// Get X11 KeySym and its name (they are not needed for translation to win key codes, just for debug output)
+	xkb_keysym_t sym = xkb2win_keycode_lookup(demo->table, event->keycode, demo->translator->numlock)->sym;
+	char name[64];
+	xkb_keysym_get_name(sym, name, sizeof(name));
+
+	if (event->type == KeyPress)
+		printf ("KeyPress, KeyCode: %i, KeySym: %i %s\n", event->keycode, sym, name );
+	else if (event->type == KeyRelease)
+	{
+		printf( "KeyRelease, KeyCode: %i, KeySym: %i %s\n", event->keycode, sym, name );
+	}
+
+	printf ("utf8 string from X11: %.*s\n", key->utf8_len, key->utf8);
+
+	printf ("Windows VirtualKeyCode: %i %c\n",
+		key->events[0].vk, isalpha(key->events[0].vk) ? key->events[0].vk : ' ');
+
+	if (key->repeats > 1) {
+		printf ("Autorepeat count: %u\n", key->repeats);
+	}
+
+	// Print the same sequences event loop writes to pty, one per line
+	char *seq = (char *)malloc(key->count * WIN32_INPUT_MODE_SEQ_MAX);
+	size_t len = win32_input_mode_encode(key->events, key->count, seq, key->count * WIN32_INPUT_MODE_SEQ_MAX, NULL);
+	for (size_t i = 0; i < len; i++) {
+		if (seq[i] == '\x1b') { printf ("ESC sequence as in win32-input-mode: ^["); }
+		else { putchar(seq[i]); }
+		if (seq[i] == '_') { putchar('\n'); }
+	}
+	free(seq);
+
+	printf ("\n");
+
+	// Exit on ESC key press
+	if ( event->keycode == 0x09 )
+		x11_event_loop_stop(demo->loop);
+}
 
-int main()
+int main(int argc, char **argv)
 {
 
 	Display *display; // X11 display
 	Window window;    // X11 window
-	XEvent event;     // X11 event for keypresses we want to process
 	int screen;       // X11 screen
 
-	int cks = 0;      // Value for dwControlKeyState field
-	
+	// Command line: kp [-r] [-x] [-m] [-o output] [-k overrides] [trace_file]
+	// -r: pass autorepeats that are queued together as single key event with repeat count
+	// -o: write ESC sequences to given file, FIFO or other terminal's pty, as terminal writes them to its pty
+	// -k: take Windows key codes overrides from given file (see key_overrides.c), reloading it when it changes
+	// -x: always get text from X input method; by default it is only used if IME is configured
+	// -m: read output too, and offer shared memory ring (see key_ring.c) to app that asks for it there;
+	//     output should be pty or FIFO then, regular files can not be watched for requests
+	int fold_repeats = 0;
+	int use_xim = 0;
+	int use_ring = 0;
+	const char *trace_path = nullptr;
+	const char *output_path = nullptr;
+	const char *overrides_path = nullptr;
+	for (int a = 1; a < argc; a++) {
+		if (!strcmp(argv[a], "-r")) { fold_repeats = 1; }
+		else if (!strcmp(argv[a], "-x")) { use_xim = 1; }
+		else if (!strcmp(argv[a], "-m")) { use_ring = 1; }
+		else if (!strcmp(argv[a], "-o") && a + 1 < argc) { output_path = argv[++a]; }
+		else if (!strcmp(argv[a], "-k") && a + 1 < argc) { overrides_path = argv[++a]; }
+		else { trace_path = argv[a]; }
+	}
+
+	// Print per-stage latency on SIGUSR1 and at exit, if built with -DXKB2WIN_LATENCY
+	KEY_LATENCY_INSTALL();
+
 	// Open connection with the server
 	display = XOpenDisplay(NULL);
 	if (display == NULL)
@@ -43,27 +173,48 @@ int main()
 	// Map (show) the window
 	XMapWindow(display, window);
 
-	// Prepare keyboard state object for us keyboard layout.
+	// Prepare translation table for us keyboard layout.
 	// We need X11 keycodes for English keyboard layout, no matter what layout is actually used,
-	// to get the corresponding Windows key codes
-	xkb_context *ctx = nullptr;
-	xkb_keymap *keymap = nullptr;
-	xkb_state *state = nullptr;
-	ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-	struct xkb_rule_names names = {0};
-	names.layout = "us";
-	keymap = xkb_keymap_new_from_names(ctx, &names, XKB_KEYMAP_COMPILE_NO_FLAGS);
-	state = xkb_state_new(keymap);
+	// to get the corresponding Windows key codes.
+	// Table is taken from startup cache, keymap is compiled only if cache is missing or outdated
+	keymap_cache cache;
+	if (!keymap_cache_load(&cache, "us"))
+	{
+		fprintf(stderr, "Cannot compile keymap\n");
+		exit(1);
+	}
 
 	// Read keyboard state of physical keyboard to detect initial num lock state
 	XKeyboardState x;
 	XGetKeyboardControl(display, &x);
-	if (x.led_mask & 2) { // If NumLock is on
-		// Change our virtual english keyboard state so it has NumLock on also.
-		// NumLock key has X11 scan code 77, as defined in
-		// /usr/share/X11/xkb/keycodes/xfree86
-		xkb_state_update_key(state, 77, XKB_KEY_DOWN); // simulate numlock key down
-		xkb_state_update_key(state, 77, XKB_KEY_UP);   // simulate numlock key up
+	int numlock = (x.led_mask & 2) ? 1 : 0;
+
+	x11_translator translator;
+	x11_translator_init(&translator, cache.table, numlock);
+
+	// Windows key codes overrides, if file name is given
+	key_overrides overrides;
+	if (overrides_path) {
+		if (!key_overrides_init(&overrides, cache.table, overrides_path, 1)) {
+			kp_report_overrides(&overrides, -1);
+		}
+		key_overrides_attach(&overrides, &translator);
+	}
+
+	// Record key events to trace file for replaying them without X11, if file name is given
+	FILE *trace = nullptr;
+	if (trace_path) {
+		trace = key_trace_create(trace_path, numlock);
+		if (!trace) {
+			fprintf(stderr, "Cannot create trace file %s\n", trace_path);
+			exit(1);
+		}
+	}
+
+	// Ask X11 to send autorepeats as KeyPress events only, without KeyRelease in between.
+	// If it is not supported, synthetic KeyRelease events are detected by their timestamps
+	if (fold_repeats) {
+		XkbSetDetectableAutoRepeat(display, True, NULL);
 	}
 
 	// Create an input method
@@ -72,112 +223,66 @@ int main()
 	// Create an input context
 	XIC ic = XCreateIC(im, XNInputStyle, XIMPreeditNothing | XIMStatusNothing, XNClientWindow, window, NULL);
 
-	// Event loop
-	while (1)
-	{
-		XNextEvent(display, &event);
-
-		// Update our virtual keyboard state so it has NumLock state equal to actual physical NumLock state.
-		// But do not pass Shift key presses here as we want KeySyms for non-alphabetic char keys
-		// to be in lower case for X11-to-WinKey translations.
-		// Shift keys have X11 scan codes 50 and 62, as defined in
-		// /usr/share/X11/xkb/keycodes/xfree86
-		if ((event.xkey.keycode != 50) && (event.xkey.keycode != 62)) {
-			xkb_state_update_key(state, event.xkey.keycode, (event.type == KeyPress) ? XKB_KEY_DOWN : XKB_KEY_UP);
-		}
-
-		// Get X11 KeySym for the pressed key
-		xkb_keysym_t sym = xkb_state_key_get_one_sym(state, event.xkey.keycode);
-
-		// Reset Windows control key state in case modifier key release event is lost (due to window focus lost, etc)
-		if (!(event.xkey.state & ShiftMask))
-			{ cks &= ~LEFT_SHIFT_PRESSED; cks &= ~RIGHT_SHIFT_PRESSED; cks &= ~SHIFT_PRESSED; }
-		if (!(event.xkey.state & ControlMask))
-			{ cks &= ~LEFT_CTRL_PRESSED; cks &= ~RIGHT_CTRL_PRESSED; }
-		if (!(event.xkey.state & Mod1Mask) && !(event.xkey.state & Mod5Mask)) // sometimes AltGr is mapped to Mod5
-			{ cks &= ~LEFT_ALT_PRESSED; cks &= ~RIGHT_ALT_PRESSED; }
-
-		// Update Windows control key state
-		if ((sym == XKB_KEY_Shift_L) && (event.type == KeyPress  )) { cks |=  LEFT_SHIFT_PRESSED;  cks |=  SHIFT_PRESSED; }
-		if ((sym == XKB_KEY_Shift_L) && (event.type == KeyRelease)) { cks &= ~LEFT_SHIFT_PRESSED;  cks &= ~SHIFT_PRESSED; }
-		if ((sym == XKB_KEY_Shift_R) && (event.type == KeyPress  )) { cks |=  RIGHT_SHIFT_PRESSED; cks |=  SHIFT_PRESSED; }
-		if ((sym == XKB_KEY_Shift_R) && (event.type == KeyRelease)) { cks &= ~RIGHT_SHIFT_PRESSED; cks &= ~SHIFT_PRESSED; }
-
-		if ((sym == XKB_KEY_Control_L) && (event.type == KeyPress  )) { cks |=  LEFT_CTRL_PRESSED;  }
-		if ((sym == XKB_KEY_Control_L) && (event.type == KeyRelease)) { cks &= ~LEFT_CTRL_PRESSED;  }
-		if ((sym == XKB_KEY_Control_R) && (event.type == KeyPress  )) { cks |=  RIGHT_CTRL_PRESSED; }
-		if ((sym == XKB_KEY_Control_R) && (event.type == KeyRelease)) { cks &= ~RIGHT_CTRL_PRESSED; }
-
-		if ((sym == XKB_KEY_Alt_L) && (event.type == KeyPress  )) { cks |=  LEFT_ALT_PRESSED;  }
-		if ((sym == XKB_KEY_Alt_L) && (event.type == KeyRelease)) { cks &= ~LEFT_ALT_PRESSED;  }
-		if ((sym == XKB_KEY_Alt_R) && (event.type == KeyPress  )) { cks |=  RIGHT_ALT_PRESSED; }
-		if ((sym == XKB_KEY_Alt_R) && (event.type == KeyRelease)) { cks &= ~RIGHT_ALT_PRESSED; }
-
-		// Get X11 KeySym name (it is not needed for translation to win key codes, just for debug output)
-		char buf[64];
-		xkb_keysym_get_name(sym, buf, 64);
-
-		if (event.type == KeyPress)
-			printf ("KeyPress, KeyCode: %i, KeySym: %i %s\n", event.xkey.keycode, sym, buf );
-		else if (event.type == KeyRelease)
-		{
-			printf( "KeyRelease, KeyCode: %i, KeySym: %i %s\n", event.xkey.keycode, sym, buf );
-		}
+	// Make text of key events in-process with user's actual keyboard layout,
+	// unless input method is IME
+	xkb_text text;
+	int have_text = 0;
+	if (!use_xim && !xkb_text_ime_active(im)) {
+		have_text = xkb_text_init(&text, display);
+		if (!have_text) { fprintf(stderr, "Cannot get keymap of current layout from X server, using input method\n"); }
+	}
 
-		// Get UTF-8 string corresponding to key event
-		int r;
-		Status s;
-		r = Xutf8LookupString(ic, (XKeyPressedEvent*)&event, buf, sizeof(buf), 0, 0);
-		buf[r] = 0;
-		printf ("utf8 string from X11: %s\n", buf);
-
-		// Translate X11 KeySym to Windows key codes
-		unsigned char* win_key_data = xkb_to_winkey(sym);
-
-		printf ("Windows VirtualKeyCode: %i %c\n",
-			win_key_data[0], isalpha(win_key_data[0]) ? win_key_data[0] : ' ');
-
-		// Update Windows control keys state to actual num/caps/scroll lock state
-		int cks_current = cks | (win_key_data[2] ? ENHANCED_KEY : 0);
-		if (event.xkey.state & LockMask)    cks_current |= CAPSLOCK_ON;
-		if (event.xkey.state & Mod2Mask)    cks_current |= NUMLOCK_ON;
-		if (event.xkey.state & Mod3Mask)    cks_current |= SCROLLLOCK_ON;
-
-		// Generate win32-input-mode ESC sequence[s]
-		// If X11 gives us more than 1 unicode char, we should generate
-		// separate sequence for each char
-		int numread = 0; // number of utf8 chars parsed
-		int offset = 0;  // offset of current utf8 char
-		wchar_t ch;      // integet value of current unicode char
-		bool first = 1;  // first iteration
-		while(1) { 
-			numread = utf8_char_to_ucs2(&buf[offset], &ch);
-			if (numread || first) {
-				// zero read utf8 bytes on first iteration means no unicode value for that key event
-				// still esc seq should be displayed
-				printf ("ESC sequence as in win32-input-mode: ^[[%i;%i;%i;%i;%i;%i_\n",
-					win_key_data[0],                   // VirtualKeyCode
-					win_key_data[1],                   // VirtualScanCode
-					ch,				                   // Unicode Char as integer value
-					(event.type == KeyPress) ? 1 : 0,  // KeyDown or KeyUp flag
-					cks_current,                       // dwControlKeyState
-					1                                  // RepeatCount
-				);
-			} else { break; }
-			offset += numread;
-			first = 0;
+	// Output for ESC sequences, if given
+	int output = -1;
+	if (output_path) {
+		output = open(output_path, (use_ring ? O_RDWR : O_WRONLY) | O_NOCTTY | O_CLOEXEC);
+		if (output < 0) {
+			fprintf(stderr, "Cannot open output %s\n", output_path);
+			exit(1);
 		}
+	}
 
-		printf ("\n");
+	// Event loop
+	x11_event_loop loop;
+	if (!x11_event_loop_init(&loop, display, ic, &translator, output))
+	{
+		fprintf(stderr, "Cannot create event loop\n");
+		exit(1);
+	}
+	kp_demo demo = { &loop, cache.table, &translator, trace, nullptr };
+	loop.fold_repeats = fold_repeats;
+	loop.xkb_text = have_text ? &text : nullptr;
+	loop.on_key = kp_on_key;
+	loop.user = &demo;
+	if (overrides_path) {
+		loop.overrides = &overrides;
+		loop.on_overrides_reload = kp_on_overrides_reload;
+		demo.overrides = &overrides;
+	}
 
-		// Exit on ESC key press
-		if ( event.xkey.keycode == 0x09 )
-			break;
+	// When app asks for ring in output, reply with ring socket name goes to output;
+	// app that connects gets KEY_RING_START in output, and key events after it through ring
+	key_ring ring;
+	key_ring_init(&ring);
+	if (use_ring) {
+		if (output < 0) { fprintf(stderr, "Cannot offer key ring, no output given\n"); }
+		else if (!loop.pty_watched) { fprintf(stderr, "Cannot offer key ring, output is not pty or FIFO\n"); }
+		loop.ring = &ring;
+		loop.on_pty_input = kp_on_pty_input;
 	}
 
-	if (state) { xkb_state_unref(state); }
-	if (keymap) { xkb_keymap_unref(keymap); }
-	if (ctx) { xkb_context_unref(ctx); }
+	x11_event_loop_run(&loop);
+	x11_event_loop_free(&loop);
+	key_ring_free(&ring);
+
+	if (overrides_path) {
+		key_overrides_detach(&overrides, &translator);
+		key_overrides_free(&overrides);
+	}
+	if (have_text) { xkb_text_free(&text); }
+	if (output >= 0) { close(output); }
+	if (trace) { fclose(trace); }
+	keymap_cache_close(&cache);
 
 	// Close connection to server
 	if (display) {
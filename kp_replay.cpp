@@ -0,0 +1,149 @@
+// https://github.com/unxed/xkb2win
+// License: CC0-1.0 license
+
+// Replays key events recorded by kp through the same translation kp does, without X11 connection.
+// Usage:
+//   kp_replay trace_file           print win32-input-mode ESC sequences, one line per recorded event
+//   kp_replay -b trace_file        measure translation and encoding speed, print nothing else
+//   kp_replay -g count trace_file  write synthetic trace of given number of events
+// Built with -DXKB2WIN_LATENCY, also prints per-stage latency percentiles at exit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xkbcommon/xkbcommon.h>
+#include "xkb2win.c"
+#include "x11_translator.c"
+#include "key_trace.c"
+#include "keymap_cache.c"
+#include "key_latency.c"
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Writes trace of random key taps with modifier keys held from time to time.
+// UTF-8 strings are what English keyboard layout gives, without Shift applied.
+static int generate(const xkb2win_keycode_table *table, long count, const char *path)
+{
+	FILE *f = key_trace_create(path, 0);
+	if (!f) { return 0; }
+
+	static const unsigned int modifiers[] = { 37, 50, 62, 64, 105, 108 }; // Ctrl, Shift, Alt; left and right
+	static const unsigned int modifier_masks[] = { ControlMask, ShiftMask, ShiftMask, Mod1Mask, ControlMask, Mod1Mask };
+	unsigned int time = 0;
+	unsigned int state = 0;
+	int held = -1;
+	srand(1);
+	for (long i = 0; i < count; i += 2) {
+		if (held < 0 && rand() % 16 == 0) {
+			held = rand() % 6;
+			key_trace_write(f, modifiers[held], 1, state, time++, "", 0);
+			state |= modifier_masks[held];
+		} else if (held >= 0 && rand() % 4 == 0) {
+			state &= ~modifier_masks[held];
+			key_trace_write(f, modifiers[held], 0, state | modifier_masks[held], time++, "", 0);
+			held = -1;
+		}
+
+		unsigned int keycode = 10 + rand() % 52; // digits, letters and punctuation rows
+		char utf8[8] = {0};
+		int len = xkb_keysym_to_utf8(xkb2win_keycode_lookup(table, keycode, 0)->sym, utf8, sizeof(utf8));
+		len = (len > 0) ? len - 1 : 0; // without terminating null
+		key_trace_write(f, keycode, 1, state, time++, utf8, len);
+		key_trace_write(f, keycode, 0, state, time++, "", 0);
+	}
+	return fclose(f) == 0;
+}
+
+int main(int argc, char **argv)
+{
+	int bench = (argc == 3 && !strcmp(argv[1], "-b"));
+	int gen = (argc == 4 && !strcmp(argv[1], "-g"));
+	if (argc != 2 && !bench && !gen) {
+		fprintf(stderr, "Usage: %s [-b] trace_file\n       %s -g count trace_file\n", argv[0], argv[0]);
+		return 1;
+	}
+	const char *path = argv[argc - 1];
+
+	// Print per-stage latency at exit, if built with -DXKB2WIN_LATENCY
+	KEY_LATENCY_INSTALL();
+
+	// Prepare translation table for us keyboard layout, as kp does
+	keymap_cache cache;
+	if (!keymap_cache_load(&cache, "us"))
+	{
+		fprintf(stderr, "Cannot compile keymap\n");
+		return 1;
+	}
+	const xkb2win_keycode_table *table = cache.table;
+
+	if (gen) {
+		if (!generate(table, atol(argv[2]), path)) {
+			fprintf(stderr, "Cannot write trace file %s\n", path);
+			return 1;
+		}
+		return 0;
+	}
+
+	key_trace trace;
+	if (!key_trace_open(&trace, path)) {
+		fprintf(stderr, "Cannot read trace file %s\n", path);
+		return 1;
+	}
+
+	x11_translator translator;
+	x11_translator_init(&translator, table, trace.numlock);
+
+	size_t records = 0, events_total = 0, bytes = 0;
+	unsigned int checksum = 0;
+
+	// Enough for the longest UTF-8 string trace record may have
+	const size_t max_events = 0xFFFF;
+	win_key_event *events = (win_key_event *)malloc(max_events * sizeof(win_key_event));
+	char *seq = (char *)malloc(max_events * WIN32_INPUT_MODE_SEQ_MAX);
+
+	double start = now_ns();
+
+	size_t offset = 0;
+	const key_trace_record *record;
+	while ((record = key_trace_next(&trace, &offset)) != NULL) {
+		size_t count = x11_translate(&translator, record->keycode, record->key_down, record->state,
+			record->utf8, record->utf8_len, events, max_events);
+		KEY_LATENCY_START(encode_start);
+		size_t len = win32_input_mode_encode(events, count, seq, max_events * WIN32_INPUT_MODE_SEQ_MAX, NULL);
+		KEY_LATENCY_END(KEY_LATENCY_ENCODE, encode_start);
+
+		records++;
+		events_total += count;
+		bytes += len;
+		if (bench) {
+			checksum += (unsigned char)seq[len / 2];
+			continue;
+		}
+
+		for (size_t i = 0; i < len; i++) {
+			if (seq[i] == '\x1b') { fputs("^[", stdout); }
+			else { putchar(seq[i]); }
+		}
+		putchar('\n');
+	}
+
+	double elapsed = now_ns() - start;
+	free(seq);
+	free(events);
+	key_trace_close(&trace);
+	keymap_cache_close(&cache);
+
+	if (bench) {
+		printf("%zu records, %zu key events, %zu bytes of ESC sequences in %.1f ms: "
+			"%.0f records/s, %.1f ns/record (checksum %u)\n",
+			records, events_total, bytes, elapsed / 1e6, records * 1e9 / elapsed, elapsed / records, checksum);
+	}
+	return 0;
+}
@@ -0,0 +1,226 @@
+// https://github.com/unxed/xkb2win
+// License: CC0-1.0 license
+
+#ifndef WIN32_INPUT_DECODER_C
+#define WIN32_INPUT_DECODER_C
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "xkb2win.c"
+
+// Streaming decoder of win32-input-mode ESC sequences, for apps receiving terminal input.
+// ESC [ Vk ; Sc ; Uc ; Kd ; Cs ; Rc _
+// Parameters larger than their fields (16 bit, Cs is 32 bit) make sequence not valid.
+// Input may be split between buffers at any byte: unfinished sequence is kept in decoder
+// and parsing is resumed with the next buffer.
+// Bytes that are not part of win32-input-mode sequence (plain text, other ESC sequences)
+// are passed through unchanged, in the same order relative to decoded key events.
+
+#define WIN32_INPUT_DECODER_TEXT    0 // outside of sequence
+#define WIN32_INPUT_DECODER_ESC     1 // got ESC
+#define WIN32_INPUT_DECODER_PARAMS  2 // got ESC [, parsing parameters
+
+struct win32_input_decoder {
+	// Called for every decoded key event
+	void (*on_event)(void *user, const struct win_key_event *event);
+	// Called for bytes that are not part of win32-input-mode sequence
+	void (*on_text)(void *user, const char *text, size_t len);
+	void *user;
+
+	unsigned int values[6];                 // parameters of sequence being parsed
+	unsigned char param;                    // index of parameter being parsed
+	unsigned char present;                  // bit mask of parameters that have digits
+	unsigned char state;                    // one of WIN32_INPUT_DECODER_* values
+	unsigned char pending_len;              // length of unfinished sequence
+	char pending[WIN32_INPUT_MODE_SEQ_MAX]; // unfinished sequence, passed as text if it turns out to be something else
+};
+
+static void win32_input_decoder_init(struct win32_input_decoder *decoder,
+	void (*on_event)(void *user, const struct win_key_event *event),
+	void (*on_text)(void *user, const char *text, size_t len),
+	void *user)
+{
+	memset(decoder, 0, sizeof(*decoder));
+	decoder->on_event = on_event;
+	decoder->on_text = on_text;
+	decoder->user = user;
+}
+
+// Helper function to find first ESC char
+// return
+//   pointer to ESC char, or end if there is none
+static inline const char *win32_input_decoder_find_esc(const char *p, const char *end)
+{
+#ifdef __SSE2__
+	const __m128i esc = _mm_set1_epi8('\x1b');
+	for (; end - p >= 16; p += 16) {
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), esc));
+		if (mask) { return p + __builtin_ctz(mask); }
+	}
+#endif
+	const char *esc_pos = (const char *)memchr(p, '\x1b', end - p);
+	return esc_pos ? esc_pos : end;
+}
+
+// Largest value of each parameter: control key state is 32 bit, others are 16 bit
+static const unsigned int win32_input_decoder_max[6] = { 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFFFFFF, 0xFFFF };
+
+// Helper function to add digit to parameter value
+// return
+//   1 on success, 0 if value is too large for parameter (sequence is not valid then)
+static inline int win32_input_decoder_digit(unsigned int *value, unsigned int param, unsigned int digit)
+{
+	if (*value > (win32_input_decoder_max[param] - digit) / 10) { return 0; }
+	*value = *value * 10 + digit;
+	return 1;
+}
+
+// Helper function to pass key event with parsed parameters, omitted ones set to defaults
+static inline void win32_input_decoder_emit(struct win32_input_decoder *decoder)
+{
+	struct win_key_event event;
+	event.vk = (unsigned short)decoder->values[0];
+	event.scan = (unsigned short)decoder->values[1];
+	event.unicode = (unsigned short)decoder->values[2];
+	event.key_down = decoder->values[3] ? 1 : 0;
+	event.control_key_state = decoder->values[4];
+	event.repeat_count = (decoder->present & (1 << 5)) ? (unsigned short)decoder->values[5] : 1;
+	decoder->on_event(decoder->user, &event);
+}
+
+static inline void win32_input_decoder_reset(struct win32_input_decoder *decoder)
+{
+	memset(decoder->values, 0, sizeof(decoder->values));
+	decoder->param = 0;
+	decoder->present = 0;
+	decoder->pending_len = 0;
+	decoder->state = WIN32_INPUT_DECODER_TEXT;
+}
+
+#ifdef __SSE2__
+// Vectorized parsing of whole sequence that is completely inside of the buffer.
+// Finds closing '_' and checks that everything before it is digits and up to five ';'
+// with three 16 byte compares, so only digit values are left for scalar code.
+// input:
+//   p - pointer to ESC char, at least 2 + 48 bytes should be readable
+// return
+//   pointer to the char next to sequence, or NULL if there is no valid sequence
+static inline const char *win32_input_decoder_fast(struct win32_input_decoder *decoder, const char *p)
+{
+	if (p[1] != '[') { return NULL; }
+	const char *body = p + 2;
+
+	const __m128i underscore = _mm_set1_epi8('_');
+	const __m128i semicolon = _mm_set1_epi8(';');
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i sign = _mm_set1_epi8((char)0x80);
+	const __m128i ten = _mm_set1_epi8((char)(0x80 + 10));
+
+	unsigned long long us_mask = 0, semi_mask = 0, digit_mask = 0;
+	for (int i = 0; i < 3; i++) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(body + i * 16));
+		// unsigned (v - '0') < 10, via signed compare with flipped sign bits
+		__m128i digit = _mm_cmplt_epi8(_mm_xor_si128(_mm_sub_epi8(v, zero), sign), ten);
+		us_mask |= (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, underscore)) << (i * 16);
+		semi_mask |= (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, semicolon)) << (i * 16);
+		digit_mask |= (unsigned long long)(unsigned)_mm_movemask_epi8(digit) << (i * 16);
+	}
+	if (!us_mask) { return NULL; }
+
+	int len = __builtin_ctzll(us_mask);
+	unsigned long long body_mask = (1ULL << len) - 1;
+	if (len > WIN32_INPUT_MODE_SEQ_MAX - 3) { return NULL; }
+	if (((digit_mask | semi_mask) & body_mask) != body_mask) { return NULL; }
+	if (__builtin_popcountll(semi_mask & body_mask) > 5) { return NULL; }
+
+	unsigned int values[6] = {0, 0, 0, 0, 0, 0};
+	unsigned int param = 0;
+	unsigned int present = 0;
+	for (int i = 0; i < len; i++) {
+		if (body[i] == ';') { param++; continue; }
+		if (!win32_input_decoder_digit(&values[param], param, body[i] - '0')) { return NULL; }
+		present |= 1u << param;
+	}
+	memcpy(decoder->values, values, sizeof(values));
+	decoder->present = (unsigned char)present;
+	win32_input_decoder_emit(decoder);
+	return body + len + 1;
+}
+#endif
+
+// This function decodes next chunk of input.
+// Key events and passed through text are reported via decoder callbacks as they are found.
+// Sequence that is not finished at the end of the chunk is continued with the next call.
+static void win32_input_decode(struct win32_input_decoder *decoder, const char *buf, size_t len)
+{
+	const char *p = buf;
+	const char *end = buf + len;
+
+	while (p < end) {
+		if (decoder->state == WIN32_INPUT_DECODER_TEXT) {
+			const char *esc = win32_input_decoder_find_esc(p, end);
+			if (esc != p) { decoder->on_text(decoder->user, p, esc - p); }
+			p = esc;
+			if (p == end) { break; }
+#ifdef __SSE2__
+			if (end - p >= 2 + 48) {
+				const char *next = win32_input_decoder_fast(decoder, p);
+				if (next) {
+					win32_input_decoder_reset(decoder);
+					p = next;
+					continue;
+				}
+			}
+#endif
+			decoder->pending[decoder->pending_len++] = *p++;
+			decoder->state = WIN32_INPUT_DECODER_ESC;
+			continue;
+		}
+
+		char c = *p;
+		int accepted = 0;
+		if (decoder->state == WIN32_INPUT_DECODER_ESC) {
+			if (c == '[') { decoder->state = WIN32_INPUT_DECODER_PARAMS; accepted = 1; }
+		} else if (c == '_') {
+			win32_input_decoder_emit(decoder);
+			win32_input_decoder_reset(decoder);
+			p++;
+			continue;
+		} else if (decoder->pending_len < WIN32_INPUT_MODE_SEQ_MAX - 1) {
+			if (c >= '0' && c <= '9'
+				&& win32_input_decoder_digit(&decoder->values[decoder->param], decoder->param, c - '0')) {
+				decoder->present |= 1 << decoder->param;
+				accepted = 1;
+			} else if (c == ';' && decoder->param < 5) {
+				decoder->param++;
+				accepted = 1;
+			}
+		}
+
+		if (accepted) {
+			decoder->pending[decoder->pending_len++] = c;
+			p++;
+		} else {
+			// Not a win32-input-mode sequence: pass it through,
+			// and process current char again as it may start new sequence
+			decoder->on_text(decoder->user, decoder->pending, decoder->pending_len);
+			win32_input_decoder_reset(decoder);
+		}
+	}
+}
+
+// This function passes unfinished sequence, if any, through as text.
+// Should be called when input ends, or when ESC is not followed by anything for too long
+// (which means it was Esc key press, not a start of sequence).
+static void win32_input_decoder_flush(struct win32_input_decoder *decoder)
+{
+	if (decoder->pending_len) {
+		decoder->on_text(decoder->user, decoder->pending, decoder->pending_len);
+	}
+	win32_input_decoder_reset(decoder);
+}
+
+#endif // WIN32_INPUT_DECODER_C
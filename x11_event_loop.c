@@ -0,0 +1,580 @@
+// https://github.com/unxed/xkb2win
+// License: CC0-1.0 license
+
+#ifndef X11_EVENT_LOOP_C
+#define X11_EVENT_LOOP_C
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#include "xkb2win.c"
+#include "x11_translator.c"
+#include "key_latency.c"
+#include "key_overrides.c"
+#include "xkb_text.c"
+#include "key_ring.c"
+
+// Event loop for terminals: waits for X11 connection and pty with epoll, on each wakeup
+// takes all X11 key events that are pending, translates them and writes resulting
+// win32-input-mode ESC sequences to pty with single writev() call.
+// Pty is written in non-blocking mode: if app does not read its input fast enough,
+// output is kept and X11 events are left queued until pty becomes writable again.
+
+#define X11_EVENT_LOOP_BATCH  64   // max count of X11 events processed together
+#define X11_EVENT_LOOP_CHUNK  4096 // size of output buffer chunk
+
+// Single X11 key event, as passed to on_key callback
+struct x11_event_loop_key {
+	XKeyEvent *xkey;                     // X11 event
+	const char *utf8;                    // Xutf8LookupString or xkb_text output, not null terminated
+	int utf8_len;                        // its length in bytes
+	unsigned int repeats;                // autorepeat count, 0 if event is folded into previous one
+	const struct win_key_event *events;  // translated key events, NULL if folded
+	size_t count;                        // count of translated key events
+};
+
+// Part of output buffer; chunks are written together with writev()
+struct x11_event_loop_chunk {
+	size_t len;
+	char data[X11_EVENT_LOOP_CHUNK];
+};
+
+struct x11_event_loop {
+	Display *display;
+	XIC ic;                            // input context for Xutf8LookupString
+	struct xkb_text *xkb_text;         // if not NULL, text is made with it instead of Xutf8LookupString
+	struct x11_translator *translator;
+	int pty_fd;                        // where ESC sequences are written, -1 if nowhere
+	int fold_repeats;                  // pass autorepeats as repeat count, see x11_fold_autorepeat()
+
+	// Called for every X11 key event after translation, may be NULL
+	void (*on_key)(void *user, const struct x11_event_loop_key *key);
+	// Called when pty has data to read (app output), may be NULL
+	void (*on_pty_input)(void *user, int fd);
+	// Called after override file is reloaded, with key_overrides_poll() result, may be NULL
+	void (*on_overrides_reload)(void *user, int result);
+	void *user;
+
+	struct key_overrides *overrides;   // reloaded when override file changes, may be NULL
+	struct key_ring *ring;             // shared memory transport, used instead of pty while app is connected;
+	                                   // may be NULL, see x11_event_loop_pty_output()
+	struct key_ring_scanner ring_scanner; // KEY_RING_REQUEST search in app output
+
+	int epoll_fd;
+	int stop;                          // set by x11_event_loop_stop()
+	int x11_watched;                   // X11 connection is watched by epoll
+	int pty_events;                    // epoll events pty is watched for
+	int pty_watched;                   // pty_fd is watched by epoll; regular files and /dev/null can not be,
+	                                   // they are written with blocking writes
+
+	struct x11_event_loop_chunk **chunks; // output buffer
+	size_t chunks_allocated;
+	size_t chunks_used;                // chunks with data, last one may have room left
+	size_t sent;                       // bytes of first chunk already written
+
+	struct win_key_event *ring_pending; // key events that did not fit into ring yet
+	size_t ring_pending_count;
+	size_t ring_pending_size;
+
+	struct win_key_event *events;      // translation buffer, grows for long IME commit strings
+	size_t events_size;
+	char *text;                        // Xutf8LookupString buffer, grows for long IME commit strings
+	size_t text_size;
+
+	XEvent batch[X11_EVENT_LOOP_BATCH];
+	struct x11_key_event keys[X11_EVENT_LOOP_BATCH];
+	unsigned int repeats[X11_EVENT_LOOP_BATCH];
+};
+
+// input:
+//   display - X11 connection
+//   ic - input context for Xutf8LookupString
+//   translator - translation state, should outlive event loop
+//   pty_fd - pty master (or any fd) to write ESC sequences to, -1 to only call on_key;
+//            it is switched to non-blocking mode if epoll can watch it, otherwise (regular file,
+//            /dev/null) it is written with blocking writes and on_pty_input is never called
+// return
+//   1 on success, 0 on failure
+static int x11_event_loop_init(struct x11_event_loop *loop, Display *display, XIC ic,
+	struct x11_translator *translator, int pty_fd)
+{
+	memset(loop, 0, sizeof(*loop));
+	loop->display = display;
+	loop->ic = ic;
+	loop->translator = translator;
+	loop->pty_fd = pty_fd;
+
+	loop->events_size = 256;
+	loop->events = (struct win_key_event *)malloc(loop->events_size * sizeof(struct win_key_event));
+	loop->text_size = 256;
+	loop->text = (char *)malloc(loop->text_size);
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (!loop->events || !loop->text || loop->epoll_fd < 0) { return 0; }
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = ConnectionNumber(display);
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) { return 0; }
+	loop->x11_watched = 1;
+
+	if (pty_fd >= 0) {
+		ev.events = 0;
+		ev.data.fd = pty_fd;
+		if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, pty_fd, &ev) == 0) {
+			fcntl(pty_fd, F_SETFL, fcntl(pty_fd, F_GETFL) | O_NONBLOCK);
+			loop->pty_watched = 1;
+		} else if (errno != EPERM) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void x11_event_loop_free(struct x11_event_loop *loop)
+{
+	for (size_t i = 0; i < loop->chunks_allocated; i++) { free(loop->chunks[i]); }
+	free(loop->chunks);
+	free(loop->ring_pending);
+	free(loop->events);
+	free(loop->text);
+	if (loop->epoll_fd >= 0) { close(loop->epoll_fd); }
+	memset(loop, 0, sizeof(*loop));
+	loop->epoll_fd = -1;
+}
+
+// This function makes x11_event_loop_run() return after current wakeup is processed.
+// Can be called from callbacks.
+static void x11_event_loop_stop(struct x11_event_loop *loop)
+{
+	loop->stop = 1;
+}
+
+// Helper function to get chunk of output buffer with room for more data
+// return
+//   chunk, or NULL if out of memory
+static struct x11_event_loop_chunk *x11_event_loop_chunk_get(struct x11_event_loop *loop)
+{
+	// Chunk is full when even one more sequence of max length may not fit into it
+	if (loop->chunks_used && loop->chunks[loop->chunks_used - 1]->len + WIN32_INPUT_MODE_SEQ_MAX <= X11_EVENT_LOOP_CHUNK) {
+		return loop->chunks[loop->chunks_used - 1];
+	}
+	if (loop->chunks_used == loop->chunks_allocated) {
+		size_t n = loop->chunks_allocated ? loop->chunks_allocated * 2 : 4;
+		struct x11_event_loop_chunk **chunks = (struct x11_event_loop_chunk **)realloc(loop->chunks, n * sizeof(*chunks));
+		if (!chunks) { return NULL; }
+		memset(chunks + loop->chunks_allocated, 0, (n - loop->chunks_allocated) * sizeof(*chunks));
+		loop->chunks = chunks;
+		loop->chunks_allocated = n;
+	}
+	if (!loop->chunks[loop->chunks_used]) {
+		loop->chunks[loop->chunks_used] = (struct x11_event_loop_chunk *)malloc(sizeof(struct x11_event_loop_chunk));
+		if (!loop->chunks[loop->chunks_used]) { return NULL; }
+	}
+	struct x11_event_loop_chunk *chunk = loop->chunks[loop->chunks_used++];
+	chunk->len = 0;
+	return chunk;
+}
+
+// Helper function to ensure buffer has room for given count of items
+static int x11_event_loop_reserve(void **buf, size_t *size, size_t needed, size_t item_size)
+{
+	if (needed <= *size) { return 1; }
+	void *p = realloc(*buf, needed * item_size);
+	if (!p) { return 0; }
+	*buf = p;
+	*size = needed;
+	return 1;
+}
+
+// Helper function to pass key events through ring; those that do not fit wait in ring_pending
+static void x11_event_loop_ring_append(struct x11_event_loop *loop, const struct win_key_event *events, size_t count)
+{
+	if (!loop->ring_pending_count) {
+		size_t pushed = key_ring_push(loop->ring, events, count);
+		events += pushed;
+		count -= pushed;
+	}
+	if (count && x11_event_loop_reserve((void **)&loop->ring_pending, &loop->ring_pending_size,
+		loop->ring_pending_count + count, sizeof(struct win_key_event))) {
+		memcpy(loop->ring_pending + loop->ring_pending_count, events, count * sizeof(struct win_key_event));
+		loop->ring_pending_count += count;
+	}
+}
+
+// Helper function to pass key events waiting in ring_pending
+// return
+//   1 if everything is passed, 0 if ring is still full
+static int x11_event_loop_ring_flush(struct x11_event_loop *loop)
+{
+	size_t pushed = key_ring_push(loop->ring, loop->ring_pending, loop->ring_pending_count);
+	loop->ring_pending_count -= pushed;
+	memmove(loop->ring_pending, loop->ring_pending + pushed, loop->ring_pending_count * sizeof(struct win_key_event));
+	return !loop->ring_pending_count;
+}
+
+// Helper function to append bytes to output buffer
+static void x11_event_loop_append_bytes(struct x11_event_loop *loop, const char *data, size_t len)
+{
+	while (len) {
+		struct x11_event_loop_chunk *chunk = x11_event_loop_chunk_get(loop);
+		if (!chunk) { return; }
+		size_t n = X11_EVENT_LOOP_CHUNK - chunk->len;
+		if (n > len) { n = len; }
+		memcpy(chunk->data + chunk->len, data, n);
+		chunk->len += n;
+		data += n;
+		len -= n;
+	}
+}
+
+// Helper function to append ESC sequences for key events to output buffer,
+// or pass key events through ring if app is connected to it
+static void x11_event_loop_append(struct x11_event_loop *loop, const struct win_key_event *events, size_t count)
+{
+	if (loop->ring && loop->ring->conn_fd >= 0) {
+		x11_event_loop_ring_append(loop, events, count);
+		return;
+	}
+	if (loop->pty_fd < 0) { return; }
+	while (count) {
+		struct x11_event_loop_chunk *chunk = x11_event_loop_chunk_get(loop);
+		if (!chunk) { return; }
+		size_t encoded;
+		chunk->len += win32_input_mode_encode(events, count, chunk->data + chunk->len,
+			X11_EVENT_LOOP_CHUNK - chunk->len, &encoded);
+		events += encoded;
+		count -= encoded;
+	}
+}
+
+// Helper function to write as much of output buffer as pty accepts
+// return
+//   1 if everything is written, 0 if some output is left, -1 on error
+static int x11_event_loop_flush(struct x11_event_loop *loop)
+{
+	while (loop->chunks_used) {
+		struct iovec iov[64];
+		int iov_count = 0;
+		for (size_t i = 0; i < loop->chunks_used && iov_count < 64; i++) {
+			size_t skip = i ? 0 : loop->sent;
+			iov[iov_count].iov_base = loop->chunks[i]->data + skip;
+			iov[iov_count].iov_len = loop->chunks[i]->len - skip;
+			iov_count++;
+		}
+
+		KEY_LATENCY_START(write_start);
+		ssize_t written = writev(loop->pty_fd, iov, iov_count);
+		KEY_LATENCY_END(KEY_LATENCY_WRITE, write_start);
+		if (written < 0) {
+			if (errno == EINTR) { continue; }
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+
+		// Move chunks that are written completely to the end of list, for reuse
+		size_t left = written + loop->sent;
+		while (loop->chunks_used && left >= loop->chunks[0]->len) {
+			left -= loop->chunks[0]->len;
+			struct x11_event_loop_chunk *done = loop->chunks[0];
+			memmove(loop->chunks, loop->chunks + 1, (loop->chunks_allocated - 1) * sizeof(*loop->chunks));
+			loop->chunks[loop->chunks_allocated - 1] = done;
+			loop->chunks_used--;
+		}
+		loop->sent = left;
+		if (loop->chunks_used && loop->pty_watched) { return 0; } // partial write, pty is full
+	}
+	return 1;
+}
+
+// Helper function to add fd to epoll
+static int x11_event_loop_add(struct x11_event_loop *loop, int fd, int events)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0 || errno == EEXIST;
+}
+
+// This function answers app's KEY_RING_REQUEST: creates ring if there is none yet,
+// and appends reply with socket name to pty output.
+// loop->ring should be set and initialized with key_ring_init(), and freed with
+// key_ring_free() after event loop is freed; once app connects, key events go through
+// ring instead of pty.
+// return
+//   1 if reply is sent, 0 on failure (app gets no reply and keeps using ESC sequences)
+static int x11_event_loop_offer_ring(struct x11_event_loop *loop)
+{
+	if (!loop->ring || loop->pty_fd < 0) { return 0; }
+	if (!loop->ring->shared) {
+		if (!key_ring_create(loop->ring)) { return 0; }
+		if (!x11_event_loop_add(loop, loop->ring->listen_fd, EPOLLIN)
+			|| !x11_event_loop_add(loop, loop->ring->space_eventfd, EPOLLIN)) {
+			epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->ring->listen_fd, NULL);
+			key_ring_free(loop->ring);
+			return 0;
+		}
+	}
+	char reply[128];
+	size_t len = key_ring_reply(loop->ring, reply, sizeof(reply));
+	x11_event_loop_append_bytes(loop, reply, len);
+	return len != 0;
+}
+
+// Helper function to connect app waiting on ring socket.
+// KEY_RING_START is appended to pty output after key events already there,
+// so app knows where pty input ends and ring input starts.
+// return
+//   1 if app is connected, 0 otherwise (app keeps getting key events through pty)
+static int x11_event_loop_accept_ring(struct x11_event_loop *loop)
+{
+	// New app starts with empty ring; connections are refused while app is connected
+	if (!key_ring_accept(loop->ring)) { return 0; }
+	loop->ring_pending_count = 0;
+	if (!x11_event_loop_add(loop, loop->ring->conn_fd, EPOLLIN | EPOLLRDHUP)) {
+		key_ring_disconnect(loop->ring);
+		return 0;
+	}
+	x11_event_loop_append_bytes(loop, KEY_RING_START, sizeof(KEY_RING_START) - 1);
+	return 1;
+}
+
+// This function should be called from on_pty_input with app output read from pty.
+// Ring is offered to app only if it asks for it with KEY_RING_REQUEST (see key_ring.c),
+// request may be split between reads. Nothing is done if loop->ring is NULL.
+// return
+//   count of replies sent
+static size_t x11_event_loop_pty_output(struct x11_event_loop *loop, const char *buf, size_t len)
+{
+	if (!loop->ring) { return 0; }
+	size_t replies = 0;
+	for (size_t requests = key_ring_scan(&loop->ring_scanner, buf, len); requests; requests--) {
+		replies += x11_event_loop_offer_ring(loop);
+	}
+	return replies;
+}
+
+// Helper function to write output buffer to pty, or drop it if there is no pty
+// return
+//   1 if everything is written, 0 if some output is left, -1 on error
+static int x11_event_loop_output(struct x11_event_loop *loop)
+{
+	if (loop->pty_fd < 0) {
+		loop->chunks_used = 0;
+		return 1;
+	}
+	return loop->chunks_used ? x11_event_loop_flush(loop) : 1;
+}
+
+// Helper function to translate batch of X11 events and append result to output buffer
+static void x11_event_loop_process(struct x11_event_loop *loop, int batch_count)
+{
+	int run_len = 0; // text length of last KeyPress that was looked up, its text is left in loop->text
+	for (int b = 0; b < batch_count; b++) {
+		XEvent *event = &loop->batch[b];
+		loop->keys[b].keycode = event->xkey.keycode;
+		loop->keys[b].state = event->xkey.state;
+		loop->keys[b].time = event->xkey.time;
+		loop->keys[b].key_down = (event->type == KeyPress);
+		loop->repeats[b] = 1;
+#ifdef XKB2WIN_LATENCY
+		// X server timestamps are CLOCK_MONOTONIC ms on Linux, so for local server
+		// they can be compared with our clock; other clocks give nonsense, which is skipped
+		unsigned long long now_ms = key_latency_now() / 1000000;
+		unsigned int queued_ms = (unsigned int)now_ms - event->xkey.time;
+		if ((event->type == KeyPress || event->type == KeyRelease) && queued_ms < 10000) {
+			KEY_LATENCY_RECORD(KEY_LATENCY_QUEUE, queued_ms * 1000000ULL);
+		}
+#endif
+	}
+	if (loop->fold_repeats) {
+		x11_fold_autorepeat(loop->keys, batch_count, loop->repeats);
+	}
+
+	for (int b = 0; b < batch_count && !loop->stop; b++) {
+		XEvent *event = &loop->batch[b];
+		if (event->type == MappingNotify) {
+			// Keyboard layouts were changed
+			XRefreshKeyboardMapping(&event->xmapping);
+			if (loop->xkb_text && event->xmapping.request == MappingKeyboard) { xkb_text_reload(loop->xkb_text); }
+			continue;
+		}
+		if ((event->type != KeyPress) && (event->type != KeyRelease)) { continue; }
+
+		// Get UTF-8 string corresponding to key event
+		// IME commit strings may not fit into buffer, X11 tells us the size needed then
+		KEY_LATENCY_START(lookup_start);
+		int r;
+		int composing = loop->xkb_text && xkb_text_composing(loop->xkb_text);
+		if (loop->xkb_text && !loop->repeats[b]) {
+			// Folded presses give the same text as KeyPress they are folded into, see below,
+			// so they are not fed to compose; that text is still in buffer, as only dropped
+			// KeyRelease events, that are not looked up, may be between them
+			r = (event->type == KeyPress) ? run_len : 0;
+		} else if (loop->xkb_text) {
+			r = xkb_text_lookup(loop->xkb_text, event->xkey.keycode, event->type == KeyPress, event->xkey.state,
+				loop->text, loop->text_size);
+			if ((r >= (int)loop->text_size) && x11_event_loop_reserve((void **)&loop->text, &loop->text_size, r + 1, 1)) {
+				r = xkb_text_lookup(loop->xkb_text, event->xkey.keycode, event->type == KeyPress, event->xkey.state,
+					loop->text, loop->text_size);
+			}
+			// Out of memory: text is cut, the rest of it is dropped
+			if (r >= (int)loop->text_size) {
+				xkb_text_discard(loop->xkb_text);
+				r = loop->text_size - 1;
+			}
+			if (r < 0) { r = 0; }
+		} else {
+			Status s;
+			r = Xutf8LookupString(loop->ic, &event->xkey, loop->text, loop->text_size, 0, &s);
+			if ((s == XBufferOverflow) && x11_event_loop_reserve((void **)&loop->text, &loop->text_size, r, 1)) {
+				r = Xutf8LookupString(loop->ic, &event->xkey, loop->text, loop->text_size, 0, &s);
+			}
+			if ((s != XLookupChars) && (s != XLookupBoth)) { r = 0; }
+		}
+		KEY_LATENCY_END(KEY_LATENCY_LOOKUP, lookup_start);
+		if (loop->repeats[b] && (event->type == KeyPress)) { run_len = r; }
+
+		// KeyPress that is a part of Dead key or Compose key sequence gives different text
+		// than its repeats would, so they are passed one by one, as without folding
+		if ((loop->repeats[b] > 1) && loop->xkb_text && (composing || xkb_text_composing(loop->xkb_text))) {
+			x11_unfold_autorepeat(loop->keys, batch_count, b, loop->repeats);
+		}
+
+		struct x11_event_loop_key key;
+		key.xkey = &event->xkey;
+		key.utf8 = loop->text;
+		key.utf8_len = r;
+		key.repeats = loop->repeats[b];
+		key.events = NULL;
+		key.count = 0;
+
+		if (key.repeats) {
+			x11_event_loop_reserve((void **)&loop->events, &loop->events_size, r, sizeof(struct win_key_event));
+			key.events = loop->events;
+			key.count = x11_translate(loop->translator, event->xkey.keycode, event->type == KeyPress,
+				event->xkey.state, loop->text, r, loop->events, loop->events_size);
+
+			// Pass autorepeats as repeat count, if key event has single unicode char.
+			// Otherwise there is no way to express repeat in single sequence, so it is repeated instead
+			unsigned int copies = 1;
+			if (key.repeats > 1) {
+				if (key.count == 1) { loop->events[0].repeat_count = key.repeats; }
+				else { copies = key.repeats; }
+			}
+			KEY_LATENCY_START(encode_start);
+			for (unsigned int c = 0; c < copies; c++) {
+				x11_event_loop_append(loop, key.events, key.count);
+			}
+			KEY_LATENCY_END(KEY_LATENCY_ENCODE, encode_start);
+		}
+
+		if (loop->on_key) { loop->on_key(loop->user, &key); }
+	}
+}
+
+// Helper function to change epoll events fd is watched for, if they differ
+static void x11_event_loop_watch(struct x11_event_loop *loop, int fd, int events, int *current)
+{
+	if (events == *current) { return; }
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+	*current = events;
+}
+
+// This function runs event loop until x11_event_loop_stop() is called or error occurs.
+// return
+//   1 if stopped, 0 on error (X11 connection or pty is closed)
+static int x11_event_loop_run(struct x11_event_loop *loop)
+{
+	const int x11_fd = ConnectionNumber(loop->display);
+	int x11_events = EPOLLIN;
+	loop->pty_events = 0;
+
+	const int overrides_fd = loop->overrides ? loop->overrides->inotify_fd : -1;
+	if (overrides_fd >= 0 && !x11_event_loop_add(loop, overrides_fd, EPOLLIN)) { return 0; }
+
+	while (!loop->stop) {
+		// Output left from previous wakeup is written first, X11 events stay queued until it is
+		KEY_LATENCY_START(wakeup_start);
+		int flushed = x11_event_loop_output(loop);
+		if (flushed < 0) { return 0; }
+		int ring_flushed = loop->ring_pending_count ? x11_event_loop_ring_flush(loop) : 1;
+
+		// Take all pending X11 events, then single write for everything translated on this wakeup
+		if (flushed && ring_flushed) {
+			int processed = 0;
+			while (!loop->stop && XPending(loop->display)) {
+				int batch_count = 0;
+				do {
+					XNextEvent(loop->display, &loop->batch[batch_count]);
+					// Input method takes key events it composes text of, committed text comes with later event
+					if (!loop->xkb_text && XFilterEvent(&loop->batch[batch_count], None)) { continue; }
+					batch_count++;
+				} while ((batch_count < X11_EVENT_LOOP_BATCH) && XEventsQueued(loop->display, QueuedAlready));
+				x11_event_loop_process(loop, batch_count);
+				processed = 1;
+			}
+			flushed = x11_event_loop_output(loop);
+			if (flushed < 0) { return 0; }
+			if (loop->ring_pending_count) { ring_flushed = 0; }
+			if (processed) { KEY_LATENCY_END(KEY_LATENCY_WAKEUP, wakeup_start); }
+		}
+		if (loop->stop) { break; }
+
+		// While pty or ring is full, wait for it to become writable and leave X11 events queued
+		int writable = flushed && ring_flushed;
+		x11_event_loop_watch(loop, x11_fd, writable ? (int)EPOLLIN : 0, &x11_events);
+		if (loop->pty_watched) {
+			x11_event_loop_watch(loop, loop->pty_fd,
+				(loop->on_pty_input ? (int)EPOLLIN : 0) | (flushed ? 0 : (int)EPOLLOUT), &loop->pty_events);
+		}
+		XFlush(loop->display);
+
+		// Events Xlib has already read from X11 connection do not make it readable again,
+		// so epoll would not wake up for them
+		int timeout = -1;
+		// While ring is full, app wakes us up through space_eventfd when it reads key events
+		if (!ring_flushed && !key_ring_prepare_space_wait(loop->ring)) { timeout = 0; }
+		if (writable && XEventsQueued(loop->display, QueuedAlready)) { timeout = 0; }
+
+		struct epoll_event ready[4];
+		int n = epoll_wait(loop->epoll_fd, ready, 4, timeout);
+		if (n < 0 && errno != EINTR) { return 0; }
+		for (int i = 0; i < n; i++) {
+			struct key_ring *ring = loop->ring;
+			if (ring && ready[i].data.fd == ring->listen_fd) {
+				x11_event_loop_accept_ring(loop);
+			} else if (ring && ready[i].data.fd == ring->space_eventfd) {
+				key_ring_space_wakeup(ring);
+			} else if (ring && ready[i].data.fd == ring->conn_fd) {
+				// App does not write to socket, so any event means it is closed
+				epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, ring->conn_fd, NULL);
+				key_ring_disconnect(ring);
+				loop->ring_pending_count = 0;
+			} else if (ready[i].data.fd == loop->pty_fd) {
+				if ((ready[i].events & EPOLLIN) && loop->on_pty_input) { loop->on_pty_input(loop->user, loop->pty_fd); }
+				if ((ready[i].events & (EPOLLERR | EPOLLHUP)) && !(ready[i].events & EPOLLIN)) { return 0; }
+			} else if (ready[i].data.fd == overrides_fd) {
+				int result = key_overrides_poll(loop->overrides);
+				if (result && loop->on_overrides_reload) { loop->on_overrides_reload(loop->user, result); }
+			} else if (ready[i].events & (EPOLLERR | EPOLLHUP)) {
+				return 0; // X11 connection closed
+			}
+		}
+	}
+	return 1;
+}
+
+#endif // X11_EVENT_LOOP_C
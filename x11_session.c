@@ -0,0 +1,88 @@
+// https://github.com/unxed/xkb2win
+// License: CC0-1.0 license
+
+#ifndef X11_SESSION_C
+#define X11_SESSION_C
+
+#include <stdlib.h>
+
+#include "xkb2win.c"
+#include "keymap_cache.c"
+#include "x11_translator.c"
+
+// Translation for many terminal sessions in one process (multiplexers and the like).
+// Translation table is loaded once and shared by all sessions via reference counting;
+// it is never modified after loading, so sessions can translate in different threads
+// at the same time without locks. Each session keeps only its own NumLock and control
+// key state (see x11_translator), a few bytes, and needs no keymap compilation or xkb_state:
+// everything xkb_state was used for is precomputed in translation table.
+// Single session should be used by one thread at a time.
+
+// Translation table shared between sessions
+struct xkb2win_shared_table {
+	int refs;                                  // reference count, changed atomically
+	struct keymap_cache cache;                 // table and keymap text
+	const struct xkb2win_keycode_table *table; // translation table, immutable
+};
+
+// This function loads translation table for keyboard layout (see keymap_cache_load()).
+// return
+//   shared table with single reference, or NULL on failure
+static struct xkb2win_shared_table *xkb2win_shared_table_new(const char *layout)
+{
+	struct xkb2win_shared_table *shared = (struct xkb2win_shared_table *)malloc(sizeof(struct xkb2win_shared_table));
+	if (!shared) { return NULL; }
+	if (!keymap_cache_load(&shared->cache, layout)) {
+		free(shared);
+		return NULL;
+	}
+	shared->table = shared->cache.table;
+	shared->refs = 1;
+	return shared;
+}
+
+// Can be called from any thread
+static struct xkb2win_shared_table *xkb2win_shared_table_ref(struct xkb2win_shared_table *shared)
+{
+	__atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+	return shared;
+}
+
+// Can be called from any thread; table is freed with last reference
+static void xkb2win_shared_table_unref(struct xkb2win_shared_table *shared)
+{
+	if (__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		keymap_cache_close(&shared->cache);
+		free(shared);
+	}
+}
+
+// Single terminal session
+struct x11_session {
+	struct xkb2win_shared_table *shared; // referenced by session
+	struct x11_translator translator;    // NumLock and control key state of session
+};
+
+// input:
+//   shared - translation table, session takes its own reference
+//   numlock - initial NumLock state of session's keyboard
+static void x11_session_init(struct x11_session *session, struct xkb2win_shared_table *shared, int numlock)
+{
+	session->shared = xkb2win_shared_table_ref(shared);
+	x11_translator_init(&session->translator, shared->table, numlock);
+}
+
+static void x11_session_free(struct x11_session *session)
+{
+	xkb2win_shared_table_unref(session->shared);
+	session->shared = NULL;
+}
+
+// This function translates X11 key event of the session, see x11_translate()
+static inline size_t x11_session_translate(struct x11_session *session, unsigned int keycode, int key_down,
+	unsigned int state, const char *utf8, size_t utf8_len, struct win_key_event *events, size_t max_events)
+{
+	return x11_translate(&session->translator, keycode, key_down, state, utf8, utf8_len, events, max_events);
+}
+
+#endif // X11_SESSION_C
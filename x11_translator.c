@@ -0,0 +1,220 @@
+// https://github.com/unxed/xkb2win
+// License: CC0-1.0 license
+
+#ifndef X11_TRANSLATOR_C
+#define X11_TRANSLATOR_C
+
+#include <X11/X.h>
+
+#include "xkb2win.c"
+#include "key_latency.c"
+
+// Translation of X11 key events to win32-like key events.
+// Keeps NumLock and control key state between events, as that state
+// can not be restored from single X11 event. Needs no X11 connection,
+// so it can also be fed with recorded events.
+
+struct x11_translator {
+	const struct xkb2win_keycode_table *table;         // translation table for English keyboard layout
+	const struct xkb2win_keycode_table *const *active; // if not NULL, table is atomically read from here instead,
+	                                                   // on every event (see key_overrides)
+	const unsigned long long *epoch;                   // reload count of active pointer, read before table
+	unsigned long long reading;                        // epoch read + 1 while table is used, 0 otherwise;
+	                                                   // tables replaced since then are not freed until it is 0
+	struct x11_translator *next_reader;                // next translator reading the same active pointer
+	int numlock;                                       // NumLock state of our virtual english keyboard
+	int cks;                                           // Value for dwControlKeyState field, without lock states
+};
+
+// input:
+//   table - translation table, should outlive translator
+//   numlock - initial NumLock state of physical keyboard
+static void x11_translator_init(struct x11_translator *tr, const struct xkb2win_keycode_table *table, int numlock)
+{
+	tr->table = table;
+	tr->active = NULL;
+	tr->epoch = NULL;
+	tr->reading = 0;
+	tr->next_reader = NULL;
+	tr->numlock = numlock ? 1 : 0;
+	tr->cks = 0;
+}
+
+// This function translates single X11 key event to win32-like key events.
+// If X11 gives us more than 1 unicode char, separate key event is generated for each char.
+// Chars above U+FFFF get two key events, for high and low surrogates.
+// input:
+//   keycode - X11 keycode of the key
+//   key_down - 1 for KeyPress, 0 for KeyRelease
+//   state - X11 modifiers mask from the event
+//   utf8 - UTF-8 string corresponding to key event (Xutf8LookupString output), of any length
+//   utf8_len - length of UTF-8 string in bytes
+//   max_events - size of events array, should be at least 1;
+//                max_events >= utf8_len is always enough
+// outout:
+//   events - translated key events
+// return
+//   count of key events, at least 1
+static size_t x11_translate(struct x11_translator *tr, unsigned int keycode, int key_down, unsigned int state,
+	const char *utf8, size_t utf8_len, struct win_key_event *events, size_t max_events)
+{
+	KEY_LATENCY_START(key_start);
+
+	// Update our virtual keyboard state so it has NumLock state equal to actual physical NumLock state.
+	// Shift key presses are not taken into account by translation table
+	// as we want KeySyms for non-alphabetic char keys to be in lower case
+	// for X11-to-WinKey translations.
+	if ((keycode == XKB2WIN_KEYCODE_NUMLOCK) && key_down) {
+		tr->numlock = !tr->numlock;
+	}
+
+	// Get X11 KeySym and Windows key codes for the pressed key
+	// Epoch is announced before active pointer is read: table read then is either active one,
+	// or one replaced after that epoch, which reload does not free while we read it.
+	// Wait-free, no retries however often table is reloaded
+	const struct xkb2win_keycode_table *table = tr->table;
+	if (tr->active) {
+		__atomic_store_n(&tr->reading, __atomic_load_n(tr->epoch, __ATOMIC_SEQ_CST) + 1, __ATOMIC_SEQ_CST);
+		table = __atomic_load_n(tr->active, __ATOMIC_SEQ_CST);
+	}
+	const struct xkb2win_keycode *translation = xkb2win_keycode_lookup(table, keycode, tr->numlock);
+	xkb_keysym_t sym = translation->sym;
+	struct winkey win_key = translation->key;
+	if (tr->active) { __atomic_store_n(&tr->reading, 0, __ATOMIC_RELEASE); }
+	int cks = tr->cks;
+
+	// Reset Windows control key state in case modifier key release event is lost (due to window focus lost, etc)
+	if (!(state & ShiftMask))
+		{ cks &= ~LEFT_SHIFT_PRESSED; cks &= ~RIGHT_SHIFT_PRESSED; cks &= ~SHIFT_PRESSED; }
+	if (!(state & ControlMask))
+		{ cks &= ~LEFT_CTRL_PRESSED; cks &= ~RIGHT_CTRL_PRESSED; }
+	if (!(state & Mod1Mask) && !(state & Mod5Mask)) // sometimes AltGr is mapped to Mod5
+		{ cks &= ~LEFT_ALT_PRESSED; cks &= ~RIGHT_ALT_PRESSED; }
+
+	// Update Windows control key state
+	if ((sym == XKB_KEY_Shift_L) &&  key_down) { cks |=  LEFT_SHIFT_PRESSED;  cks |=  SHIFT_PRESSED; }
+	if ((sym == XKB_KEY_Shift_L) && !key_down) { cks &= ~LEFT_SHIFT_PRESSED;  cks &= ~SHIFT_PRESSED; }
+	if ((sym == XKB_KEY_Shift_R) &&  key_down) { cks |=  RIGHT_SHIFT_PRESSED; cks |=  SHIFT_PRESSED; }
+	if ((sym == XKB_KEY_Shift_R) && !key_down) { cks &= ~RIGHT_SHIFT_PRESSED; cks &= ~SHIFT_PRESSED; }
+
+	if ((sym == XKB_KEY_Control_L) &&  key_down) { cks |=  LEFT_CTRL_PRESSED;  }
+	if ((sym == XKB_KEY_Control_L) && !key_down) { cks &= ~LEFT_CTRL_PRESSED;  }
+	if ((sym == XKB_KEY_Control_R) &&  key_down) { cks |=  RIGHT_CTRL_PRESSED; }
+	if ((sym == XKB_KEY_Control_R) && !key_down) { cks &= ~RIGHT_CTRL_PRESSED; }
+
+	if ((sym == XKB_KEY_Alt_L) &&  key_down) { cks |=  LEFT_ALT_PRESSED;  }
+	if ((sym == XKB_KEY_Alt_L) && !key_down) { cks &= ~LEFT_ALT_PRESSED;  }
+	if ((sym == XKB_KEY_Alt_R) &&  key_down) { cks |=  RIGHT_ALT_PRESSED; }
+	if ((sym == XKB_KEY_Alt_R) && !key_down) { cks &= ~RIGHT_ALT_PRESSED; }
+
+	tr->cks = cks;
+
+	// Update Windows control keys state to actual num/caps/scroll lock state
+	int cks_current = cks | (win_key.enhanced ? ENHANCED_KEY : 0);
+	if (state & LockMask)    cks_current |= CAPSLOCK_ON;
+	if (state & Mod2Mask)    cks_current |= NUMLOCK_ON;
+	if (state & Mod3Mask)    cks_current |= SCROLLLOCK_ON;
+
+	struct win_key_event e;
+	e.vk = win_key.vk;                  // VirtualKeyCode
+	e.scan = win_key.scan;              // VirtualScanCode
+	e.unicode = 0;                      // Unicode Char as integer value
+	e.key_down = key_down ? 1 : 0;      // KeyDown or KeyUp flag
+	e.control_key_state = cks_current;  // dwControlKeyState
+	e.repeat_count = 1;                 // RepeatCount
+	KEY_LATENCY_END(KEY_LATENCY_KEY, key_start);
+
+	KEY_LATENCY_START(text_start);
+	size_t count = 0;  // number of key events
+	size_t offset = 0; // offset of first not converted utf8 char
+	while (offset < utf8_len && count < max_events) {
+		unsigned short units[256];
+		size_t consumed;
+		size_t n = utf8_to_utf16(utf8 + offset, utf8_len - offset, units,
+			(max_events - count < 256) ? max_events - count : 256, &consumed);
+		if (!n) { break; }
+		for (size_t i = 0; i < n; i++) {
+			events[count] = e;
+			events[count].unicode = units[i];
+			count++;
+		}
+		offset += consumed;
+	}
+	KEY_LATENCY_END(KEY_LATENCY_TEXT, text_start);
+
+	// No unicode value for that key event, still key event should be generated
+	if (!count) {
+		events[0] = e;
+		count = 1;
+	}
+	return count;
+}
+
+// X11 key event fields needed to detect autorepeat
+struct x11_key_event {
+	unsigned int keycode;   // X11 keycode
+	unsigned int state;     // X11 modifiers mask
+	unsigned int time;      // X11 event timestamp, ms
+	unsigned char key_down; // 1 for KeyPress, 0 for KeyRelease
+};
+
+// This function finds autorepeat in a batch of key events that were already queued together,
+// so each run of repeats can be passed as single key down event with wRepeatCount set,
+// as KEY_EVENT_RECORD allows, instead of separate event for each repeat.
+// Without detectable autorepeat X11 sends KeyRelease and KeyPress pair with identical timestamps
+// for each repeat; KeyRelease of such pair is dropped. With detectable autorepeat it sends
+// KeyPress only. KeyPress of the same key with the same modifiers that follows
+// KeyPress (with nothing else in between) is a repeat, and is folded into that KeyPress.
+// input:
+//   events - key events, in order they were received
+//   count - number of key events
+// outout:
+//   repeats - for each event: 0 if it is dropped or folded into previous one,
+//             otherwise repeat count it should be passed with
+static void x11_fold_autorepeat(const struct x11_key_event *events, size_t count, unsigned int *repeats)
+{
+	const size_t none = (size_t)-1;
+	size_t run = none; // index of KeyPress following repeats are folded into
+	for (size_t i = 0; i < count; i++) {
+		const struct x11_key_event *e = &events[i];
+		repeats[i] = 1;
+
+		if (!e->key_down && (i + 1 < count) && events[i + 1].key_down
+			&& (events[i + 1].keycode == e->keycode) && (events[i + 1].time == e->time)) {
+			repeats[i] = 0; // synthetic KeyRelease
+			continue;
+		}
+
+		if (e->key_down && (run != none) && (events[run].keycode == e->keycode) && (events[run].state == e->state)) {
+			repeats[run]++;
+			repeats[i] = 0;
+			continue;
+		}
+
+		run = e->key_down ? i : none;
+	}
+}
+
+// This function splits run of repeats found by x11_fold_autorepeat() back into separate
+// key down events, for when repeats can give different text than KeyPress they are folded into
+// (it is a part of Dead key or Compose key sequence).
+// input:
+//   events - key events x11_fold_autorepeat() was called for
+//   count - number of key events
+//   run - index of KeyPress repeats are folded into
+// outout:
+//   repeats - 1 for KeyPress and each of its repeats; dropped KeyRelease events stay dropped
+static void x11_unfold_autorepeat(const struct x11_key_event *events, size_t count, size_t run, unsigned int *repeats)
+{
+	// Folded presses of later runs come after KeyPress of that run, so first ones are ours
+	unsigned int left = repeats[run] - 1;
+	repeats[run] = 1;
+	for (size_t i = run + 1; i < count && left; i++) {
+		if (events[i].key_down && !repeats[i]) {
+			repeats[i] = 1;
+			left--;
+		}
+	}
+}
+
+#endif // X11_TRANSLATOR_C
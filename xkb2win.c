@@ -1,7 +1,13 @@
 // https://github.com/unxed/xkb2win
 // License: CC0-1.0 license
 
-#include <ctype.h>
+#ifndef XKB2WIN_C
+#define XKB2WIN_C
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <xkbcommon/xkbcommon.h>
 
 // Auxiliary constants and functions necessary for the implementation
@@ -35,136 +41,493 @@
 // https://chromium.googlesource.com/chromium/src/+/refs/heads/main/ui/events/keycodes/keyboard_code_conversion_x.cc
 // https://chromium.googlesource.com/chromium/src/+/refs/heads/main/ui/events/keycodes/dom/dom_code_data.inc
 
+// Result of XKB KeySym translation: values needed for win32-like terminal input protocols.
+struct winkey {
+	unsigned char vk;       // wVirtualKeyCode value
+	unsigned char scan;     // wVirtualScanCode value
+	unsigned char enhanced; // Boolean ENHANCED_KEY flag state
+};
+
+#define XKB2WIN_NONE_16 \
+	{0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, \
+	{0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 0}
+
+// Translation table for the two KeySym blocks that have Windows equivalents.
+// Row is selected by high byte of KeySym, column by low byte.
+// Row 0 is used for all KeySyms outside of these blocks and contains zeroes only.
+// Lower case Latin letters have the same entries as upper case ones.
+static const struct winkey xkb2win_table[3][256] = {
+	{ // all other KeySyms
+		XKB2WIN_NONE_16, XKB2WIN_NONE_16, XKB2WIN_NONE_16, XKB2WIN_NONE_16,
+		XKB2WIN_NONE_16, XKB2WIN_NONE_16, XKB2WIN_NONE_16, XKB2WIN_NONE_16,
+		XKB2WIN_NONE_16, XKB2WIN_NONE_16, XKB2WIN_NONE_16, XKB2WIN_NONE_16,
+		XKB2WIN_NONE_16, XKB2WIN_NONE_16, XKB2WIN_NONE_16, XKB2WIN_NONE_16,
+	},
+	{ // 0x0000 - 0x00FF: Latin-1 block
+		XKB2WIN_NONE_16, // 0x0000 - 0x000F
+		XKB2WIN_NONE_16, // 0x0010 - 0x001F
+		{ 32,  57,   0}, // 0x0020 XKB_KEY_space          VK_SPACE
+		{  0,   0,   0}, // 0x0021
+		{  0,   0,   0}, // 0x0022
+		{  0,   0,   0}, // 0x0023
+		{  0,   0,   0}, // 0x0024
+		{  0,   0,   0}, // 0x0025
+		{  0,   0,   0}, // 0x0026
+		{222,  40,   0}, // 0x0027 XKB_KEY_apostrophe     VK_OEM_7
+		{  0,   0,   0}, // 0x0028
+		{  0,   0,   0}, // 0x0029
+		{  0,   0,   0}, // 0x002A
+		{  0,   0,   0}, // 0x002B
+		{188,  51,   0}, // 0x002C XKB_KEY_comma          VK_OEM_COMMA
+		{189,  12,   0}, // 0x002D XKB_KEY_minus          VK_OEM_MINUS
+		{190,  52,   0}, // 0x002E XKB_KEY_period         VK_OEM_PERIOD
+		{191,  53,   0}, // 0x002F XKB_KEY_slash          VK_OEM_2
+		{ 48,  11,   0}, // 0x0030 XKB_KEY_0              0
+		{ 49,   2,   0}, // 0x0031 XKB_KEY_1              1
+		{ 50,   3,   0}, // 0x0032 XKB_KEY_2              2
+		{ 51,   4,   0}, // 0x0033 XKB_KEY_3              3
+		{ 52,   5,   0}, // 0x0034 XKB_KEY_4              4
+		{ 53,   6,   0}, // 0x0035 XKB_KEY_5              5
+		{ 54,   7,   0}, // 0x0036 XKB_KEY_6              6
+		{ 55,   8,   0}, // 0x0037 XKB_KEY_7              7
+		{ 56,   9,   0}, // 0x0038 XKB_KEY_8              8
+		{ 57,  10,   0}, // 0x0039 XKB_KEY_9              9
+		{  0,   0,   0}, // 0x003A
+		{186,  39,   0}, // 0x003B XKB_KEY_semicolon      VK_OEM_1
+		{  0,   0,   0}, // 0x003C
+		{187,  13,   0}, // 0x003D XKB_KEY_equal          VK_OEM_PLUS
+		{  0,   0,   0}, // 0x003E
+		{  0,   0,   0}, // 0x003F
+		{  0,   0,   0}, // 0x0040
+		{ 65,  30,   0}, // 0x0041 XKB_KEY_A              A
+		{ 66,  48,   0}, // 0x0042 XKB_KEY_B              B
+		{ 67,  46,   0}, // 0x0043 XKB_KEY_C              C
+		{ 68,  32,   0}, // 0x0044 XKB_KEY_D              D
+		{ 69,  18,   0}, // 0x0045 XKB_KEY_E              E
+		{ 70,  33,   0}, // 0x0046 XKB_KEY_F              F
+		{ 71,  34,   0}, // 0x0047 XKB_KEY_G              G
+		{ 72,  35,   0}, // 0x0048 XKB_KEY_H              H
+		{ 73,  23,   0}, // 0x0049 XKB_KEY_I              I
+		{ 74,  36,   0}, // 0x004A XKB_KEY_J              J
+		{ 75,  37,   0}, // 0x004B XKB_KEY_K              K
+		{ 76,  38,   0}, // 0x004C XKB_KEY_L              L
+		{ 77,  50,   0}, // 0x004D XKB_KEY_M              M
+		{ 78,  49,   0}, // 0x004E XKB_KEY_N              N
+		{ 79,  24,   0}, // 0x004F XKB_KEY_O              O
+		{ 80,  25,   0}, // 0x0050 XKB_KEY_P              P
+		{ 81,  16,   0}, // 0x0051 XKB_KEY_Q              Q
+		{ 82,  19,   0}, // 0x0052 XKB_KEY_R              R
+		{ 83,  31,   0}, // 0x0053 XKB_KEY_S              S
+		{ 84,  20,   0}, // 0x0054 XKB_KEY_T              T
+		{ 85,  22,   0}, // 0x0055 XKB_KEY_U              U
+		{ 86,  47,   0}, // 0x0056 XKB_KEY_V              V
+		{ 87,  17,   0}, // 0x0057 XKB_KEY_W              W
+		{ 88,  45,   0}, // 0x0058 XKB_KEY_X              X
+		{ 89,  21,   0}, // 0x0059 XKB_KEY_Y              Y
+		{ 90,  44,   0}, // 0x005A XKB_KEY_Z              Z
+		{219,  26,   0}, // 0x005B XKB_KEY_bracketleft    VK_OEM_4
+		{220,  43,   0}, // 0x005C XKB_KEY_backslash      VK_OEM_5
+		{221,  27,   0}, // 0x005D XKB_KEY_bracketright   VK_OEM_6
+		{  0,   0,   0}, // 0x005E
+		{  0,   0,   0}, // 0x005F
+		{192,  41,   0}, // 0x0060 XKB_KEY_grave          VK_OEM_3
+		{ 65,  30,   0}, // 0x0061 XKB_KEY_a              A
+		{ 66,  48,   0}, // 0x0062 XKB_KEY_b              B
+		{ 67,  46,   0}, // 0x0063 XKB_KEY_c              C
+		{ 68,  32,   0}, // 0x0064 XKB_KEY_d              D
+		{ 69,  18,   0}, // 0x0065 XKB_KEY_e              E
+		{ 70,  33,   0}, // 0x0066 XKB_KEY_f              F
+		{ 71,  34,   0}, // 0x0067 XKB_KEY_g              G
+		{ 72,  35,   0}, // 0x0068 XKB_KEY_h              H
+		{ 73,  23,   0}, // 0x0069 XKB_KEY_i              I
+		{ 74,  36,   0}, // 0x006A XKB_KEY_j              J
+		{ 75,  37,   0}, // 0x006B XKB_KEY_k              K
+		{ 76,  38,   0}, // 0x006C XKB_KEY_l              L
+		{ 77,  50,   0}, // 0x006D XKB_KEY_m              M
+		{ 78,  49,   0}, // 0x006E XKB_KEY_n              N
+		{ 79,  24,   0}, // 0x006F XKB_KEY_o              O
+		{ 80,  25,   0}, // 0x0070 XKB_KEY_p              P
+		{ 81,  16,   0}, // 0x0071 XKB_KEY_q              Q
+		{ 82,  19,   0}, // 0x0072 XKB_KEY_r              R
+		{ 83,  31,   0}, // 0x0073 XKB_KEY_s              S
+		{ 84,  20,   0}, // 0x0074 XKB_KEY_t              T
+		{ 85,  22,   0}, // 0x0075 XKB_KEY_u              U
+		{ 86,  47,   0}, // 0x0076 XKB_KEY_v              V
+		{ 87,  17,   0}, // 0x0077 XKB_KEY_w              W
+		{ 88,  45,   0}, // 0x0078 XKB_KEY_x              X
+		{ 89,  21,   0}, // 0x0079 XKB_KEY_y              Y
+		{ 90,  44,   0}, // 0x007A XKB_KEY_z              Z
+		{  0,   0,   0}, // 0x007B
+		{  0,   0,   0}, // 0x007C
+		{  0,   0,   0}, // 0x007D
+		{  0,   0,   0}, // 0x007E
+		{  0,   0,   0}, // 0x007F
+		XKB2WIN_NONE_16, // 0x0080 - 0x008F
+		XKB2WIN_NONE_16, // 0x0090 - 0x009F
+		XKB2WIN_NONE_16, // 0x00A0 - 0x00AF
+		XKB2WIN_NONE_16, // 0x00B0 - 0x00BF
+		XKB2WIN_NONE_16, // 0x00C0 - 0x00CF
+		XKB2WIN_NONE_16, // 0x00D0 - 0x00DF
+		XKB2WIN_NONE_16, // 0x00E0 - 0x00EF
+		XKB2WIN_NONE_16, // 0x00F0 - 0x00FF
+	},
+	{ // 0xFF00 - 0xFFFF: function keys block
+		{  0,   0,   0}, // 0xFF00
+		{  0,   0,   0}, // 0xFF01
+		{  0,   0,   0}, // 0xFF02
+		{  0,   0,   0}, // 0xFF03
+		{  0,   0,   0}, // 0xFF04
+		{  0,   0,   0}, // 0xFF05
+		{  0,   0,   0}, // 0xFF06
+		{  0,   0,   0}, // 0xFF07
+		{  8,  14,   0}, // 0xFF08 XKB_KEY_BackSpace      VK_BACK
+		{  9,  15,   0}, // 0xFF09 XKB_KEY_Tab            VK_TAB
+		{  0,   0,   0}, // 0xFF0A
+		{  0,   0,   0}, // 0xFF0B
+		{  0,   0,   0}, // 0xFF0C
+		{ 13,  28,   0}, // 0xFF0D XKB_KEY_Return         VK_RETURN
+		{  0,   0,   0}, // 0xFF0E
+		{  0,   0,   0}, // 0xFF0F
+		{  0,   0,   0}, // 0xFF10
+		{  0,   0,   0}, // 0xFF11
+		{  0,   0,   0}, // 0xFF12
+		{  0,   0,   0}, // 0xFF13
+		{  0,   0,   0}, // 0xFF14
+		{  0,   0,   0}, // 0xFF15
+		{  0,   0,   0}, // 0xFF16
+		{  0,   0,   0}, // 0xFF17
+		{  0,   0,   0}, // 0xFF18
+		{  0,   0,   0}, // 0xFF19
+		{  0,   0,   0}, // 0xFF1A
+		{ 27,   1,   0}, // 0xFF1B XKB_KEY_Escape         VK_ESCAPE
+		{  0,   0,   0}, // 0xFF1C
+		{  0,   0,   0}, // 0xFF1D
+		{  0,   0,   0}, // 0xFF1E
+		{  0,   0,   0}, // 0xFF1F
+		XKB2WIN_NONE_16, // 0xFF20 - 0xFF2F
+		XKB2WIN_NONE_16, // 0xFF30 - 0xFF3F
+		XKB2WIN_NONE_16, // 0xFF40 - 0xFF4F
+		{ 36,  71,   1}, // 0xFF50 XKB_KEY_Home           VK_HOME
+		{ 37,  75,   1}, // 0xFF51 XKB_KEY_Left           VK_LEFT
+		{ 38,  72,   1}, // 0xFF52 XKB_KEY_Up             VK_UP
+		{ 39,  77,   1}, // 0xFF53 XKB_KEY_Right          VK_RIGHT
+		{ 40,  80,   1}, // 0xFF54 XKB_KEY_Down           VK_DOWN
+		{ 33,  73,   1}, // 0xFF55 XKB_KEY_Page_Up        VK_PRIOR
+		{ 34,  81,   1}, // 0xFF56 XKB_KEY_Page_Down      VK_NEXT
+		{ 35,  79,   1}, // 0xFF57 XKB_KEY_End            VK_END
+		{  0,   0,   0}, // 0xFF58
+		{  0,   0,   0}, // 0xFF59
+		{  0,   0,   0}, // 0xFF5A
+		{  0,   0,   0}, // 0xFF5B
+		{  0,   0,   0}, // 0xFF5C
+		{  0,   0,   0}, // 0xFF5D
+		{  0,   0,   0}, // 0xFF5E
+		{  0,   0,   0}, // 0xFF5F
+		{  0,   0,   0}, // 0xFF60
+		{ 44,  55,   1}, // 0xFF61 XKB_KEY_Print          VK_SNAPSHOT
+		{  0,   0,   0}, // 0xFF62
+		{ 45,  82,   1}, // 0xFF63 XKB_KEY_Insert         VK_INSERT
+		{  0,   0,   0}, // 0xFF64
+		{  0,   0,   0}, // 0xFF65
+		{  0,   0,   0}, // 0xFF66
+		{ 93,  93,   1}, // 0xFF67 XKB_KEY_Menu           VK_APPS
+		{  0,   0,   0}, // 0xFF68
+		{  0,   0,   0}, // 0xFF69
+		{  0,   0,   0}, // 0xFF6A
+		{  0,   0,   0}, // 0xFF6B
+		{  0,   0,   0}, // 0xFF6C
+		{  0,   0,   0}, // 0xFF6D
+		{  0,   0,   0}, // 0xFF6E
+		{  0,   0,   0}, // 0xFF6F
+		{  0,   0,   0}, // 0xFF70
+		{  0,   0,   0}, // 0xFF71
+		{  0,   0,   0}, // 0xFF72
+		{  0,   0,   0}, // 0xFF73
+		{  0,   0,   0}, // 0xFF74
+		{  0,   0,   0}, // 0xFF75
+		{  0,   0,   0}, // 0xFF76
+		{  0,   0,   0}, // 0xFF77
+		{  0,   0,   0}, // 0xFF78
+		{  0,   0,   0}, // 0xFF79
+		{  0,   0,   0}, // 0xFF7A
+		{  0,   0,   0}, // 0xFF7B
+		{  0,   0,   0}, // 0xFF7C
+		{  0,   0,   0}, // 0xFF7D
+		{  0,   0,   0}, // 0xFF7E
+		{144,  69,   1}, // 0xFF7F XKB_KEY_Num_Lock       VK_NUMLOCK
+		{  0,   0,   0}, // 0xFF80
+		{  0,   0,   0}, // 0xFF81
+		{  0,   0,   0}, // 0xFF82
+		{  0,   0,   0}, // 0xFF83
+		{  0,   0,   0}, // 0xFF84
+		{  0,   0,   0}, // 0xFF85
+		{  0,   0,   0}, // 0xFF86
+		{  0,   0,   0}, // 0xFF87
+		{  0,   0,   0}, // 0xFF88
+		{  0,   0,   0}, // 0xFF89
+		{  0,   0,   0}, // 0xFF8A
+		{  0,   0,   0}, // 0xFF8B
+		{  0,   0,   0}, // 0xFF8C
+		{ 13,  28,   1}, // 0xFF8D XKB_KEY_KP_Enter       VK_RETURN
+		{  0,   0,   0}, // 0xFF8E
+		{  0,   0,   0}, // 0xFF8F
+		{  0,   0,   0}, // 0xFF90
+		{  0,   0,   0}, // 0xFF91
+		{  0,   0,   0}, // 0xFF92
+		{  0,   0,   0}, // 0xFF93
+		{  0,   0,   0}, // 0xFF94
+		{ 36,  71,   0}, // 0xFF95 XKB_KEY_KP_Home        VK_HOME
+		{ 37,  75,   0}, // 0xFF96 XKB_KEY_KP_Left        VK_LEFT
+		{ 38,  72,   0}, // 0xFF97 XKB_KEY_KP_Up          VK_UP
+		{ 39,  77,   0}, // 0xFF98 XKB_KEY_KP_Right       VK_RIGHT
+		{ 40,  80,   0}, // 0xFF99 XKB_KEY_KP_Down        VK_DOWN
+		{ 33,  73,   0}, // 0xFF9A XKB_KEY_KP_Page_Up     VK_PRIOR
+		{ 34,  81,   0}, // 0xFF9B XKB_KEY_KP_Page_Down   VK_NEXT
+		{ 35,  79,   0}, // 0xFF9C XKB_KEY_KP_End         VK_END
+		{ 12,  76,   0}, // 0xFF9D XKB_KEY_KP_Begin       VK_CLEAR
+		{ 45,  82,   0}, // 0xFF9E XKB_KEY_KP_Insert      VK_INSERT
+		{ 46,  83,   0}, // 0xFF9F XKB_KEY_KP_Delete      VK_DELETE
+		{  0,   0,   0}, // 0xFFA0
+		{  0,   0,   0}, // 0xFFA1
+		{  0,   0,   0}, // 0xFFA2
+		{  0,   0,   0}, // 0xFFA3
+		{  0,   0,   0}, // 0xFFA4
+		{  0,   0,   0}, // 0xFFA5
+		{  0,   0,   0}, // 0xFFA6
+		{  0,   0,   0}, // 0xFFA7
+		{  0,   0,   0}, // 0xFFA8
+		{  0,   0,   0}, // 0xFFA9
+		{106,  55,   0}, // 0xFFAA XKB_KEY_KP_Multiply    VK_MULTIPLY
+		{107,  78,   0}, // 0xFFAB XKB_KEY_KP_Add         VK_ADD
+		{  0,   0,   0}, // 0xFFAC
+		{109,  74,   0}, // 0xFFAD XKB_KEY_KP_Subtract    VK_SUBTRACT
+		{110,  83,   0}, // 0xFFAE XKB_KEY_KP_Decimal     VK_DECIMAL
+		{111,  53,   1}, // 0xFFAF XKB_KEY_KP_Divide      VK_DIVIDE
+		{ 96,  82,   0}, // 0xFFB0 XKB_KEY_KP_0           VK_NUMPAD0
+		{ 97,  79,   0}, // 0xFFB1 XKB_KEY_KP_1           VK_NUMPAD1
+		{ 98,  80,   0}, // 0xFFB2 XKB_KEY_KP_2           VK_NUMPAD2
+		{ 99,  81,   0}, // 0xFFB3 XKB_KEY_KP_3           VK_NUMPAD3
+		{100,  75,   0}, // 0xFFB4 XKB_KEY_KP_4           VK_NUMPAD4
+		{101,  76,   0}, // 0xFFB5 XKB_KEY_KP_5           VK_NUMPAD5
+		{102,  77,   0}, // 0xFFB6 XKB_KEY_KP_6           VK_NUMPAD6
+		{103,  71,   0}, // 0xFFB7 XKB_KEY_KP_7           VK_NUMPAD7
+		{104,  72,   0}, // 0xFFB8 XKB_KEY_KP_8           VK_NUMPAD8
+		{105,  73,   0}, // 0xFFB9 XKB_KEY_KP_9           VK_NUMPAD9
+		{  0,   0,   0}, // 0xFFBA
+		{  0,   0,   0}, // 0xFFBB
+		{  0,   0,   0}, // 0xFFBC
+		{  0,   0,   0}, // 0xFFBD
+		{112,  59,   0}, // 0xFFBE XKB_KEY_F1             VK_F1
+		{113,  60,   0}, // 0xFFBF XKB_KEY_F2             VK_F2
+		{114,  61,   0}, // 0xFFC0 XKB_KEY_F3             VK_F3
+		{115,  62,   0}, // 0xFFC1 XKB_KEY_F4             VK_F4
+		{116,  63,   0}, // 0xFFC2 XKB_KEY_F5             VK_F5
+		{117,  64,   0}, // 0xFFC3 XKB_KEY_F6             VK_F6
+		{118,  65,   0}, // 0xFFC4 XKB_KEY_F7             VK_F7
+		{119,  66,   0}, // 0xFFC5 XKB_KEY_F8             VK_F8
+		{120,  67,   0}, // 0xFFC6 XKB_KEY_F9             VK_F9
+		{121,  68,   0}, // 0xFFC7 XKB_KEY_F10            VK_F10
+		{122,  87,   0}, // 0xFFC8 XKB_KEY_F11            VK_F11
+		{123,  88,   0}, // 0xFFC9 XKB_KEY_F12            VK_F12
+		{  0,   0,   0}, // 0xFFCA
+		{  0,   0,   0}, // 0xFFCB
+		{  0,   0,   0}, // 0xFFCC
+		{  0,   0,   0}, // 0xFFCD
+		{  0,   0,   0}, // 0xFFCE
+		{  0,   0,   0}, // 0xFFCF
+		XKB2WIN_NONE_16, // 0xFFD0 - 0xFFDF
+		{  0,   0,   0}, // 0xFFE0
+		{ 16,  42,   0}, // 0xFFE1 XKB_KEY_Shift_L        VK_SHIFT
+		{ 16,  54,   0}, // 0xFFE2 XKB_KEY_Shift_R        VK_SHIFT
+		{ 17,  29,   0}, // 0xFFE3 XKB_KEY_Control_L      VK_CONTROL
+		{ 17,  29,   1}, // 0xFFE4 XKB_KEY_Control_R      VK_CONTROL
+		{ 20,  58,   0}, // 0xFFE5 XKB_KEY_Caps_Lock      VK_CAPITAL
+		{  0,   0,   0}, // 0xFFE6
+		{  0,   0,   0}, // 0xFFE7
+		{  0,   0,   0}, // 0xFFE8
+		{ 18,  56,   0}, // 0xFFE9 XKB_KEY_Alt_L          VK_MENU
+		{ 18,  56,   1}, // 0xFFEA XKB_KEY_Alt_R          VK_MENU
+		{ 91,  91,   1}, // 0xFFEB XKB_KEY_Super_L        VK_LWIN
+		{ 92,  92,   1}, // 0xFFEC XKB_KEY_Super_R        VK_RWIN
+		{  0,   0,   0}, // 0xFFED
+		{  0,   0,   0}, // 0xFFEE
+		{  0,   0,   0}, // 0xFFEF
+		{  0,   0,   0}, // 0xFFF0
+		{  0,   0,   0}, // 0xFFF1
+		{  0,   0,   0}, // 0xFFF2
+		{  0,   0,   0}, // 0xFFF3
+		{  0,   0,   0}, // 0xFFF4
+		{  0,   0,   0}, // 0xFFF5
+		{  0,   0,   0}, // 0xFFF6
+		{  0,   0,   0}, // 0xFFF7
+		{  0,   0,   0}, // 0xFFF8
+		{  0,   0,   0}, // 0xFFF9
+		{  0,   0,   0}, // 0xFFFA
+		{  0,   0,   0}, // 0xFFFB
+		{  0,   0,   0}, // 0xFFFC
+		{  0,   0,   0}, // 0xFFFD
+		{  0,   0,   0}, // 0xFFFE
+		{ 46,  83,   1}, // 0xFFFF XKB_KEY_Delete         VK_DELETE
+	},
+};
+
+#undef XKB2WIN_NONE_16
+
 // This function translates XKB KeySym value (as defined /usr/include/X11/keysymdef.h)
-// to array containing three values needed for win32-like terminal input protocols:
+// to structure containing three values needed for win32-like terminal input protocols:
 // 1. wVirtualKeyCode value
 // 2. wVirtualScanCode value
 // 3. Boolean ENHANCED_KEY flag state
 // Boolean ENHANCED_KEY flag state should be applied to dwControlKeyState field as follows:
 // dwControlKeyState |= (enhanced_flag_state ? ENHANCED_KEY : 0);
-static unsigned char *xkb_to_winkey(int code)
+// Unknown KeySyms are translated to all zeroes.
+// Lookup is a single read from constant table, so function is reentrant and has no branches.
+static inline struct winkey xkb_to_winkey(int code)
 {
-	if ((code < 128) && isalpha(code)) { code = toupper(code); }
-
-	switch (code) {
-
-		case XKB_KEY_BackSpace:    { static unsigned char arr[3] = {  8,  14,   0}; return arr; } // VK_BACK
-		case XKB_KEY_Tab:          { static unsigned char arr[3] = {  9,  15,   0}; return arr; } // VK_TAB
-		case XKB_KEY_KP_Begin:     { static unsigned char arr[3] = { 12,  76,   0}; return arr; } // VK_CLEAR
-		case XKB_KEY_Return:       { static unsigned char arr[3] = { 13,  28,   0}; return arr; } // VK_RETURN
-		case XKB_KEY_KP_Enter:     { static unsigned char arr[3] = { 13,  28,   1}; return arr; } // VK_RETURN
-		case XKB_KEY_Shift_L:      { static unsigned char arr[3] = { 16,  42,   0}; return arr; } // VK_SHIFT
-		case XKB_KEY_Shift_R:      { static unsigned char arr[3] = { 16,  54,   0}; return arr; } // VK_SHIFT
-		case XKB_KEY_Control_L:    { static unsigned char arr[3] = { 17,  29,   0}; return arr; } // VK_CONTROL
-		case XKB_KEY_Control_R:    { static unsigned char arr[3] = { 17,  29,   1}; return arr; } // VK_CONTROL
-		case XKB_KEY_Alt_L:        { static unsigned char arr[3] = { 18,  56,   0}; return arr; } // VK_MENU
-		case XKB_KEY_Alt_R:        { static unsigned char arr[3] = { 18,  56,   1}; return arr; } // VK_MENU
-		case XKB_KEY_Caps_Lock:    { static unsigned char arr[3] = { 20,  58,   0}; return arr; } // VK_CAPITAL
-		case XKB_KEY_Escape:       { static unsigned char arr[3] = { 27,   1,   0}; return arr; } // VK_ESCAPE
-		case XKB_KEY_space:        { static unsigned char arr[3] = { 32,  57,   0}; return arr; } // VK_SPACE
-		case XKB_KEY_Page_Up:      { static unsigned char arr[3] = { 33,  73,   1}; return arr; } // VK_PRIOR
-		case XKB_KEY_KP_Page_Up:   { static unsigned char arr[3] = { 33,  73,   0}; return arr; } // VK_PRIOR
-		case XKB_KEY_Page_Down:    { static unsigned char arr[3] = { 34,  81,   1}; return arr; } // VK_NEXT
-		case XKB_KEY_KP_Page_Down: { static unsigned char arr[3] = { 34,  81,   0}; return arr; } // VK_NEXT
-		case XKB_KEY_End:          { static unsigned char arr[3] = { 35,  79,   1}; return arr; } // VK_END
-		case XKB_KEY_KP_End:       { static unsigned char arr[3] = { 35,  79,   0}; return arr; } // VK_END
-		case XKB_KEY_Home:         { static unsigned char arr[3] = { 36,  71,   1}; return arr; } // VK_HOME
-		case XKB_KEY_KP_Home:      { static unsigned char arr[3] = { 36,  71,   0}; return arr; } // VK_HOME
-		case XKB_KEY_Left:         { static unsigned char arr[3] = { 37,  75,   1}; return arr; } // VK_LEFT
-		case XKB_KEY_KP_Left:      { static unsigned char arr[3] = { 37,  75,   0}; return arr; } // VK_LEFT
-		case XKB_KEY_Up:           { static unsigned char arr[3] = { 38,  72,   1}; return arr; } // VK_UP
-		case XKB_KEY_KP_Up:        { static unsigned char arr[3] = { 38,  72,   0}; return arr; } // VK_UP
-		case XKB_KEY_Right:        { static unsigned char arr[3] = { 39,  77,   1}; return arr; } // VK_RIGHT
-		case XKB_KEY_KP_Right:     { static unsigned char arr[3] = { 39,  77,   0}; return arr; } // VK_RIGHT
-		case XKB_KEY_Down:         { static unsigned char arr[3] = { 40,  80,   1}; return arr; } // VK_DOWN
-		case XKB_KEY_KP_Down:      { static unsigned char arr[3] = { 40,  80,   0}; return arr; } // VK_DOWN
-		case XKB_KEY_Print:        { static unsigned char arr[3] = { 44,  55,   1}; return arr; } // VK_SNAPSHOT
-		case XKB_KEY_Insert:       { static unsigned char arr[3] = { 45,  82,   1}; return arr; } // VK_INSERT
-		case XKB_KEY_KP_Insert:    { static unsigned char arr[3] = { 45,  82,   0}; return arr; } // VK_INSERT
-		case XKB_KEY_Delete:       { static unsigned char arr[3] = { 46,  83,   1}; return arr; } // VK_DELETE
-		case XKB_KEY_KP_Delete:    { static unsigned char arr[3] = { 46,  83,   0}; return arr; } // VK_DELETE
-		case XKB_KEY_0:            { static unsigned char arr[3] = { 48,  11,   0}; return arr; } // 0
-		case XKB_KEY_1:            { static unsigned char arr[3] = { 49,   2,   0}; return arr; } // 1
-		case XKB_KEY_2:            { static unsigned char arr[3] = { 50,   3,   0}; return arr; } // 2
-		case XKB_KEY_3:            { static unsigned char arr[3] = { 51,   4,   0}; return arr; } // 3
-		case XKB_KEY_4:            { static unsigned char arr[3] = { 52,   5,   0}; return arr; } // 4
-		case XKB_KEY_5:            { static unsigned char arr[3] = { 53,   6,   0}; return arr; } // 5
-		case XKB_KEY_6:            { static unsigned char arr[3] = { 54,   7,   0}; return arr; } // 6
-		case XKB_KEY_7:            { static unsigned char arr[3] = { 55,   8,   0}; return arr; } // 7
-		case XKB_KEY_8:            { static unsigned char arr[3] = { 56,   9,   0}; return arr; } // 8
-		case XKB_KEY_9:            { static unsigned char arr[3] = { 57,  10,   0}; return arr; } // 9
-		case XKB_KEY_A:            { static unsigned char arr[3] = { 65,  30,   0}; return arr; } // A
-		case XKB_KEY_B:            { static unsigned char arr[3] = { 66,  48,   0}; return arr; } // B
-		case XKB_KEY_C:            { static unsigned char arr[3] = { 67,  46,   0}; return arr; } // C
-		case XKB_KEY_D:            { static unsigned char arr[3] = { 68,  32,   0}; return arr; } // D
-		case XKB_KEY_E:            { static unsigned char arr[3] = { 69,  18,   0}; return arr; } // E
-		case XKB_KEY_F:            { static unsigned char arr[3] = { 70,  33,   0}; return arr; } // F
-		case XKB_KEY_G:            { static unsigned char arr[3] = { 71,  34,   0}; return arr; } // G
-		case XKB_KEY_H:            { static unsigned char arr[3] = { 72,  35,   0}; return arr; } // H
-		case XKB_KEY_I:            { static unsigned char arr[3] = { 73,  23,   0}; return arr; } // I
-		case XKB_KEY_J:            { static unsigned char arr[3] = { 74,  36,   0}; return arr; } // J
-		case XKB_KEY_K:            { static unsigned char arr[3] = { 75,  37,   0}; return arr; } // K
-		case XKB_KEY_L:            { static unsigned char arr[3] = { 76,  38,   0}; return arr; } // L
-		case XKB_KEY_M:            { static unsigned char arr[3] = { 77,  50,   0}; return arr; } // M
-		case XKB_KEY_N:            { static unsigned char arr[3] = { 78,  49,   0}; return arr; } // N
-		case XKB_KEY_O:            { static unsigned char arr[3] = { 79,  24,   0}; return arr; } // O
-		case XKB_KEY_P:            { static unsigned char arr[3] = { 80,  25,   0}; return arr; } // P
-		case XKB_KEY_Q:            { static unsigned char arr[3] = { 81,  16,   0}; return arr; } // Q
-		case XKB_KEY_R:            { static unsigned char arr[3] = { 82,  19,   0}; return arr; } // R
-		case XKB_KEY_S:            { static unsigned char arr[3] = { 83,  31,   0}; return arr; } // S
-		case XKB_KEY_T:            { static unsigned char arr[3] = { 84,  20,   0}; return arr; } // T
-		case XKB_KEY_U:            { static unsigned char arr[3] = { 85,  22,   0}; return arr; } // U
-		case XKB_KEY_V:            { static unsigned char arr[3] = { 86,  47,   0}; return arr; } // V
-		case XKB_KEY_W:            { static unsigned char arr[3] = { 87,  17,   0}; return arr; } // W
-		case XKB_KEY_X:            { static unsigned char arr[3] = { 88,  45,   0}; return arr; } // X
-		case XKB_KEY_Y:            { static unsigned char arr[3] = { 89,  21,   0}; return arr; } // Y
-		case XKB_KEY_Z:            { static unsigned char arr[3] = { 90,  44,   0}; return arr; } // Z
-		case XKB_KEY_Super_L:      { static unsigned char arr[3] = { 91,  91,   1}; return arr; } // VK_LWIN
-		case XKB_KEY_Super_R:      { static unsigned char arr[3] = { 92,  92,   1}; return arr; } // VK_RWIN
-		case XKB_KEY_Menu:         { static unsigned char arr[3] = { 93,  93,   1}; return arr; } // VK_APPS
-		case XKB_KEY_KP_0:         { static unsigned char arr[3] = { 96,  82,   0}; return arr; } // VK_NUMPAD0
-		case XKB_KEY_KP_1:         { static unsigned char arr[3] = { 97,  79,   0}; return arr; } // VK_NUMPAD1
-		case XKB_KEY_KP_2:         { static unsigned char arr[3] = { 98,  80,   0}; return arr; } // VK_NUMPAD2
-		case XKB_KEY_KP_3:         { static unsigned char arr[3] = { 99,  81,   0}; return arr; } // VK_NUMPAD3
-		case XKB_KEY_KP_4:         { static unsigned char arr[3] = {100,  75,   0}; return arr; } // VK_NUMPAD4
-		case XKB_KEY_KP_5:         { static unsigned char arr[3] = {101,  76,   0}; return arr; } // VK_NUMPAD5
-		case XKB_KEY_KP_6:         { static unsigned char arr[3] = {102,  77,   0}; return arr; } // VK_NUMPAD6
-		case XKB_KEY_KP_7:         { static unsigned char arr[3] = {103,  71,   0}; return arr; } // VK_NUMPAD7
-		case XKB_KEY_KP_8:         { static unsigned char arr[3] = {104,  72,   0}; return arr; } // VK_NUMPAD8
-		case XKB_KEY_KP_9:         { static unsigned char arr[3] = {105,  73,   0}; return arr; } // VK_NUMPAD9
-		case XKB_KEY_KP_Multiply:  { static unsigned char arr[3] = {106,  55,   0}; return arr; } // VK_MULTIPLY
-		case XKB_KEY_KP_Add:       { static unsigned char arr[3] = {107,  78,   0}; return arr; } // VK_ADD
-		case XKB_KEY_KP_Subtract:  { static unsigned char arr[3] = {109,  74,   0}; return arr; } // VK_SUBTRACT
-		case XKB_KEY_KP_Decimal:   { static unsigned char arr[3] = {110,  83,   0}; return arr; } // VK_DECIMAL
-		case XKB_KEY_KP_Divide:    { static unsigned char arr[3] = {111,  53,   1}; return arr; } // VK_DIVIDE
-		case XKB_KEY_F1:           { static unsigned char arr[3] = {112,  59,   0}; return arr; } // VK_F1
-		case XKB_KEY_F2:           { static unsigned char arr[3] = {113,  60,   0}; return arr; } // VK_F2
-		case XKB_KEY_F3:           { static unsigned char arr[3] = {114,  61,   0}; return arr; } // VK_F3
-		case XKB_KEY_F4:           { static unsigned char arr[3] = {115,  62,   0}; return arr; } // VK_F4
-		case XKB_KEY_F5:           { static unsigned char arr[3] = {116,  63,   0}; return arr; } // VK_F5
-		case XKB_KEY_F6:           { static unsigned char arr[3] = {117,  64,   0}; return arr; } // VK_F6
-		case XKB_KEY_F7:           { static unsigned char arr[3] = {118,  65,   0}; return arr; } // VK_F7
-		case XKB_KEY_F8:           { static unsigned char arr[3] = {119,  66,   0}; return arr; } // VK_F8
-		case XKB_KEY_F9:           { static unsigned char arr[3] = {120,  67,   0}; return arr; } // VK_F9
-		case XKB_KEY_F10:          { static unsigned char arr[3] = {121,  68,   0}; return arr; } // VK_F10
-		case XKB_KEY_F11:          { static unsigned char arr[3] = {122,  87,   0}; return arr; } // VK_F11
-		case XKB_KEY_F12:          { static unsigned char arr[3] = {123,  88,   0}; return arr; } // VK_F12
-		case XKB_KEY_Num_Lock:     { static unsigned char arr[3] = {144,  69,   1}; return arr; } // VK_NUMLOCK
-		case XKB_KEY_semicolon:    { static unsigned char arr[3] = {186,  39,   0}; return arr; } // VK_OEM_1
-		case XKB_KEY_equal:        { static unsigned char arr[3] = {187,  13,   0}; return arr; } // VK_OEM_PLUS
-		case XKB_KEY_comma:        { static unsigned char arr[3] = {188,  51,   0}; return arr; } // VK_OEM_COMMA
-		case XKB_KEY_minus:        { static unsigned char arr[3] = {189,  12,   0}; return arr; } // VK_OEM_MINUS
-		case XKB_KEY_period:       { static unsigned char arr[3] = {190,  52,   0}; return arr; } // VK_OEM_PERIOD
-		case XKB_KEY_slash:        { static unsigned char arr[3] = {191,  53,   0}; return arr; } // VK_OEM_2
-		case XKB_KEY_grave:        { static unsigned char arr[3] = {192,  41,   0}; return arr; } // VK_OEM_3
-		case XKB_KEY_bracketleft:  { static unsigned char arr[3] = {219,  26,   0}; return arr; } // VK_OEM_4
-		case XKB_KEY_backslash:    { static unsigned char arr[3] = {220,  43,   0}; return arr; } // VK_OEM_5
-		case XKB_KEY_bracketright: { static unsigned char arr[3] = {221,  27,   0}; return arr; } // VK_OEM_6
-		case XKB_KEY_apostrophe:   { static unsigned char arr[3] = {222,  40,   0}; return arr; } // VK_OEM_7
+	unsigned int hi = (unsigned int)code >> 8;
+	unsigned int row = (hi == 0x00) | ((hi == 0xFF) << 1);
+	return xkb2win_table[row][code & 0xFF];
+}
+
+// Single key event, fields are the same as in KEY_EVENT_RECORD structure
+struct win_key_event {
+	unsigned short vk;              // wVirtualKeyCode value
+	unsigned short scan;            // wVirtualScanCode value
+	unsigned short unicode;         // UnicodeChar value
+	unsigned char key_down;         // bKeyDown value
+	unsigned int control_key_state; // dwControlKeyState value
+	unsigned short repeat_count;    // wRepeatCount value
+};
+
+// Maximum length of single win32-input-mode ESC sequence:
+// ESC [ Vk ; Sc ; Uc ; Kd ; Cs ; Rc _
+// with 5 digits for each 16 bit value, 1 digit for Kd and 10 digits for Cs
+#define WIN32_INPUT_MODE_SEQ_MAX  (2 + 5 + 1 + 5 + 1 + 5 + 1 + 1 + 1 + 10 + 1 + 5 + 1)
+
+// Helper function to write decimal representation of unsigned integer
+// input:
+//   p - pointer to string buffer, should have room for 10 chars
+//   v - value to write
+// return
+//   pointer to the char next to last written one
+static inline char *xkb2win_put_uint(char *p, unsigned int v)
+{
+	char tmp[10];
+	char *t = tmp + sizeof(tmp);
+	do { *--t = (char)('0' + v % 10); v /= 10; } while (v);
+	size_t len = tmp + sizeof(tmp) - t;
+	memcpy(p, t, len);
+	return p + len;
+}
+
+// This function writes win32-input-mode ESC sequence for single key event.
+// Buffer should have room for WIN32_INPUT_MODE_SEQ_MAX chars.
+// return
+//   pointer to the char next to last written one
+static inline char *win32_input_mode_encode_one(const struct win_key_event *event, char *p)
+{
+	*p++ = '\x1b';
+	*p++ = '[';
+	p = xkb2win_put_uint(p, event->vk);                *p++ = ';';
+	p = xkb2win_put_uint(p, event->scan);              *p++ = ';';
+	p = xkb2win_put_uint(p, event->unicode);           *p++ = ';';
+	*p++ = event->key_down ? '1' : '0';                *p++ = ';';
+	p = xkb2win_put_uint(p, event->control_key_state); *p++ = ';';
+	p = xkb2win_put_uint(p, event->repeat_count);
+	*p++ = '_';
+	return p;
+}
+
+// This function writes win32-input-mode ESC sequences for array of key events
+// into single buffer, so they all can be passed to terminal with one write() call.
+// Encoding stops on first event that may not fit into the buffer,
+// buffer of count * WIN32_INPUT_MODE_SEQ_MAX chars is always enough.
+// Written sequences are not null terminated.
+// input:
+//   events - key events to encode
+//   count - number of key events
+//   buf - pointer to string buffer
+//   size - size of string buffer
+// outout:
+//   encoded - number of key events encoded, may be NULL
+// return
+//   count of bytes written
+static size_t win32_input_mode_encode(const struct win_key_event *events, size_t count,
+	char *buf, size_t size, size_t *encoded)
+{
+	char *p = buf;
+	size_t i = 0;
+	for (; i < count && (size_t)(buf + size - p) >= WIN32_INPUT_MODE_SEQ_MAX; i++) {
+		p = win32_input_mode_encode_one(&events[i], p);
 	}
+	if (encoded) { *encoded = i; }
+	return p - buf;
+}
+
+// X11 keycodes of keys that need special handling, as defined in
+// /usr/share/X11/xkb/keycodes/xfree86
+#define XKB2WIN_KEYCODE_SHIFT_L   50
+#define XKB2WIN_KEYCODE_SHIFT_R   62
+#define XKB2WIN_KEYCODE_NUMLOCK   77
+
+// Precomputed translation of single X11 keycode
+struct xkb2win_keycode {
+	xkb_keysym_t sym;  // KeySym that English keyboard layout gives for the key, Shift not pressed
+	struct winkey key; // xkb_to_winkey() result for that KeySym
+};
+
+// Translation of all X11 keycodes, first index is NumLock state (0 is off, 1 is on).
+// With it event processing needs single array read instead of keeping xkb_state
+// for English keyboard layout and querying it on every key event.
+struct xkb2win_keycode_table {
+	struct xkb2win_keycode keys[2][256];
+};
+
+// This function fills translation table by walking all keycodes of given keymap,
+// once with NumLock off and once with NumLock on.
+// Keymap should be compiled for English keyboard layout: we need X11 keycodes for it,
+// no matter what layout is actually used, to get the corresponding Windows key codes.
+// Shift is never pressed while walking, as we want KeySyms for non-alphabetic char keys
+// to be in lower case for X11-to-WinKey translations. Control and Alt are not pressed either,
+// so keys keep their own Windows key codes when they are held: Ctrl+Alt+F1..F12 is VK_F1..VK_F12
+// (not XF86Switch_VT_n with no key code), Ctrl+Alt+KP_Divide..KP_Add are VK_DIVIDE..VK_ADD,
+// Alt+Print is VK_SNAPSHOT (not Sys_Req), Ctrl+Pause is Pause (not Break).
+// Keycodes the keymap does not have are translated to all zeroes.
+// return
+//   1 on success, 0 on failure
+static int xkb2win_keycode_table_build(struct xkb2win_keycode_table *table, struct xkb_keymap *keymap)
+{
+	memset(table, 0, sizeof(*table));
 
-	static unsigned char arr[3] = {0, 0, 0};
-	return arr;
+	struct xkb_state *state = xkb_state_new(keymap);
+	if (!state) { return 0; }
+
+	xkb_keycode_t min = xkb_keymap_min_keycode(keymap);
+	xkb_keycode_t max = xkb_keymap_max_keycode(keymap);
+	if (max > 255) { max = 255; }
+
+	for (int numlock = 0; numlock < 2; numlock++) {
+		if (numlock) {
+			xkb_state_update_key(state, XKB2WIN_KEYCODE_NUMLOCK, XKB_KEY_DOWN); // simulate numlock key down
+			xkb_state_update_key(state, XKB2WIN_KEYCODE_NUMLOCK, XKB_KEY_UP);   // simulate numlock key up
+		}
+		for (xkb_keycode_t keycode = min; keycode <= max; keycode++) {
+			struct xkb2win_keycode *entry = &table->keys[numlock][keycode];
+			entry->sym = xkb_state_key_get_one_sym(state, keycode);
+			entry->key = xkb_to_winkey(entry->sym);
+		}
+	}
+
+	xkb_state_unref(state);
+	return 1;
+}
+
+// This function returns precomputed translation for X11 keycode.
+// numlock is current NumLock state: 0 is off, anything else is on.
+static inline const struct xkb2win_keycode *xkb2win_keycode_lookup(
+	const struct xkb2win_keycode_table *table, unsigned int keycode, int numlock)
+{
+	return &table->keys[numlock != 0][keycode & 0xFF];
 }
 
 // Helper function to translate UTF8 char to its integer value
@@ -186,3 +549,105 @@ int utf8_char_to_ucs2(char *utf8, wchar_t *out)
 	else
 		{ *out = 0; return 0; };       // UCS-2 can't handle code points this high; broken input?
 }
+
+// Helper function to decode single UTF8 char, validating it.
+// Overlong forms, surrogates and code points above U+10FFFF are invalid.
+// input:
+//   utf8 - pointer to string buffer
+//   len - bytes left in string buffer, at least 1
+// outout:
+//   out - code point, or U+FFFD for invalid input
+// return
+//   count of utf8 bytes decoded; for invalid input it is the length of its
+//   longest valid prefix, or 1, so decoding can continue with the next char
+static inline int utf8_char_decode(const unsigned char *utf8, size_t len, unsigned int *out)
+{
+	unsigned char c = utf8[0];
+	if (c < 0x80) {                       // 0xxxxxxx
+		*out = c;
+		return 1;
+	}
+	if (c >= 0xC2 && c <= 0xDF) {         // 110xxxxx, except overlong forms
+		if (len >= 2 && (utf8[1] & 0xC0) == 0x80) {
+			*out = ((c & 0x1F) << 6) | (utf8[1] & 0x3F);
+			return 2;
+		}
+		*out = 0xFFFD;
+		return 1;
+	}
+
+	int need;                             // count of continuation bytes
+	unsigned char lo = 0x80, hi = 0xBF;   // valid range for first continuation byte
+	if (c >= 0xE0 && c <= 0xEF)           // 1110xxxx
+		{ need = 2; if (c == 0xE0) lo = 0xA0; if (c == 0xED) hi = 0x9F; }
+	else if (c >= 0xF0 && c <= 0xF4)      // 11110xxx
+		{ need = 3; if (c == 0xF0) lo = 0x90; if (c == 0xF4) hi = 0x8F; }
+	else
+		{ *out = 0xFFFD; return 1; }
+
+	if (len < 2 || utf8[1] < lo || utf8[1] > hi) { *out = 0xFFFD; return 1; }
+	if (len < 3 || (utf8[2] & 0xC0) != 0x80) { *out = 0xFFFD; return 2; }
+	if (need == 2) {
+		*out = ((c & 0x0F) << 12) | ((utf8[1] & 0x3F) << 6) | (utf8[2] & 0x3F);
+		return 3;
+	}
+	if (len < 4 || (utf8[3] & 0xC0) != 0x80) { *out = 0xFFFD; return 3; }
+	*out = ((c & 0x07) << 18) | ((utf8[1] & 0x3F) << 12) | ((utf8[2] & 0x3F) << 6) | (utf8[3] & 0x3F);
+	return 4;
+}
+
+// This function converts UTF8 string to UTF-16, validating it.
+// Invalid input is replaced with U+FFFD chars, code points above U+FFFF
+// are written as surrogate pairs.
+// input:
+//   utf8 - pointer to string buffer, not necessarily null terminated
+//   len - length of string in bytes
+//   out_size - size of out array; out_size >= len is always enough
+// outout:
+//   out - UTF-16 code units
+//   consumed - count of utf8 bytes converted, may be NULL; less than len only if out is full
+// return
+//   count of UTF-16 code units written
+static size_t utf8_to_utf16(const char *utf8, size_t len, unsigned short *out, size_t out_size, size_t *consumed)
+{
+	const unsigned char *s = (const unsigned char *)utf8;
+	size_t i = 0, n = 0;
+	while (i < len) {
+#ifdef __SSE2__
+		// Fast path for ASCII: 16 chars at once
+		if (len - i >= 16 && out_size - n >= 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+			if (!_mm_movemask_epi8(v)) {
+				__m128i zero = _mm_setzero_si128();
+				_mm_storeu_si128((__m128i *)(out + n), _mm_unpacklo_epi8(v, zero));
+				_mm_storeu_si128((__m128i *)(out + n + 8), _mm_unpackhi_epi8(v, zero));
+				i += 16;
+				n += 16;
+				continue;
+			}
+		}
+#endif
+		// Not ASCII: decode chars one by one for the next 16 bytes before trying fast path again
+		size_t scalar_end = (len - i > 16) ? i + 16 : len;
+		int full = 0;
+		while (i < scalar_end) {
+			unsigned int cp;
+			int numread = utf8_char_decode(s + i, len - i, &cp);
+			if (cp < 0x10000) {
+				if (n >= out_size) { full = 1; break; }
+				out[n++] = (unsigned short)cp;
+			} else {
+				if (out_size - n < 2) { full = 1; break; }
+				cp -= 0x10000;
+				out[n++] = (unsigned short)(0xD800 | (cp >> 10));
+				out[n++] = (unsigned short)(0xDC00 | (cp & 0x3FF));
+			}
+			i += numread;
+		}
+		if (full) { break; }
+	}
+	if (consumed) { *consumed = i; }
+	return n;
+}
+
+#endif // XKB2WIN_C
@@ -0,0 +1,208 @@
+// https://github.com/unxed/xkb2win
+// License: CC0-1.0 license
+
+#ifndef XKB_TEXT_C
+#define XKB_TEXT_C
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
+
+#include <xkbcommon/xkbcommon.h>
+#include <xkbcommon/xkbcommon-compose.h>
+#include <xkbcommon/xkbcommon-x11.h>
+
+// Text of key events made in-process with libxkbcommon, instead of Xutf8LookupString and XIM.
+// Uses keymap user actually has (not the English one used for Windows key codes),
+// taken from X server with XKB extension, so it has changes made with xmodmap or xkbcomp.
+// Without XKB extension xkb_text can not be used (Xutf8LookupString should be used then).
+// Needs libxkbcommon-x11 and libX11-xcb.
+// Modifiers and layout group come from each X11 event's state field, so no XKB extension
+// events are needed. Dead keys and Compose key sequences are handled with compose table
+// for current locale. Input methods (IME) can not be handled this way: if one is in use,
+// Xutf8LookupString should be used instead, see xkb_text_ime_active().
+
+struct xkb_text {
+	Display *display;
+	struct xkb_context *ctx;
+	int32_t device_id;                        // XKB id of core keyboard
+	struct xkb_keymap *keymap;                // user's keymap
+	struct xkb_state *state;                  // set from each event's modifiers and group
+	struct xkb_compose_table *compose_table;  // NULL if there is no compose file for locale
+	struct xkb_compose_state *compose;        // NULL if there is no compose file for locale
+	int composed_pending;                     // composed string did not fit into buffer, lookup is repeated
+	unsigned int pending_keycode;             // KeyPress composed string is pending for
+	unsigned int pending_state;
+};
+
+// This function checks if X11 input method that is actually opened is an IME.
+// XMODIFIERS is set by most desktops whether IME is used or not, and when IM server it names
+// is not running, Xlib falls back to its built-in input method, that only does Compose
+// sequences (as xkb_text does) and has no preedit styles. IM servers have them.
+// input:
+//   im - XOpenIM() result, may be NULL
+// return
+//   1 if text should be taken from input method, 0 if xkb_text can be used
+static int xkb_text_ime_active(XIM im)
+{
+	XIMStyles *styles = NULL;
+	if (!im || XGetIMValues(im, XNQueryInputStyle, &styles, NULL) || !styles) { return 0; }
+	int active = 0;
+	for (unsigned short i = 0; i < styles->count_styles; i++) {
+		if (styles->supported_styles[i] & (XIMPreeditArea | XIMPreeditCallbacks | XIMPreeditPosition)) { active = 1; }
+	}
+	XFree(styles);
+	return active;
+}
+
+// This function takes user's keymap from X server again, should be called on MappingNotify
+// (keyboard layouts were changed with setxkbmap, xmodmap or desktop settings).
+// return
+//   1 on success, 0 on failure (old keymap is left in use)
+static int xkb_text_reload(struct xkb_text *text)
+{
+	struct xkb_keymap *keymap = xkb_x11_keymap_new_from_device(text->ctx, XGetXCBConnection(text->display),
+		text->device_id, XKB_KEYMAP_COMPILE_NO_FLAGS);
+	struct xkb_state *state = keymap ? xkb_state_new(keymap) : NULL;
+	if (!state) {
+		if (keymap) { xkb_keymap_unref(keymap); }
+		return 0;
+	}
+	if (text->state) { xkb_state_unref(text->state); }
+	if (text->keymap) { xkb_keymap_unref(text->keymap); }
+	text->keymap = keymap;
+	text->state = state;
+	if (text->compose) { xkb_compose_state_reset(text->compose); }
+	text->composed_pending = 0;
+	return 1;
+}
+
+static void xkb_text_free(struct xkb_text *text)
+{
+	if (text->compose) { xkb_compose_state_unref(text->compose); }
+	if (text->compose_table) { xkb_compose_table_unref(text->compose_table); }
+	if (text->state) { xkb_state_unref(text->state); }
+	if (text->keymap) { xkb_keymap_unref(text->keymap); }
+	if (text->ctx) { xkb_context_unref(text->ctx); }
+	memset(text, 0, sizeof(*text));
+}
+
+// return
+//   1 on success, 0 if X server has no XKB extension or keymap can not be taken from it
+static int xkb_text_init(struct xkb_text *text, Display *display)
+{
+	memset(text, 0, sizeof(*text));
+	text->display = display;
+	xcb_connection_t *connection = XGetXCBConnection(display);
+	if (!xkb_x11_setup_xkb_extension(connection, XKB_X11_MIN_MAJOR_XKB_VERSION, XKB_X11_MIN_MINOR_XKB_VERSION,
+		XKB_X11_SETUP_XKB_EXTENSION_NO_FLAGS, NULL, NULL, NULL, NULL)) {
+		return 0;
+	}
+	text->device_id = xkb_x11_get_core_keyboard_device_id(connection);
+	text->ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	if (text->device_id < 0 || !text->ctx || !xkb_text_reload(text)) {
+		xkb_text_free(text);
+		return 0;
+	}
+
+	// Same locale lookup order as setlocale() has; works without compose table if there is none
+	const char *locale = getenv("LC_ALL");
+	if (!locale || !*locale) { locale = getenv("LC_CTYPE"); }
+	if (!locale || !*locale) { locale = getenv("LANG"); }
+	if (!locale || !*locale) { locale = "C"; }
+	text->compose_table = xkb_compose_table_new_from_locale(text->ctx, locale, XKB_COMPOSE_COMPILE_NO_FLAGS);
+	if (text->compose_table) {
+		text->compose = xkb_compose_state_new(text->compose_table, XKB_COMPOSE_STATE_NO_FLAGS);
+	}
+	return 1;
+}
+
+// return
+//   1 if Dead key or Compose key sequence is in progress, then next KeyPress can give different text
+//   than the same KeyPress would give otherwise
+static int xkb_text_composing(const struct xkb_text *text)
+{
+	return text->compose && xkb_compose_state_get_status(text->compose) != XKB_COMPOSE_NOTHING;
+}
+
+// This function drops composed string that did not fit into buffer, if caller
+// does not repeat lookup with larger buffer (see xkb_text_lookup()).
+static void xkb_text_discard(struct xkb_text *text)
+{
+	if (!text->composed_pending) { return; }
+	xkb_compose_state_reset(text->compose);
+	text->composed_pending = 0;
+}
+
+// This function gets UTF-8 string for key event, as Xutf8LookupString does.
+// Dead keys and Compose key sequences give empty string until they are finished,
+// KeyRelease always gives empty string, as with X input method.
+// input:
+//   keycode - X11 keycode of the key
+//   key_down - 1 for KeyPress, 0 for KeyRelease
+//   state - X11 modifiers mask from the event, with layout group in bits 13-14
+//   size - size of buf
+// outout:
+//   buf - null terminated UTF-8 string, if it fits
+// return
+//   length of UTF-8 string without terminating null; if it is not less than size,
+//   string did not fit and function should be called again for the same event with larger buffer,
+//   or xkb_text_discard() should be called; lookup for other event discards it too
+static int xkb_text_lookup(struct xkb_text *text, unsigned int keycode, int key_down, unsigned int state,
+	char *buf, size_t size)
+{
+	// X11 core modifiers are the first 8 modifiers of xkbcommon keymap, in the same order.
+	// Locks are passed as depressed too: only effective modifiers matter for lookup
+	xkb_state_update_mask(text->state, state & 0xFF, 0, 0, (state >> 13) & 3, 0, 0);
+
+	// Repeated lookup of the same event, with larger buffer
+	if (text->composed_pending && (!key_down || keycode != text->pending_keycode || state != text->pending_state)) {
+		xkb_text_discard(text);
+	}
+	if (text->composed_pending) {
+		int len = xkb_compose_state_get_utf8(text->compose, buf, size);
+		if (len < (int)size) {
+			xkb_compose_state_reset(text->compose);
+			text->composed_pending = 0;
+		}
+		return len;
+	}
+
+	if (!key_down) {
+		if (size) { buf[0] = 0; }
+		return 0;
+	}
+
+	if (text->compose) {
+		xkb_keysym_t sym = xkb_state_key_get_one_sym(text->state, keycode);
+		if (xkb_compose_state_feed(text->compose, sym) == XKB_COMPOSE_FEED_ACCEPTED) {
+			switch (xkb_compose_state_get_status(text->compose)) {
+			case XKB_COMPOSE_COMPOSING:
+				if (size) { buf[0] = 0; }
+				return 0;
+			case XKB_COMPOSE_COMPOSED: {
+				int len = xkb_compose_state_get_utf8(text->compose, buf, size);
+				if (len < (int)size) { xkb_compose_state_reset(text->compose); }
+				else {
+					text->composed_pending = 1;
+					text->pending_keycode = keycode;
+					text->pending_state = state;
+				}
+				return len;
+			}
+			case XKB_COMPOSE_CANCELLED:
+				xkb_compose_state_reset(text->compose);
+				if (size) { buf[0] = 0; }
+				return 0;
+			case XKB_COMPOSE_NOTHING:
+				break;
+			}
+		}
+	}
+
+	return xkb_state_key_get_utf8(text->state, keycode, buf, size);
+}
+
+#endif // XKB_TEXT_C